@@ -0,0 +1,107 @@
+#!/usr/bin/env ruby
+
+# Compares two results files written by run.rb:
+#
+#   compare.rb [--threshold PERCENT] old.json new.json
+#
+# prints each model's times, peak RSS and triangle count side by side, and
+# exits with status 1 if any time or peak RSS grew by more than the
+# threshold (10% by default). times under MIN_TIME are too noisy to count.
+
+require 'optparse'
+require 'json'
+
+
+threshold = 10.0
+
+OptionParser.new do |opts|
+  opts.banner = "Usage: compare.rb [options] old.json new.json"
+
+  opts.on("-t", "--threshold PERCENT", Float,
+          "report increases over PERCENT as regressions") do |percent|
+    threshold = percent
+  end
+end.parse!
+
+if ARGV.size != 2
+  $stderr.puts "expected 2 results files"
+  exit 2
+end
+
+MIN_TIME = 0.05
+
+old_report, new_report = ARGV.map do |path|
+  JSON.parse(File.read(path), symbolize_names: true)
+end
+
+def format_value(metric, value)
+  return "-" if value.nil?
+
+  case metric
+  when :peak_rss
+    sprintf("%.0f MB", value / 1024.0 / 1024.0)
+  when :triangles
+    value.to_i.to_s
+  else
+    sprintf("%.3fs", value)
+  end
+end
+
+def metrics(result)
+  values = { wall: result[:wall] }
+  (result[:phases] || {}).each { |phase, time| values[phase] = time }
+  values[:peak_rss] = result[:peak_rss]
+  values[:triangles] = result[:triangles]
+  values
+end
+
+printf("%s (%s) -> %s (%s)\n\n",
+       old_report[:commit] || "?", old_report[:date],
+       new_report[:commit] || "?", new_report[:date])
+printf("%-20s %-10s %12s %12s %9s\n", "model", "metric", "old", "new",
+       "change")
+
+regressions = []
+models = old_report[:models].keys | new_report[:models].keys
+models.each do |model|
+  old_result = old_report[:models][model]
+  new_result = new_report[:models][model]
+
+  if old_result.nil? || new_result.nil?
+    printf("%-20s only in %s\n", model, old_result ? "old" : "new")
+    next
+  end
+
+  if new_result[:status] != "ok"
+    printf("%-20s failed: %s\n", model, new_result[:error])
+    regressions << "#{model} failed" if old_result[:status] == "ok"
+    next
+  end
+
+  old_metrics = metrics(old_result)
+  metrics(new_result).each do |metric, new_value|
+    old_value = old_metrics[metric]
+    next if new_value.nil? || old_value.nil?
+
+    change =
+      old_value.zero? ? 0.0 : (new_value - old_value) * 100.0 / old_value
+    mark = ""
+
+    if metric == :triangles
+      mark = " (output changed)" if new_value != old_value
+    elsif change > threshold &&
+          (metric == :peak_rss || new_value - old_value >= MIN_TIME)
+      mark = " REGRESSION"
+      regressions << "#{model} #{metric}"
+    end
+
+    printf("%-20s %-10s %12s %12s %+8.1f%%%s\n", model, metric,
+           format_value(metric, old_value), format_value(metric, new_value),
+           change, mark)
+  end
+end
+
+unless regressions.empty?
+  printf("\n%d regression(s): %s\n", regressions.size, regressions.join(", "))
+  exit 1
+end
@@ -0,0 +1,59 @@
+require 'tmpdir'
+
+# input files that models read. run.rb generates them before timing any
+# model, so that a model's build phase only measures building its shape.
+module BenchFixtures
+  SPHERE_RADIUS = 30
+  SPHERE_RINGS = 256
+  SPHERE_SEGMENTS = 512
+
+  # a binary STL sphere, named by its parameters. it's written again if
+  # it doesn't have the size they give, e.g. if an earlier run was
+  # interrupted while writing it.
+  def BenchFixtures.sphere_stl
+    path = File.join(Dir.tmpdir, sprintf("rcad-bench-sphere-%d-%d-%d.stl",
+      SPHERE_RADIUS, SPHERE_RINGS, SPHERE_SEGMENTS))
+    expected_size = 84 + 50 * 2 * SPHERE_RINGS * SPHERE_SEGMENTS
+
+    unless File.exist?(path) && File.size(path) == expected_size
+      # written under a temporary name, so that other runs never see it
+      # half-written
+      tmp_path = sprintf("%s.%d.tmp", path, Process.pid)
+      write_sphere_stl(tmp_path, SPHERE_RADIUS, SPHERE_RINGS, SPHERE_SEGMENTS)
+      File.rename(tmp_path, path)
+    end
+
+    path
+  end
+
+  def BenchFixtures.prepare
+    sphere_stl
+  end
+
+  # writes a binary STL sphere with 2 * rings * segments triangles
+  def BenchFixtures.write_sphere_stl(path, radius, rings, segments)
+    point = lambda do |ring, segment|
+      theta = Math::PI * ring / rings
+      phi = 2 * Math::PI * segment / segments
+      [radius * Math.sin(theta) * Math.cos(phi),
+       radius * Math.sin(theta) * Math.sin(phi),
+       radius * Math.cos(theta)]
+    end
+
+    triangles = []
+    rings.times do |i|
+      segments.times do |j|
+        a, b = point.(i, j), point.(i, j + 1)
+        c, d = point.(i + 1, j + 1), point.(i + 1, j)
+        triangles << [a, d, c] << [a, c, b]
+      end
+    end
+
+    File.open(path, "wb") do |file|
+      file.write(["bench sphere".ljust(80), triangles.size].pack("a80V"))
+      triangles.each do |corners|
+        file.write(([0, 0, 0] + corners.flatten).pack("e12") + "\0\0")
+      end
+    end
+  end
+end
@@ -0,0 +1,4 @@
+require 'rcad/gears'
+
+# 60 teeth, swept along a twisted spine
+~HelicalGear.new(pitch_dia: 60, module: 1, h: 15)
@@ -0,0 +1,4 @@
+require 'rcad/gears'
+
+# 60 teeth: two opposite twisted sweeps, fused
+~HerringboneGear.new(pitch_dia: 60, module: 1, h: 20)
@@ -0,0 +1,12 @@
+require 'rcad'
+
+# 400 holes cut from a plate by a single Difference
+~sub do
+  ~box(210, 210, 5)
+
+  20.times do |i|
+    20.times do |j|
+      ~cylinder(d: 6, h: 7).move(10 + 10 * i, 10 + 10 * j, -1)
+    end
+  end
+end
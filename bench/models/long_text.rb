@@ -0,0 +1,5 @@
+require 'rcad'
+
+# a serial-number plate's worth of characters
+serial = (1..40).map { |i| format("SN-%06d", i * 7919) }.join(" ")
+~text(serial, font_size: 6).extrude(2)
@@ -0,0 +1,45 @@
+require 'rcad'
+
+# the mesh engine's degenerate cases, side by side: coplanar faces, and cuts
+# through shared edges and vertices. each raises if its result leaks.
+~add(engine: :mesh) do
+  # stacked boxes, sharing a whole face
+  ~add(engine: :mesh) do
+    ~box(10, 10, 10)
+    ~box(10, 10, 10).move_z(10)
+  end
+
+  # side by side, sharing a face and two edges with their top and bottom
+  ~add(engine: :mesh) do
+    ~box(10, 10, 10)
+    ~box(10, 5, 10).move_x(10)
+  end.move_x(30)
+
+  # a notch whose faces are flush with three of the box's, and whose
+  # corner is one of the box's
+  ~sub(engine: :mesh) do
+    ~box(10, 10, 10)
+    ~box(5, 5, 5).move(5, 5, 5)
+  end.move_x(60)
+
+  # a slot flush with the top face, running out of both sides
+  ~sub(engine: :mesh) do
+    ~box(10, 10, 10)
+    ~box(2, 10, 4).move(4, 0, 6)
+  end.move_x(90)
+
+  # a cut along x + y = 10, through two of the box's vertical edges
+  ~sub(engine: :mesh) do
+    ~box(10, 10, 10)
+    ~polygon([[11, -1], [12, -1], [12, 12], [-1, 12], [-1, 11]])
+      .extrude(12)
+      .move_z(-1)
+  end.move_x(120)
+
+  # spheres whose poles touch the box's top and side
+  ~add(engine: :mesh) do
+    ~box(10, 10, 10)
+    ~sphere(d: 6).move(5, 5, 13)
+    ~sphere(d: 6).rot_y(Math::PI / 2).move(-3, 5, 5)
+  end.move_x(150)
+end
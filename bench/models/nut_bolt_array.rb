@@ -0,0 +1,5 @@
+require 'rcad/nuts'
+
+# a 10x10 grid each of nuts and bolts, as patterns
+~pattern(pattern(HexNut.new(3), 10, x: 8), 10, y: 8)
+~pattern(pattern(Bolt.new(3, 12), 10, x: 8), 10, y: 8).move_z(-5)
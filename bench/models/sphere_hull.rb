@@ -0,0 +1,14 @@
+require 'rcad'
+
+# rounded box: the hull of a sphere at each corner
+class SphereHull < Shape
+  def render
+    hull do
+      [0, 40].product([0, 30], [0, 20]).each do |x, y, z|
+        ~sphere(d: 10).move(x, y, z)
+      end
+    end
+  end
+end
+
+~SphereHull.new
@@ -0,0 +1,4 @@
+require 'rcad/gears'
+
+# 120 teeth, extruded straight
+~SpurGear.new(pitch_dia: 120, module: 1, h: 10)
@@ -0,0 +1,27 @@
+require 'rcad'
+require_relative '../fixtures'
+
+# a scanned-looking part: a finely tessellated sphere read from STL, with
+# mounting holes cut into it
+class StlPart < Shape
+  attr_reader :path
+
+  def initialize(path)
+    @path = path
+  end
+
+  def render
+    Shape.from_stl(path)
+  end
+end
+
+~sub do
+  ~StlPart.new(BenchFixtures.sphere_stl)
+
+  4.times do |i|
+    ~cylinder(d: 5, h: 80)
+      .move_z(-40)
+      .rot_x(Math::PI / 2)
+      .rot_z(i * Math::PI / 4)
+  end
+end
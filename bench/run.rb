@@ -0,0 +1,227 @@
+#!/usr/bin/env ruby
+
+# Renders each model in bench/models in its own process, and writes the
+# timings as JSON. compare.rb compares two such files.
+#
+# Phases are:
+# * build: loading the script, which builds the shape tree. input files
+#   that models read are generated beforehand (see fixtures.rb).
+# * bbox: the shape's bounding box
+# * render: rendering and exporting it to STL, split by the profiler into
+#   plan, booleans, extrusion, hull, import, text, meshing, export and other
+#   (everything else, including profiler categories with no phase of their
+#   own). these are summed over render threads, so can add up to more than
+#   render's wall time.
+
+require 'optparse'
+require 'json'
+require 'time'
+require 'tmpdir'
+require 'rcad'
+require_relative 'fixtures'
+
+
+options = {
+  repeat: 1,
+  models: nil,
+  output: nil,
+}
+
+OptionParser.new do |opts|
+  opts.banner = "Usage: run.rb [options]"
+
+  opts.on("-n", "--repeat N", Integer,
+          "render each model N times, and report medians") do |n|
+    options[:repeat] = [n, 1].max
+  end
+
+  opts.on("-m", "--models A,B", Array,
+          "only run these models (by file name, without .rb)") do |models|
+    options[:models] = models
+  end
+
+  opts.on("-o", "--output FILE", "write results to FILE") do |path|
+    options[:output] = path
+  end
+end.parse!
+
+
+MODELS_DIR = File.join(__dir__, "models")
+
+# profiler categories reported as phases, and the phase names they're
+# reported under. any other category is reported under other.
+PHASE_CATEGORIES = {
+  "plan" => :plan,
+  "boolean" => :booleans,
+  "extrusion" => :extrusion,
+  "hull" => :hull,
+  "import" => :import,
+  "text" => :text,
+  "meshing" => :meshing,
+  "export" => :export,
+  "shape" => :other,
+}
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def peak_rss
+  File.foreach("/proc/self/status") do |line|
+    return line.split[1].to_i * 1024 if line.start_with?("VmHWM:")
+  end
+  nil
+rescue SystemCallError
+  nil
+end
+
+def stl_triangle_count(path)
+  File.open(path, "rb") do |file|
+    file.seek(80)
+    file.read(4).unpack("V")[0]
+  end
+end
+
+# runs in a child process, so each model starts from a clean slate
+def measure(model_path, output_path)
+  # measure rendering, not the cache
+  $render_cache = nil
+
+  result = { status: "ok" }
+  phases = {}
+
+  Profiler.start
+  begin
+    start = now
+    load(model_path, true)
+    phases[:build] = now - start
+    fail "model didn't add a shape" if $shape.nil?
+
+    start = now
+    $shape.bbox
+    phases[:bbox] = now - start
+
+    start = now
+    $shape.write_stl(output_path)
+    phases[:render] = now - start
+  rescue StandardError, ScriptError => e
+    result[:status] = "failed"
+    result[:error] = sprintf("%s: %s", e.class, e.message)
+  ensure
+    Profiler.stop
+  end
+
+  PHASE_CATEGORIES.each_value { |phase| phases[phase] = 0.0 }
+  Profiler.events.each do |event|
+    phase = PHASE_CATEGORIES.fetch(event.category, :other)
+    phases[phase] += event.self_wall / 1e6
+  end
+
+  result[:wall] =
+    phases.values_at(:build, :bbox, :render).compact.reduce(0, :+)
+  result[:phases] = phases
+  result[:peak_rss] = peak_rss
+  if result[:status] == "ok"
+    result[:triangles] = stl_triangle_count(output_path)
+  end
+
+  result
+end
+
+def run_model(model_path)
+  reader, writer = IO.pipe
+  output_path = File.join(Dir.tmpdir,
+    sprintf("rcad-bench-%d-%s.stl", Process.pid,
+            File.basename(model_path, ".rb")))
+
+  pid = fork do
+    reader.close
+    result = measure(model_path, output_path)
+    writer.write(JSON.generate(result))
+    writer.close
+
+    # skip at_exit handlers, which would render $shape again
+    exit!(0)
+  end
+
+  writer.close
+  output = reader.read
+  reader.close
+  _, status = Process.wait2(pid)
+  File.delete(output_path) if File.exist?(output_path)
+
+  if output.empty?
+    { status: "failed", error: sprintf("worker exited with %s", status) }
+  else
+    JSON.parse(output, symbolize_names: true)
+  end
+end
+
+def median(values)
+  sorted = values.sort
+  mid = sorted.size / 2
+  sorted.size.odd? ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2.0
+end
+
+# medians of each number over runs that succeeded
+def combine_runs(runs)
+  ok = runs.select { |run| run[:status] == "ok" }
+  return runs.last if ok.empty?
+
+  combined = ok.first.dup
+  [:wall, :peak_rss, :triangles].each do |key|
+    combined[key] = median(ok.map { |run| run[key] })
+  end
+
+  combined[:phases] = ok.first[:phases].keys.map do |phase|
+    [phase, median(ok.map { |run| run[:phases][phase] })]
+  end.to_h
+
+  combined[:runs] = runs.size
+  combined
+end
+
+
+model_paths = Dir.glob(File.join(MODELS_DIR, "*.rb")).sort
+if options[:models]
+  model_paths.select! do |path|
+    options[:models].include?(File.basename(path, ".rb"))
+  end
+end
+
+BenchFixtures.prepare
+
+results = {}
+model_paths.each do |path|
+  name = File.basename(path, ".rb")
+  $stdout.printf("%-20s ", name)
+  $stdout.flush
+
+  result = combine_runs((1..options[:repeat]).map { run_model(path) })
+  results[name] = result
+
+  if result[:status] == "ok"
+    $stdout.printf("%8.2fs  %8d triangles  %6d MB\n", result[:wall],
+                   result[:triangles], result[:peak_rss].to_i / 1024 / 1024)
+  else
+    $stdout.printf("failed: %s\n", result[:error])
+  end
+end
+
+commit = `git -C #{__dir__} rev-parse --short HEAD 2>/dev/null`.strip
+report = {
+  commit: commit.empty? ? nil : commit,
+  date: Time.now.iso8601,
+  ruby: RUBY_VERSION,
+  render_threads: $render_threads,
+  repeat: options[:repeat],
+  models: results,
+}
+
+output = options[:output] ||
+  File.join(__dir__, "results", (commit.empty? ? "latest" : commit) + ".json")
+Dir.mkdir(File.dirname(output)) unless Dir.exist?(File.dirname(output))
+File.write(output, JSON.pretty_generate(report))
+puts "wrote #{output}"
+
+exit(results.values.any? { |result| result[:status] != "ok" } ? 1 : 0)
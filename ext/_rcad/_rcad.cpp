@@ -1,15 +1,55 @@
 #include <sstream>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <algorithm>
+#include <cstdarg>
+#include <exception>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <cmath>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gp_Pnt2d.hxx>
 #include <gp_Pnt.hxx>
 #include <gp_Vec.hxx>
 #include <gp_Circ.hxx>
+#include <gp_Pln.hxx>
+#include <TColgp_Array1OfPnt.hxx>
 #include <TColgp_Array1OfPnt2d.hxx>
 #include <TColgp_Array2OfPnt.hxx>
+#include <TColgp_HArray1OfPnt.hxx>
+#include <TColStd_Array1OfInteger.hxx>
+#include <TColStd_Array2OfReal.hxx>
+#include <TColStd_HArray1OfReal.hxx>
 #include <Poly_Triangulation.hxx>
-#include <Geom_BezierSurface.hxx>
+#include <Poly_PolygonOnTriangulation.hxx>
+#include <Geom_BSplineSurface.hxx>
+#include <Geom_BezierCurve.hxx>
+#include <Geom_BSplineCurve.hxx>
+#include <Geom_TrimmedCurve.hxx>
+#include <Geom_Plane.hxx>
 #include <Geom_Circle.hxx>
 #include <Geom2d_BezierCurve.hxx>
-#include <GCE2d_MakeSegment.hxx>
+#include <Geom2d_Line.hxx>
+#include <GeomAPI.hxx>
+#include <GeomAPI_Interpolate.hxx>
+#include <GeomConvert.hxx>
 #include <TopoDS.hxx>
 #include <BRepPrimAPI_MakeBox.hxx>
 #include <BRepPrimAPI_MakeCone.hxx>
@@ -18,36 +58,54 @@
 #include <BRepPrimAPI_MakeTorus.hxx>
 #include <BRepPrimAPI_MakePrism.hxx>
 #include <BRepPrimAPI_MakeRevol.hxx>
-#include <BRepOffsetAPI_MakePipeShell.hxx>
-#include <BRepAlgoAPI_Fuse.hxx>
-#include <BRepAlgoAPI_Cut.hxx>
-#include <BRepAlgoAPI_Common.hxx>
-#include <BRepAlgoAPI_Common.hxx>
+#include <BOPAlgo_PaveFiller.hxx>
+#include <BOPAlgo_BOP.hxx>
+#include <BOPCol_ListOfShape.hxx>
 #include <BRepBuilderAPI_MakeEdge.hxx>
 #include <BRepBuilderAPI_MakeEdge2d.hxx>
 #include <BRepBuilderAPI_MakeWire.hxx>
-#include <BRepBuilderAPI_MakePolygon.hxx>
+#include <BRepBuilderAPI_MakeVertex.hxx>
 #include <BRepBuilderAPI_MakeFace.hxx>
 #include <BRepBuilderAPI_MakeSolid.hxx>
 #include <BRepBuilderAPI_Transform.hxx>
 #include <BRepBuilderAPI_GTransform.hxx>
-#include <BRepBuilderAPI_Sewing.hxx>
+#include <BRepBuilderAPI_Copy.hxx>
 #include <BRepClass3d_SolidClassifier.hxx>
 #include <BRepTopAdaptor_FClass2d.hxx>
 #include <BRepMesh_IncrementalMesh.hxx>
 #include <BRepBndLib.hxx>
-#include <StlAPI_Reader.hxx>
-#include <StlAPI_Writer.hxx>
+#include <BRepAdaptor_Surface.hxx>
+#include <BRepAdaptor_Curve.hxx>
+#include <ElSLib.hxx>
+#include <GCPnts_TangentialDeflection.hxx>
+#include <TopExp.hxx>
+#include <TopoDS_Iterator.hxx>
+#include <TopTools_IndexedMapOfShape.hxx>
+#include <TopTools_MapOfShape.hxx>
+#include <TopTools_IndexedDataMapOfShapeListOfShape.hxx>
+#include <TopTools_ListIteratorOfListOfShape.hxx>
+#include <BRepTools.hxx>
+#include <Standard.hxx>
 #include <Standard_Failure.hxx>
 #include <rice/Class.hpp>
 #include <rice/Exception.hpp>
 #include <rice/Array.hpp>
 #include <rice/global_function.hpp>
+#include <rice/protect.hpp>
+#include <ruby/thread.h>
+#include <zlib.h>
 
 extern "C" {
-#include <qhull/qhull_a.h>
+#include <libqhull_r/qhull_ra.h>
 }
 
+#ifdef HAVE_FREETYPE
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+#include <fontconfig/fontconfig.h>
+#endif
+
 
 using namespace Rice;
 
@@ -176,11 +234,100 @@ static Standard_Real get_tolerance()
 }
 
 
+struct WithoutGvlCall
+{
+    std::function<void ()> func;
+    bool ran;
+    std::exception_ptr error;
+};
+
+static void *without_gvl_call(void *data)
+{
+    WithoutGvlCall *call = static_cast<WithoutGvlCall *>(data);
+    call->ran = true;
+
+    try {
+        call->func();
+    } catch (...) {
+        // C++ exceptions mustn't unwind through Ruby's frames
+        call->error = std::current_exception();
+    }
+
+    return NULL;
+}
+
+static VALUE check_interrupts(VALUE)
+{
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+// runs func without holding the GVL, so that other Ruby threads can run
+// meanwhile. func mustn't touch any Ruby objects, so convert everything it
+// needs beforehand. if given, ubf is called (without the GVL) when the
+// thread is interrupted, and should make func return early.
+//
+// exceptions thrown by func are rethrown here, after any pending interrupt
+// (e.g. Thread#raise, or Ctrl-C) has been raised.
+static void without_gvl(std::function<void ()> func,
+    rb_unblock_function_t *ubf = NULL, void *ubf_data = NULL)
+{
+    WithoutGvlCall call;
+    call.func = func;
+    call.ran = false;
+
+    rb_thread_call_without_gvl2(without_gvl_call, &call, ubf, ubf_data);
+
+    protect(check_interrupts, Qnil);
+
+    if (call.error) {
+        std::rethrow_exception(call.error);
+    } else if (!call.ran) {
+        Standard_Failure::Raise("interrupted");
+    }
+}
+
+
 static TopoDS_Shape rendered_shape__reversed(TopoDS_Shape self)
 {
     return self.Oriented(TopAbs_REVERSED);
 }
 
+// BREP files keep the exact geometry, plus mesh shapes' triangles
+static void rendered_shape__write_brep(TopoDS_Shape self, String path)
+{
+    const std::string path_str = path.str();
+
+    bool ok;
+    without_gvl([&] {
+        ok = BRepTools::Write(self, path_str.c_str());
+    });
+
+    if (!ok) {
+        throw Exception(rb_cOCEError,
+            "failed writing BREP file %s", path_str.c_str());
+    }
+}
+
+static TopoDS_Shape rendered_shape__read_brep(String path)
+{
+    const std::string path_str = path.str();
+
+    TopoDS_Shape shape;
+    bool ok;
+    without_gvl([&] {
+        BRep_Builder builder;
+        ok = BRepTools::Read(shape, path_str.c_str(), builder);
+    });
+
+    if (!ok) {
+        throw Exception(rb_cOCEError,
+            "failed reading BREP file %s", path_str.c_str());
+    }
+
+    return shape;
+}
+
 
 static String transform_to_s(gp_GTrsf self)
 {
@@ -286,33 +433,21 @@ static gp_GTrsf transform_inverse(gp_GTrsf self)
 }
 
 
-static Data_Object<TopoDS_Shape> render_shape(Object shape)
+// throws an OCE exception, which is translated to OCEError when it reaches
+// Ruby. unlike Rice exceptions, these can be thrown from render threads.
+static void raise_oce_error(const char *format, ...)
 {
-    if (shape.is_a(rb_cRenderedShape)) {
-        return shape;
-    }
-
-    if (!shape.is_a(rb_cShape)) {
-        String shape_str = shape.to_s();
-        throw Exception(rb_eArgError,
-            "attempt to render %s which is not a Shape",
-            shape_str.c_str());
-    }
-
-    while (shape.is_a(rb_cShape)) {
-        shape = shape.call("render");
-    }
+    char message[1024];
 
-    if (!shape.is_a(rb_cRenderedShape)) {
-        String shape_str = shape.to_s();
-        throw Exception(rb_eArgError,
-            "render returned %s instead of a rendered shape",
-            shape_str.c_str());
-    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
 
-    return shape;
+    Standard_Failure::Raise(message);
 }
 
+
 // TODO: better to just put things in a Data_Object to begin with, than to
 // allocate them twice
 static Object wrap_rendered_shape(const TopoDS_Shape &shape)
@@ -320,589 +455,6342 @@ static Object wrap_rendered_shape(const TopoDS_Shape &shape)
     return Data_Object<TopoDS_Shape>(new TopoDS_Shape(shape));
 }
 
-void shape_write_stl(Object self, String path)
+// returns the key to store a shape's rendering under in $render_cache, or
+// nil if it shouldn't be cached
+static Object get_render_cache_key(Object render_key)
 {
-    Data_Object<TopoDS_Shape> shape = render_shape(self);
+    Object cache(rb_gv_get("$render_cache"));
+    if (cache.is_nil() || render_key.is_nil()) {
+        return Object(Qnil);
+    }
 
-    StlAPI_Writer writer;
-    writer.ASCIIMode() = false;
-    writer.RelativeMode() = false;
-    writer.SetDeflection(get_tolerance());
-    writer.Write(*shape, path.c_str());
+    // rendered shapes are approximated according to $tol, so it's part of
+    // the key too
+    Array cache_key;
+    cache_key.push(render_key);
+    cache_key.push(get_tolerance());
+    return cache_key;
 }
 
-Object shape__bbox(Object self)
+// number of threads to render with, from $render_threads. nil means one
+// thread per core.
+static size_t get_render_threads()
 {
-    Data_Object<TopoDS_Shape> shape = render_shape(self);
-
-    Standard_Real minXYZ[3];
-    Standard_Real maxXYZ[3];
-    Bnd_Box bbox;
-    BRepBndLib::Add(*shape, bbox);
-    bbox.Get(
-        minXYZ[0], minXYZ[1], minXYZ[2],
-        maxXYZ[0], maxXYZ[1], maxXYZ[2]);
-
-    const Standard_Real gap = bbox.GetGap();
-    for (int i = 0; i < 3; ++i) {
-        minXYZ[i] += gap;
-        maxXYZ[i] -= gap;
+    Object threads(rb_gv_get("$render_threads"));
+    if (!threads.is_nil()) {
+        return std::max(1, from_ruby<int>(threads));
     }
 
-    Array res;
-    res.push(Array(minXYZ));
-    res.push(Array(maxXYZ));
-    return res;
+    return std::max(1u, std::thread::hardware_concurrency());
 }
 
 
-Object shape_from_stl(String path)
-{
-    TopoDS_Shape shape;
-    StlAPI_Reader reader;
-    reader.Read(shape, path.c_str());
-    return wrap_rendered_shape(shape);
-}
-
+// Profiling, enabled by Profiler.start. rendering each Shape node, and the
+// expensive steps within it (booleans, sweeps, meshing, hulls, imports and
+// exports), are recorded as ProfileScopes. a scope's path is the classes of
+// the shape tree from the root down to its node, then the steps it's nested
+// in, separated by ';'.
 
-Object transformed_shape_render(Object self)
+struct ProfileEvent
 {
-    gp_GTrsf transform = from_ruby<gp_GTrsf>(self.iv_get("@trsf"));
-
-    Object shape = self.iv_get("@shape");
-    Data_Object<TopoDS_Shape> rendered = render_shape(shape);
-
-    return wrap_rendered_shape(
-        BRepBuilderAPI_GTransform(*rendered, transform, Standard_True).Shape());
-}
+    std::string path;
+    const char *category;
+    size_t thread;
+    // in microseconds since profiling started
+    double start;
+    double wall;
+    // wall time not spent in nested scopes
+    double self_wall;
+    // CPU time of the scope's thread
+    double cpu;
+    // change in the whole process's resident memory, in bytes
+    long memory_delta;
+    // of the scope's result, or -1 if it has none
+    int faces;
+    int edges;
+};
 
-static TopoDS_Wire make_wire_from_path(Array points, Array path)
+class ProfileLog
 {
-    BRepBuilderAPI_MakeWire wire_maker;
-
-    for (size_t i = 0; i < path.size(); ++i) {
-        const size_t j = (i + 1) % path.size();
-
-        const size_t p1_idx = from_ruby<size_t>(path[i]);
-        const size_t p2_idx = from_ruby<size_t>(path[j]);
-
-        gp_Pnt gp_p1(from_ruby<gp_Pnt>(points[p1_idx]));
-        gp_Pnt gp_p2(from_ruby<gp_Pnt>(points[p2_idx]));
+public:
+    ProfileLog()
+        : is_enabled(false)
+    {
+    }
 
-        wire_maker.Add(BRepBuilderAPI_MakeEdge(gp_p1, gp_p2).Edge());
+    bool enabled() const
+    {
+        return is_enabled.load(std::memory_order_relaxed);
     }
 
-    return wire_maker.Wire();
-}
+    // clears the previous events
+    void start();
+    void stop();
 
-Object polygon_render(Object self)
-{
-    const Array points = self.iv_get("@points");
-    const Array paths = self.iv_get("@paths");
+    void record(ProfileEvent &event);
+    std::vector<ProfileEvent> events();
 
-    if (paths.size() == 0) {
-        throw Exception(rb_eArgError,
-            "Polygon must have at least 1 path!");
+    double now() const
+    {
+        return std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - origin).count();
     }
 
-    BRepBuilderAPI_MakeFace face_maker(
-        make_wire_from_path(points, paths[0]));
-    for (size_t i = 1; i < paths.size(); ++i) {
-        TopoDS_Wire wire = make_wire_from_path(points, paths[i]);
-
-        // all paths except the first are inner loops,
-        // so they should be reversed
-        face_maker.Add(TopoDS::Wire(wire.Oriented(TopAbs_REVERSED)));
-    }
+private:
+    std::atomic<bool> is_enabled;
+    std::chrono::steady_clock::time_point origin;
 
-    return wrap_rendered_shape(face_maker.Shape());
-}
+    std::mutex mutex;
+    std::vector<ProfileEvent> recorded;
+    std::map<std::thread::id, size_t> thread_numbers;
+};
 
-Object circle_render(Object self)
+void ProfileLog::start()
 {
-    Standard_Real dia = from_ruby<Standard_Real>(self.iv_get("@dia"));
-    gp_Circ circ(gp_Ax2(), dia / 2.0);
-    TopoDS_Edge edge = BRepBuilderAPI_MakeEdge(circ).Edge();
-    TopoDS_Wire wire = BRepBuilderAPI_MakeWire(edge).Wire();
-    return wrap_rendered_shape(BRepBuilderAPI_MakeFace(wire).Shape());
+    std::lock_guard<std::mutex> lock(mutex);
+    recorded.clear();
+    thread_numbers.clear();
+    origin = std::chrono::steady_clock::now();
+    is_enabled = true;
 }
 
-
-Object box_render(Object self)
+void ProfileLog::stop()
 {
-    Standard_Real xsize = from_ruby<Standard_Real>(self.iv_get("@xsize"));
-    Standard_Real ysize = from_ruby<Standard_Real>(self.iv_get("@ysize"));
-    Standard_Real zsize = from_ruby<Standard_Real>(self.iv_get("@zsize"));
-
-    return to_ruby(BRepPrimAPI_MakeBox(xsize, ysize, zsize).Shape());
+    is_enabled = false;
 }
 
-
-Object cone_render(Object self)
+void ProfileLog::record(ProfileEvent &event)
 {
-    Standard_Real height = from_ruby<Standard_Real>(self.iv_get("@height"));
-    Standard_Real dia1 = from_ruby<Standard_Real>(self.iv_get("@bottom_dia"));
-    Standard_Real dia2 = from_ruby<Standard_Real>(self.iv_get("@top_dia"));
-    return to_ruby(
-        BRepPrimAPI_MakeCone(dia1 / 2.0, dia2 / 2.0, height).Shape());
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::thread::id, size_t>::iterator number =
+        thread_numbers.insert(std::make_pair(std::this_thread::get_id(),
+            thread_numbers.size())).first;
+    event.thread = number->second;
+    recorded.push_back(event);
 }
 
-
-Object cylinder_render(Object self)
+std::vector<ProfileEvent> ProfileLog::events()
 {
-    Standard_Real height = from_ruby<Standard_Real>(self.iv_get("@height"));
-    Standard_Real dia = from_ruby<Standard_Real>(self.iv_get("@dia"));
-    return to_ruby(BRepPrimAPI_MakeCylinder(dia / 2.0, height).Shape());
+    std::lock_guard<std::mutex> lock(mutex);
+    return recorded;
 }
 
+static ProfileLog profile_log;
 
-Object sphere_render(Object self)
+static double thread_cpu_time()
 {
-    Standard_Real dia = from_ruby<Standard_Real>(self.iv_get("@dia"));
-    return to_ruby(BRepPrimAPI_MakeSphere(dia / 2.0).Shape());
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
 }
 
-
-// check if shape is inside-out and fix it if it is
-static void fix_inside_out_solid(TopoDS_Solid &solid)
+static long resident_memory()
 {
-    BRepClass3d_SolidClassifier classifier(solid);
-    classifier.PerformInfinitePoint(Precision::Confusion());
-    if (classifier.State() == TopAbs_IN) {
-        solid = TopoDS::Solid(solid.Oriented(TopAbs_REVERSED));
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file) {
+        return 0;
     }
+
+    long size = 0;
+    long resident = 0;
+    const int num_read = fscanf(file, "%ld %ld", &size, &resident);
+    fclose(file);
+
+    return (2 == num_read) ? resident * sysconf(_SC_PAGESIZE) : 0;
 }
 
-static Object polyhedron_render_internal(const Array points, const Array faces)
+// records the time from its construction to its destruction, if profiling
+// is enabled. otherwise does nothing. unless it's a root, its path is
+// appended to that of the scope it's nested in.
+class ProfileScope
 {
-    if (faces.size() < 4) {
-        throw Exception(rb_eArgError,
-            "Polyhedron must have at least 4 faces!");
+public:
+    ProfileScope(const char *category, const std::string &name,
+        bool root = false);
+    ~ProfileScope();
+
+    // counts the shape's faces and edges once the scope ends
+    void set_result(const TopoDS_Shape &shape)
+    {
+        result = shape;
     }
 
-    BRepBuilderAPI_Sewing sewing;
+private:
+    ProfileScope(const ProfileScope &);
+    ProfileScope &operator =(const ProfileScope &);
+
+    bool active;
+    ProfileEvent event;
+    double nested_wall;
+    double cpu_start;
+    long memory_start;
+    TopoDS_Shape result;
+    ProfileScope *parent;
+
+    static thread_local ProfileScope *current;
+};
 
-    for (size_t i = 0; i < faces.size(); ++i) {
-        TopoDS_Wire wire = make_wire_from_path(points, faces[i]);
+thread_local ProfileScope *ProfileScope::current = NULL;
 
-        sewing.Add(BRepBuilderAPI_MakeFace(wire).Face());
+ProfileScope::ProfileScope(const char *category, const std::string &name,
+    bool root)
+    : active(profile_log.enabled()),
+      nested_wall(0),
+      parent(NULL)
+{
+    if (!active) {
+        return;
     }
 
-    sewing.Perform();
+    parent = current;
+    current = this;
 
-    TopoDS_Shell shell = TopoDS::Shell(sewing.SewedShape());
-    // TODO: check for free/multiple edges and problems from sewing object
+    event.path = (parent && !root) ? parent->event.path + ";" + name : name;
+    event.category = category;
+    event.faces = event.edges = -1;
+    memory_start = resident_memory();
+    cpu_start = thread_cpu_time();
+    event.start = profile_log.now();
+}
 
-    TopoDS_Solid solid = BRepBuilderAPI_MakeSolid(shell).Solid();
+ProfileScope::~ProfileScope()
+{
+    if (!active) {
+        return;
+    }
 
-    fix_inside_out_solid(solid);
+    event.wall = profile_log.now() - event.start;
+    event.cpu = thread_cpu_time() - cpu_start;
+    event.memory_delta = resident_memory() - memory_start;
+    event.self_wall = event.wall - nested_wall;
+
+    if (!result.IsNull()) {
+        TopTools_IndexedMapOfShape faces, edges;
+        TopExp::MapShapes(result, TopAbs_FACE, faces);
+        TopExp::MapShapes(result, TopAbs_EDGE, edges);
+        event.faces = faces.Extent();
+        event.edges = edges.Extent();
+    }
 
-    return wrap_rendered_shape(solid);
-}
+    current = parent;
+    if (parent) {
+        parent->nested_wall += event.wall;
+    }
 
-Object polyhedron_render(Object self)
-{
-    const Array points = self.iv_get("@points");
-    const Array faces = self.iv_get("@faces");
-    return polyhedron_render_internal(points, faces);
+    profile_log.record(event);
 }
 
 
-Object torus_render(Object self)
-{
-    Standard_Real inner_dia = from_ruby<Standard_Real>(
-        self.iv_get("@inner_dia"));
-
-    Standard_Real outer_dia = from_ruby<Standard_Real>(
-        self.iv_get("@outer_dia"));
+// Rendering happens in two stages. First, a RenderPlan is built from the
+// Shape tree: each node's parameters are converted to C++ values, and
+// render methods written in Ruby (e.g. HexNut's) are called. Each node
+// becomes a RenderTask, and identical subtrees share a single task. Then,
+// the tasks are run by a TaskScheduler, with independent subtrees rendered
+// concurrently. The second stage doesn't touch any Ruby objects.
 
-    Standard_Real r1 = inner_dia / 2.0;
-    Standard_Real r2 = outer_dia / 2.0;
+// a task's rendered inputs. shared[i] is set if inputs[i], or shapes it's
+// built from, may be used by other tasks while this one runs.
+struct TaskInputs : public std::vector<TopoDS_Shape>
+{
+    std::vector<bool> shared;
 
-    Object angle = self.iv_get("@angle");
-    if (angle.is_nil()) {
-        return to_ruby(BRepPrimAPI_MakeTorus(r1, r2).Shape());
-    } else {
-        Standard_Real angle_num = from_ruby<Standard_Real>(angle);
-        return to_ruby(BRepPrimAPI_MakeTorus(r1, r2, angle_num).Shape());
+    bool is_shared(size_t i) const
+    {
+        return i < shared.size() && shared[i];
     }
-}
+};
 
+typedef std::function<TopoDS_Shape (const TaskInputs &)> TaskFunc;
 
-void combination_initialize(Object self, Object a, Object b)
+struct RenderTask
 {
-    self.iv_set("@a", a);
-    self.iv_set("@b", b);
-}
-
+    size_t index;
+    // the path of the shape it renders, when profiling
+    std::string label;
+    TaskFunc func;
+    std::vector<RenderTask *> inputs;
+    std::vector<RenderTask *> dependents;
+    std::atomic<size_t> pending_inputs;
+    bool done;
+    TopoDS_Shape result;
+    // whether result reuses sub-shapes of a shared input, e.g. because the
+    // task moved it
+    bool result_shared;
+};
 
-Object union_render(Object self)
-{
-    Data_Object<TopoDS_Shape> shape_a = render_shape(self.iv_get("@a"));
-    Data_Object<TopoDS_Shape> shape_b = render_shape(self.iv_get("@b"));
-    return to_ruby(
-        BRepAlgoAPI_Fuse(*shape_a, *shape_b).Shape());
-}
 
+// defined with the mesh shapes, below
+static bool is_mesh_shape(const TopoDS_Shape &shape);
 
-Object difference_render(Object self)
+// runs a DAG of tasks on a pool of threads. each thread has its own queue
+// of ready tasks. it works on the newest task in its queue, so that it
+// continues up the subtree it's been working on, and when it runs out it
+// steals the oldest task from another thread's queue.
+class TaskScheduler
 {
-    Data_Object<TopoDS_Shape> shape_a = render_shape(self.iv_get("@a"));
-    Data_Object<TopoDS_Shape> shape_b = render_shape(self.iv_get("@b"));
-    return to_ruby(
-        BRepAlgoAPI_Cut(*shape_a, *shape_b).Shape());
-}
+public:
+    explicit TaskScheduler(size_t num_threads)
+        : num_threads(num_threads),
+          failed(false)
+    {
+    }
 
+    // throws Standard_Failure with the first error if any task failed
+    void run(const std::vector<std::unique_ptr<RenderTask> > &tasks);
 
-Object intersection_render(Object self)
-{
-    Data_Object<TopoDS_Shape> shape_a = render_shape(self.iv_get("@a"));
-    Data_Object<TopoDS_Shape> shape_b = render_shape(self.iv_get("@b"));
-    return to_ruby(
-        BRepAlgoAPI_Common(*shape_a, *shape_b).Shape());
-}
+    // makes run return early. tasks that have already started are
+    // finished first. can be called from any thread.
+    void cancel()
+    {
+        fail("interrupted");
+    }
 
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<RenderTask *> queue;
+    };
+
+    void work(size_t index);
+    RenderTask *next_task(size_t index);
+    void push(size_t index, RenderTask *task);
+    void execute(size_t index, RenderTask *task);
+    void fail(const char *message);
+
+    size_t num_threads;
+    std::vector<std::unique_ptr<Worker> > workers;
+
+    std::mutex idle_mutex;
+    std::condition_variable idle_cond;
+    std::atomic<size_t> num_queued;
+    std::atomic<size_t> num_remaining;
+    std::atomic<bool> failed;
+    std::string failure_message;
+};
 
-static bool is_inner_wire_of_face(TopoDS_Wire wire, TopoDS_Face face)
+void TaskScheduler::run(const std::vector<std::unique_ptr<RenderTask> > &tasks)
 {
-    // recipe from http://opencascade.wikidot.com/recipes
-    TopoDS_Face newface = TopoDS::Face(
-        face.EmptyCopied().Oriented(TopAbs_FORWARD));
-
-    BRep_Builder builder;
-    builder.Add(newface, wire);
+    std::vector<RenderTask *> ready;
+    num_remaining = 0;
+    num_queued = 0;
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        RenderTask *task = tasks[i].get();
+        if (task->done) {
+            continue;
+        }
 
-    BRepTopAdaptor_FClass2d fclass2D(newface, Precision::PConfusion());
-    return (fclass2D.PerformInfinitePoint() != TopAbs_OUT);
-}
+        size_t pending = 0;
+        for (size_t j = 0; j < task->inputs.size(); ++j) {
+            if (!task->inputs[j]->done) {
+                ++pending;
+            }
+        }
 
-static TopoDS_Shape extrude_wire(TopoDS_Wire profile, TopoDS_Wire spine,
-    TopoDS_Face spine_support)
-{
-    BRepOffsetAPI_MakePipeShell pipe_maker(spine);
+        task->pending_inputs = pending;
+        ++num_remaining;
 
-    if (!spine_support.IsNull()) {
-        if (!pipe_maker.SetMode(spine_support)) {
-            throw Exception(rb_cOCEError,
-                "failed setting twisted surface-normal for PipeShell");
+        if (0 == pending) {
+            ready.push_back(task);
         }
     }
 
-    pipe_maker.Add(profile);
-    const Standard_Real tolerance = get_tolerance();
-    pipe_maker.SetTolerance(tolerance, tolerance);
-    pipe_maker.Build();
+    if (0 == num_remaining) {
+        return;
+    }
 
-    if (!pipe_maker.MakeSolid()) {
-        throw Exception(rb_cOCEError, "failed making extrusion solid");
+    const size_t num_workers = std::min<size_t>(num_threads, num_remaining);
+    workers.clear();
+    for (size_t i = 0; i < num_workers; ++i) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
     }
 
-    return pipe_maker.Shape();
-}
+    for (size_t i = 0; i < ready.size(); ++i) {
+        workers[i % num_workers]->queue.push_back(ready[i]);
+        ++num_queued;
+    }
 
-static TopoDS_Shape extrude_face(TopoDS_Face profile, TopoDS_Wire spine,
-    TopoDS_Face spine_support)
-{
-    // extrude outer and inner wires separately, then subtract the inner
-    // shapes from the outer shape. there should be only one outer shape,
-    // and zero or more inner shapes.
+    // the calling thread is worker 0
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_workers; ++i) {
+        threads.push_back(std::thread(&TaskScheduler::work, this, i));
+    }
 
-    TopoDS_Shape outer;
+    work(0);
 
-    TopoDS_Compound inner;
-    BRep_Builder builder;
-    builder.MakeCompound(inner);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
 
-    TopExp_Explorer texp;
+    if (failed) {
+        Standard_Failure::Raise(failure_message.c_str());
+    }
+}
+
+void TaskScheduler::work(size_t index)
+{
+    while (!failed) {
+        RenderTask *task = next_task(index);
+        if (task) {
+            execute(index, task);
+            continue;
+        }
 
-    TopoDS_Face orface = TopoDS::Face(profile.Oriented(TopAbs_FORWARD));
-    for (texp.Init(orface, TopAbs_WIRE); texp.More(); texp.Next()) {
-        TopoDS_Wire wire = TopoDS::Wire(texp.Current());
-        TopoDS_Shape ext_wire = extrude_wire(wire, spine, spine_support);
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle_cond.wait(lock, [this] {
+            return num_queued > 0 || 0 == num_remaining || failed;
+        });
 
-        if (is_inner_wire_of_face(wire, orface)) {
-            builder.Add(inner, ext_wire);
-        } else {
-            outer = ext_wire;
+        if (0 == num_remaining) {
+            return;
         }
     }
-
-    return BRepAlgoAPI_Cut(outer, inner).Shape();
 }
 
-static TopoDS_Shape extrude_shape(TopoDS_Shape profile, TopoDS_Wire spine,
-    TopoDS_Face spine_support)
+RenderTask *TaskScheduler::next_task(size_t index)
 {
-    BRep_Builder builder;
-    TopoDS_Compound compound;
-    builder.MakeCompound(compound);
+    {
+        Worker &own = *workers[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.queue.empty()) {
+            RenderTask *task = own.queue.back();
+            own.queue.pop_back();
+            --num_queued;
+            return task;
+        }
+    }
 
-    TopExp_Explorer texp;
-    for (texp.Init(profile, TopAbs_FACE); texp.More(); texp.Next()) {
-        builder.Add(compound,
-            extrude_face(
-                TopoDS::Face(texp.Current()), spine, spine_support));
+    for (size_t i = 1; i < workers.size(); ++i) {
+        Worker &victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.queue.empty()) {
+            RenderTask *task = victim.queue.front();
+            victim.queue.pop_front();
+            --num_queued;
+            return task;
+        }
     }
 
-    return compound;
+    return NULL;
 }
 
-static TopoDS_Shape twist_extrude(TopoDS_Shape shape, Standard_Real height,
-    Standard_Real twist)
+void TaskScheduler::push(size_t index, RenderTask *task)
 {
-    // split height into segments. each segment will twist no more than
-    // 90 degrees.
-    const int num_twist_segments = (int)(fabs(twist) / M_PI_2 + 1);
-    // note that height and twist are doubles so division is not integer
-    // division
-    const Standard_Real seg_height = height / num_twist_segments;
-    const Standard_Real seg_twist = twist / num_twist_segments;
+    {
+        Worker &own = *workers[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.queue.push_back(task);
+        ++num_queued;
+    }
 
-    Handle_Geom_BezierSurface surf_hnd(
-        new Geom_BezierSurface(
-            TColgp_Array2OfPnt(
-                1, num_twist_segments + 1,
-                1, 2)));
+    // lock, so the notification can't be missed by a thread that's just
+    // checked num_queued and is about to wait
+    { std::lock_guard<std::mutex> lock(idle_mutex); }
+    idle_cond.notify_one();
+}
 
-    for (int i = 1; i <= num_twist_segments + 1; ++i) {
-        const Standard_Real z = seg_height * (i - 1);
-        const Standard_Real angle = seg_twist * (i - 1);
-        surf_hnd->SetPole(i, 1, gp_Pnt(0, 0, z));
-        surf_hnd->SetPole(i, 2, gp_Pnt(cos(angle), sin(angle), z));
+// whether other tasks, or other plans, may use input's result while task
+// does. results rendered before the plan ran belong to Ruby objects (and
+// $render_cache), so they count as shared.
+static bool is_shared_input(const RenderTask *input, const RenderTask *task)
+{
+    if (!input->func) {
+        return true;
     }
 
-    TopoDS_Face spine_support =
-        // TODO: tolerance
-        BRepBuilderAPI_MakeFace(surf_hnd, 0, 1, 0, 1,
-            Precision::Confusion());
-
-    Handle_Geom2d_Curve uv_curve_hnd =
-        GCE2d_MakeSegment(gp_Pnt2d(0, 0), gp_Pnt2d(1, 0));
-    TopoDS_Edge spine = BRepBuilderAPI_MakeEdge(uv_curve_hnd, surf_hnd);
-    TopoDS_Wire spine_wire = BRepBuilderAPI_MakeWire(spine);
+    for (size_t i = 0; i < input->dependents.size(); ++i) {
+        if (input->dependents[i] != task) {
+            return true;
+        }
+    }
 
-    return extrude_shape(shape, spine_wire, spine_support);
+    return false;
 }
 
-// initialize is defined in Ruby code
-Object linear_extrusion_render(Object self)
+static void add_edge_tshapes(const TopoDS_Shape &shape,
+    std::unordered_set<const TopoDS_TShape *> &tshapes)
 {
-    Object profile = self.iv_get("@profile");
-    Standard_Real height = from_ruby<Standard_Real>(self.iv_get("@height"));
-    Standard_Real twist = from_ruby<Standard_Real>(self.iv_get("@twist"));
-
-    Data_Object<TopoDS_Shape> shape = render_shape(profile);
-
-    if (0 == twist) {
-        return to_ruby(
-            BRepPrimAPI_MakePrism(*shape, gp_Vec(0, 0, height),
-                Standard_True).Shape());
-    } else {
-        return wrap_rendered_shape(twist_extrude(*shape, height, twist));
+    for (TopExp_Explorer ex(shape, TopAbs_EDGE); ex.More(); ex.Next()) {
+        tshapes.insert(ex.Current().TShape().operator->());
     }
 }
 
-
-Object revolution_render(Object self)
+// whether result has any edges of the shared inputs. transforms and
+// patterns place their inputs as located instances, and some tasks pass an
+// input straight through, so their results are shared too.
+static bool shares_input_geometry(const TopoDS_Shape &result,
+    const TaskInputs &inputs)
 {
-    Object profile = self.iv_get("@profile");
-    Data_Object<TopoDS_Shape> shape = render_shape(profile);
-
-    Object angle = self.iv_get("@angle");
+    if (result.IsNull() || is_mesh_shape(result)) {
+        return false;
+    }
 
-    gp_Circ circ(gp_Ax2(gp::Origin(), -gp::DY(), gp::DX()), 1.0);
-    TopoDS_Edge edge;
+    std::unordered_set<const TopoDS_TShape *> shared_edges;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs.is_shared(i)) {
+            add_edge_tshapes(inputs[i], shared_edges);
+        }
+    }
 
-    if (angle.is_nil()) {
-        edge = BRepBuilderAPI_MakeEdge(circ);
-    } else {
-        Standard_Real angle_num = from_ruby<Standard_Real>(angle);
-        angle_num = std::max(angle_num, 0.0);
-        angle_num = std::min(angle_num, M_PI * 2);
+    if (shared_edges.empty()) {
+        return false;
+    }
 
-        Handle_Geom_Curve curve_hnd(new Geom_Circle(circ));
-        edge = BRepBuilderAPI_MakeEdge(curve_hnd, 0, angle_num);
+    for (TopExp_Explorer ex(result, TopAbs_EDGE); ex.More(); ex.Next()) {
+        if (shared_edges.count(ex.Current().TShape().operator->())) {
+            return true;
+        }
     }
 
-    TopoDS_Wire spine = BRepBuilderAPI_MakeWire(edge);
-    return wrap_rendered_shape(
-        extrude_shape(*shape, spine, TopoDS_Face()));
+    return false;
 }
 
-
-static void get_points_from_shape(const TopoDS_Shape &shape,
-    std::vector<gp_Pnt> &points)
+void TaskScheduler::execute(size_t index, RenderTask *task)
 {
-    TopExp_Explorer ex(shape, TopAbs_FACE);
-    for (; ex.More(); ex.Next()) {
-        const TopoDS_Face& face = TopoDS::Face(ex.Current());
+    try {
+        // tasks are named by their place in the shape tree, whichever
+        // thread runs them
+        ProfileScope scope("shape",
+            task->label.empty() ? "render" : task->label, true);
+
+        // shared inputs are passed as they are. the booleans, which modify
+        // their operands, copy them first (see copy_shared_operands).
+        TaskInputs inputs;
+        inputs.reserve(task->inputs.size());
+        for (size_t i = 0; i < task->inputs.size(); ++i) {
+            const RenderTask *input = task->inputs[i];
+            inputs.push_back(input->result);
+            inputs.shared.push_back(
+                input->result_shared || is_shared_input(input, task));
+        }
 
-        TopLoc_Location loc;
-        Handle(Poly_Triangulation) tri = BRep_Tool::Triangulation(face, loc);
+        task->result = task->func(inputs);
+        task->result_shared = shares_input_geometry(task->result, inputs);
+        task->done = true;
+        scope.set_result(task->result);
+    } catch (const Standard_Failure &e) {
+        fail(e.GetMessageString());
+        return;
+    } catch (const std::exception &e) {
+        fail(e.what());
+        return;
+    }
 
-        if (tri.IsNull()) {
-            throw Exception(rb_cOCEError, "No triangulation");
+    for (size_t i = 0; i < task->dependents.size(); ++i) {
+        if (0 == --task->dependents[i]->pending_inputs) {
+            push(index, task->dependents[i]);
         }
+    }
 
-        const Standard_Integer numNodes = tri->NbNodes();
-        const TColgp_Array1OfPnt& nodes = tri->Nodes();
-        for (Standard_Integer i = 1; i <= numNodes; i++) {
-            points.push_back(
-                loc.IsIdentity()
-                ? nodes(i)
-                : nodes(i).Transformed(loc));
-        }
+    if (0 == --num_remaining) {
+        { std::lock_guard<std::mutex> lock(idle_mutex); }
+        idle_cond.notify_all();
     }
 }
 
-static std::vector<gp_Pnt> get_points_from_shapes(Array shapes)
+void TaskScheduler::fail(const char *message)
 {
-    std::vector<gp_Pnt> points;
-
-    const Standard_Real tolerance = get_tolerance();
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        if (!failed) {
+            failure_message = message ? message : "unknown error";
+            failed = true;
+        }
+    }
 
-    for (size_t i = 0; i < shapes.size(); ++i) {
-        Data_Object<TopoDS_Shape> shape_obj = render_shape(shapes[i]);
-        const TopoDS_Shape &shape = *shape_obj;
+    idle_cond.notify_all();
+}
 
-        BRepMesh_IncrementalMesh(shape, tolerance);
 
-        get_points_from_shape(shape, points);
-    }
+class RenderPlan;
 
-    return points;
-}
+// adds tasks rendering a shape to a plan, returning the task whose result
+// is the rendered shape. the native Shape classes each have one.
+typedef RenderTask *(*ShapePlanner)(RenderPlan &plan, Object shape);
 
+// maps native Shape classes to their planners
+static std::map<VALUE, ShapePlanner> shape_planners;
 
-// Sort function object to sort the vertices of a convex polygon
-// Algorithm from here:
-// http://stackoverflow.com/a/15104911/2758814
-class ConvexPolygonVertexSortComparator
+class RenderPlan
 {
 public:
-    ConvexPolygonVertexSortComparator(std::vector<gp_Pnt> vertices)
-        : vertices(vertices)
+    RenderPlan()
+        : tol(get_tolerance()),
+          num_threads(get_render_threads()),
+          render_keys(Object(rb_hash_new()).call("compare_by_identity"))
     {
-        if (vertices.size() == 0) {
-            throw std::exception();
-        }
-
-        // get center point
-        for (size_t i = 0; i < vertices.size(); ++i) {
-            center.Translate(gp::Origin(), vertices[i]);
-        }
-        center.Scale(gp::Origin(), 1.0/vertices.size());
+    }
 
-        center_to_first_vert = gp_Vec(center, vertices[0]);
+    Standard_Real tolerance() const
+    {
+        return tol;
+    }
 
-        // TODO: ensure that normals are all in consistent direction
-        // by specifying a point that should be on the front or back side of
-        // the polygon
+    // adds tasks rendering shape, which can be a Shape or a RenderedShape
+    RenderTask *add_shape(Object shape);
 
-        // get a normal with one of the other vectors
-        // (must find a non-zero normal, i.e. other vector must not be
-        // parallel to first vector)
-        for (size_t i = 1; i < vertices.size(); ++i) {
-            gp_Vec another_vec = gp_Vec(center, vertices[i]);
-            normal = center_to_first_vert ^ another_vec;
-            if (normal.Magnitude() > Precision::Confusion()) {
-                break;
-            }
-        }
+    RenderTask *add_task(const std::vector<RenderTask *> &inputs,
+        TaskFunc func);
+    RenderTask *add_task(RenderTask *input, TaskFunc func);
+    RenderTask *add_task(TaskFunc func);
 
-        if (normal.Magnitude() <= Precision::Confusion()) {
-            // couldn't find a non-zero normal. normal still zero
-            throw std::exception();
-        }
-    }
+    // adds a task whose result is already known
+    RenderTask *add_rendered(const TopoDS_Shape &shape);
 
-    bool operator() (gp_Pnt a, gp_Pnt b) {
-        double angle1 = get_angle_to_vec(a);
-        double angle2 = get_angle_to_vec(b);
-        return angle1 < angle2;
-    }
+    // runs all tasks, then stores their results in $render_cache
+    void run();
 
 private:
-    double get_angle_to_vec(gp_Pnt vertex) {
-        gp_Vec center_to_vertex(center, vertex);
-
-        // use normal as reference to define positive rotation angle
-        return center_to_first_vert.AngleWithRef(center_to_vertex, normal);
-    }
-
-    std::vector<gp_Pnt> vertices;
-    gp_Pnt center;
-    gp_Vec center_to_first_vert;
-    gp_Vec normal;
-};
+    RenderTask *add_shape_uncached(Object shape);
+    RenderTask *plan_shape(Object shape);
 
-static TopoDS_Solid make_solid_from_qhull()
-{
-    BRepBuilderAPI_Sewing sewing;
+    Standard_Real tol;
+    size_t num_threads;
 
-    facetT *facet;
-    FORALLfacets {
-        // get vertices into an std::vector
-        std::vector<gp_Pnt> vertices;
-        vertices.reserve(qh_setsize(facet->vertices));
+    // classes of the shapes being planned, from the root down, when
+    // profiling. tasks are labelled with it.
+    std::string shape_path;
 
-        vertexT *vertex, **vertexp;
-        FOREACHvertex_(facet->vertices) {
-            vertices.push_back(gp_Pnt(vertex->point[0], vertex->point[1],
-                vertex->point[2]));
-        }
+    std::vector<std::unique_ptr<RenderTask> > tasks;
+    std::map<std::string, RenderTask *> tasks_by_key;
 
-        sort(vertices.begin(), vertices.end(),
-            ConvexPolygonVertexSortComparator(vertices));
+    // [cache key, task index] pairs, for storing results once they're
+    // rendered. kept in a Ruby array so the GC sees the keys.
+    Array cache_entries;
 
-        BRepBuilderAPI_MakePolygon poly_maker;
-        for (size_t i = 0; i < vertices.size(); ++i) {
-            poly_maker.Add(vertices[i]);
-        }
-        poly_maker.Close();
+    // Shape#render_key's memo, so each shape's key is worked out once
+    Object render_keys;
+};
 
-        sewing.Add(BRepBuilderAPI_MakeFace(poly_maker.Wire()).Face());
+RenderTask *RenderPlan::add_shape(Object shape)
+{
+    if (shape.is_a(rb_cRenderedShape)) {
+        return add_rendered(from_ruby<TopoDS_Shape>(shape));
     }
 
-    sewing.Perform();
+    if (!shape.is_a(rb_cShape)) {
+        String shape_str = shape.to_s();
+        throw Exception(rb_eArgError,
+            "attempt to render %s which is not a Shape",
+            shape_str.c_str());
+    }
+
+    Object render_key = shape.call("render_key", render_keys);
+    std::string key_str;
+    if (!render_key.is_nil()) {
+        key_str = String(render_key).str();
+
+        std::map<std::string, RenderTask *>::iterator found =
+            tasks_by_key.find(key_str);
+        if (found != tasks_by_key.end()) {
+            return found->second;
+        }
+    }
+
+    RenderTask *task;
+
+    Object cache_key = get_render_cache_key(render_key);
+    Object cached = cache_key.is_nil()
+        ? Object(Qnil)
+        : Object(rb_gv_get("$render_cache")).call("[]", cache_key);
+
+    if (!cached.is_nil()) {
+        task = add_rendered(from_ruby<TopoDS_Shape>(cached));
+    } else {
+        task = add_shape_uncached(shape);
+
+        if (!cache_key.is_nil()) {
+            Array entry;
+            entry.push(cache_key);
+            entry.push(task->index);
+            cache_entries.push(entry);
+        }
+    }
+
+    if (!render_key.is_nil()) {
+        tasks_by_key[key_str] = task;
+    }
+
+    return task;
+}
+
+RenderTask *RenderPlan::add_shape_uncached(Object shape)
+{
+    if (!profile_log.enabled()) {
+        return plan_shape(shape);
+    }
+
+    const size_t parent_length = shape_path.size();
+    if (parent_length > 0) {
+        shape_path += ";";
+    }
+    shape_path += shape.class_of().to_s().str();
+
+    RenderTask *task = plan_shape(shape);
+    shape_path.resize(parent_length);
+    return task;
+}
+
+RenderTask *RenderPlan::plan_shape(Object shape)
+{
+    // use the native planner if render hasn't been overridden in Ruby
+    Object owner = shape.call("method", Symbol("render")).call("owner");
+    std::map<VALUE, ShapePlanner>::const_iterator planner =
+        shape_planners.find(owner.value());
+    if (planner != shape_planners.end()) {
+        return planner->second(*this, shape);
+    }
+
+    // otherwise, render builds another shape tree (e.g. HexNut or SpurGear),
+    // or renders the shape itself (e.g. Text)
+    Object rendered = shape.call("render");
+
+    if (rendered.is_a(rb_cShape)) {
+        return add_shape(rendered);
+    } else if (rendered.is_a(rb_cRenderedShape)) {
+        return add_rendered(from_ruby<TopoDS_Shape>(rendered));
+    } else {
+        String rendered_str = rendered.to_s();
+        throw Exception(rb_eArgError,
+            "render returned %s instead of a rendered shape",
+            rendered_str.c_str());
+    }
+}
+
+RenderTask *RenderPlan::add_task(const std::vector<RenderTask *> &inputs,
+    TaskFunc func)
+{
+    RenderTask *task = new RenderTask();
+    tasks.push_back(std::unique_ptr<RenderTask>(task));
+
+    task->index = tasks.size() - 1;
+    task->label = shape_path;
+    task->func = func;
+    task->inputs = inputs;
+    task->pending_inputs = 0;
+    task->done = false;
+    task->result_shared = false;
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        inputs[i]->dependents.push_back(task);
+    }
+
+    return task;
+}
+
+RenderTask *RenderPlan::add_task(RenderTask *input, TaskFunc func)
+{
+    return add_task(std::vector<RenderTask *>(1, input), func);
+}
+
+RenderTask *RenderPlan::add_task(TaskFunc func)
+{
+    return add_task(std::vector<RenderTask *>(), func);
+}
+
+RenderTask *RenderPlan::add_rendered(const TopoDS_Shape &shape)
+{
+    RenderTask *task = add_task(TaskFunc());
+    task->result = shape;
+    task->done = true;
+    return task;
+}
+
+static void cancel_scheduler(void *scheduler)
+{
+    static_cast<TaskScheduler *>(scheduler)->cancel();
+}
+
+void RenderPlan::run()
+{
+    TaskScheduler scheduler(num_threads);
+    without_gvl([&] {
+        scheduler.run(tasks);
+    }, cancel_scheduler, &scheduler);
+
+    Object cache(rb_gv_get("$render_cache"));
+    if (cache.is_nil()) {
+        return;
+    }
+
+    for (size_t i = 0; i < cache_entries.size(); ++i) {
+        Array entry(cache_entries[i]);
+        const size_t index = from_ruby<size_t>(entry[1]);
+        cache.call("[]=", Object(entry[0]),
+            wrap_rendered_shape(tasks[index]->result));
+    }
+}
+
+
+static Data_Object<TopoDS_Shape> render_shape(Object shape)
+{
+    if (shape.is_a(rb_cRenderedShape)) {
+        return shape;
+    }
+
+    RenderPlan plan;
+    RenderTask *task;
+    {
+        ProfileScope scope("plan", "plan");
+        task = plan.add_shape(shape);
+    }
+
+    plan.run();
+    return wrap_rendered_shape(task->result);
+}
+
+// renders self using a specific planner, regardless of which class's render
+// method is found first. used as the native Shape classes' render methods.
+template <ShapePlanner planner>
+Object render_with_planner(Object self)
+{
+    RenderPlan plan;
+    RenderTask *task;
+    {
+        ProfileScope scope("plan", "plan");
+        task = planner(plan, self);
+    }
+
+    plan.run();
+    return wrap_rendered_shape(task->result);
+}
+
+// lets RenderPlan use planner directly, rather than calling klass's render
+// method, as long as it hasn't been overridden in Ruby
+static void register_planner(Class klass, ShapePlanner planner)
+{
+    shape_planners[klass.value()] = planner;
+}
+
+// in radians
+static const Standard_Real MESH_ANGULAR_DEFLECTION = 0.5;
+
+// BRepMesh stores triangulations in the shapes themselves, and rendered
+// shapes share sub-shapes, so it's only given private copies (see
+// mesh_faces). BRepMesh meshes each shape's faces in parallel.
+static void mesh_shape(const TopoDS_Shape &shape,
+    Standard_Real linear_deflection, Standard_Real angular_deflection)
+{
+    BRepMesh_IncrementalMesh(shape, linear_deflection, Standard_False,
+        angular_deflection, Standard_True);
+}
+
+// triangle meshes that don't approximate a B-rep (from STL files, or the
+// mesh booleans) are kept as a face with a Poly_Triangulation but no
+// surface. they go through the render pipeline, transforms and
+// $render_cache like any other shape, and are never meshed again.
+static bool is_mesh_face(const TopoDS_Face &face)
+{
+    TopLoc_Location loc;
+    return BRep_Tool::Surface(face, loc).IsNull()
+        && !BRep_Tool::Triangulation(face, loc).IsNull();
+}
+
+static bool is_mesh_shape(const TopoDS_Shape &shape)
+{
+    return !shape.IsNull()
+        && shape.ShapeType() == TopAbs_FACE
+        && is_mesh_face(TopoDS::Face(shape));
+}
+
+static TopoDS_Shape make_empty_shape()
+{
+    TopoDS_Compound compound;
+    BRep_Builder().MakeCompound(compound);
+    return compound;
+}
+
+
+// calls a Ruby block with (done, total) from code running without the GVL.
+// if the block raises, report returns false, and check rethrows the
+// exception once the GVL is back.
+class ProgressReporter
+{
+public:
+    explicit ProgressReporter(Object block)
+        : block(block)
+    {
+    }
+
+    bool report(size_t done, size_t total);
+    void check();
+
+private:
+    static void *call_block(void *data);
+
+    Object block;
+    size_t done;
+    size_t total;
+    std::exception_ptr error;
+};
+
+bool ProgressReporter::report(size_t done, size_t total)
+{
+    if (block.is_nil()) {
+        return true;
+    }
+
+    this->done = done;
+    this->total = total;
+    rb_thread_call_with_gvl(call_block, this);
+    return !error;
+}
+
+void *ProgressReporter::call_block(void *data)
+{
+    ProgressReporter *reporter = static_cast<ProgressReporter *>(data);
+
+    try {
+        reporter->block.call("call", reporter->done, reporter->total);
+    } catch (...) {
+        // C++ exceptions mustn't unwind through Ruby's frames
+        reporter->error = std::current_exception();
+    }
+
+    return NULL;
+}
+
+void ProgressReporter::check()
+{
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+
+// binary STL is little-endian
+static char *put_uint32_le(char *out, uint32_t value)
+{
+    out[0] = static_cast<char>(value & 0xff);
+    out[1] = static_cast<char>((value >> 8) & 0xff);
+    out[2] = static_cast<char>((value >> 16) & 0xff);
+    out[3] = static_cast<char>((value >> 24) & 0xff);
+    return out + 4;
+}
+
+static char *put_float_le(char *out, Standard_Real value)
+{
+    const float f = static_cast<float>(value);
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return put_uint32_le(out, bits);
+}
+
+static char *put_xyz(char *out, const gp_XYZ &xyz)
+{
+    out = put_float_le(out, xyz.X());
+    out = put_float_le(out, xyz.Y());
+    return put_float_le(out, xyz.Z());
+}
+
+// writes binary STL triangles to a file through a fixed-size buffer, so
+// the whole mesh is never held in memory at once. the file is deleted if
+// it isn't finished, e.g. after an error.
+class StlFileWriter
+{
+public:
+    static const size_t HEADER_SIZE = 80;
+    static const size_t TRIANGLE_SIZE = 50;
+    static const size_t BUFFER_TRIANGLES = 1 << 16;
+
+    explicit StlFileWriter(const std::string &path);
+    ~StlFileWriter();
+
+    void add_triangle(const gp_Pnt &p1, const gp_Pnt &p2, const gp_Pnt &p3);
+
+    // patches the triangle count into the header, and closes the file
+    void finish();
+
+private:
+    void flush();
+    // closes and deletes the file, and raises an error about it
+    void fail();
+
+    std::string path;
+    FILE *file;
+    std::vector<char> buffer;
+    size_t buffer_used;
+    uint32_t num_triangles;
+};
+
+StlFileWriter::StlFileWriter(const std::string &path)
+    : path(path),
+      buffer(BUFFER_TRIANGLES * TRIANGLE_SIZE),
+      buffer_used(0),
+      num_triangles(0)
+{
+    file = fopen(path.c_str(), "wb");
+    if (!file) {
+        raise_oce_error("failed opening %s: %s",
+            path.c_str(), strerror(errno));
+    }
+
+    // header, then a placeholder for the triangle count
+    char header[HEADER_SIZE + 4] = {0};
+    strncpy(header, "binary STL written by rcad", HEADER_SIZE);
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+        fail();
+    }
+}
+
+StlFileWriter::~StlFileWriter()
+{
+    if (file) {
+        fclose(file);
+        remove(path.c_str());
+    }
+}
+
+void StlFileWriter::add_triangle(const gp_Pnt &p1, const gp_Pnt &p2,
+    const gp_Pnt &p3)
+{
+    if (buffer_used + TRIANGLE_SIZE > buffer.size()) {
+        flush();
+    }
+
+    gp_XYZ normal = (p2.XYZ() - p1.XYZ()) ^ (p3.XYZ() - p1.XYZ());
+    const Standard_Real length = normal.Modulus();
+    if (length > gp::Resolution()) {
+        normal.Divide(length);
+    } else {
+        normal = gp_XYZ(0, 0, 0);
+    }
+
+    char *out = &buffer[buffer_used];
+    out = put_xyz(out, normal);
+    out = put_xyz(out, p1.XYZ());
+    out = put_xyz(out, p2.XYZ());
+    out = put_xyz(out, p3.XYZ());
+    // attribute byte count
+    out[0] = out[1] = 0;
+
+    buffer_used += TRIANGLE_SIZE;
+    ++num_triangles;
+}
+
+void StlFileWriter::flush()
+{
+    if (buffer_used > 0 &&
+        fwrite(buffer.data(), buffer_used, 1, file) != 1)
+    {
+        fail();
+    }
+
+    buffer_used = 0;
+}
+
+void StlFileWriter::fail()
+{
+    const int error = errno;
+    fclose(file);
+    file = NULL;
+    remove(path.c_str());
+
+    raise_oce_error("failed writing %s: %s", path.c_str(), strerror(error));
+}
+
+void StlFileWriter::finish()
+{
+    flush();
+
+    char count[4];
+    put_uint32_le(count, num_triangles);
+    if (fseek(file, HEADER_SIZE, SEEK_SET) != 0 ||
+        fwrite(count, sizeof(count), 1, file) != 1)
+    {
+        fail();
+    }
+
+    // buffered data can still fail to be written when closing
+    FILE *closing = file;
+    file = NULL;
+    if (fclose(closing) != 0) {
+        const int error = errno;
+        remove(path.c_str());
+        raise_oce_error("failed writing %s: %s",
+            path.c_str(), strerror(error));
+    }
+}
+
+// a triangle mesh whose triangles share vertices
+struct IndexedMesh
+{
+    // x, y, z of each vertex
+    std::vector<float> vertices;
+    // vertex indices, 3 per triangle
+    std::vector<uint32_t> triangles;
+
+    size_t num_vertices() const
+    {
+        return vertices.size() / 3;
+    }
+
+    size_t num_triangles() const
+    {
+        return triangles.size() / 3;
+    }
+
+    size_t memory_size() const
+    {
+        return vertices.size() * sizeof(float)
+            + triangles.size() * sizeof(uint32_t);
+    }
+
+    gp_Pnt vertex(size_t index) const
+    {
+        const float *xyz = &vertices[3 * index];
+        return gp_Pnt(xyz[0], xyz[1], xyz[2]);
+    }
+};
+
+// welds vertices with identical coordinates, as written to files
+class VertexWelder
+{
+public:
+    explicit VertexWelder(IndexedMesh &mesh)
+        : mesh(mesh)
+    {
+    }
+
+    uint32_t add(const gp_Pnt &pnt)
+    {
+        const float xyz[3] = {
+            static_cast<float>(pnt.X()),
+            static_cast<float>(pnt.Y()),
+            static_cast<float>(pnt.Z()),
+        };
+
+        Key key;
+        memcpy(key.bits, xyz, sizeof(key.bits));
+
+        std::pair<std::map<Key, uint32_t>::iterator, bool> inserted =
+            indices.insert(std::make_pair(key,
+                static_cast<uint32_t>(mesh.num_vertices())));
+        if (inserted.second) {
+            mesh.vertices.insert(mesh.vertices.end(), xyz, xyz + 3);
+        }
+
+        return inserted.first->second;
+    }
+
+private:
+    struct Key
+    {
+        uint32_t bits[3];
+
+        bool operator <(const Key &other) const
+        {
+            return memcmp(bits, other.bits, sizeof(bits)) < 0;
+        }
+    };
+
+    IndexedMesh &mesh;
+    std::map<Key, uint32_t> indices;
+};
+
+static void add_face_triangles(IndexedMesh &mesh, VertexWelder &welder,
+    const TopoDS_Face &face)
+{
+    TopLoc_Location loc;
+    Handle(Poly_Triangulation) tri = BRep_Tool::Triangulation(face, loc);
+    if (tri.IsNull()) {
+        raise_oce_error("No triangulation");
+    }
+
+    const gp_Trsf trsf = loc.Transformation();
+    const TColgp_Array1OfPnt &nodes = tri->Nodes();
+    std::vector<uint32_t> node_indices(nodes.Length());
+    for (int i = nodes.Lower(); i <= nodes.Upper(); ++i) {
+        node_indices[i - nodes.Lower()] =
+            welder.add(nodes(i).Transformed(trsf));
+    }
+
+    // oriented so that normals point outwards
+    const bool reversed = (face.Orientation() == TopAbs_REVERSED);
+    const Poly_Array1OfTriangle &triangles = tri->Triangles();
+    for (int i = triangles.Lower(); i <= triangles.Upper(); ++i) {
+        Standard_Integer n1, n2, n3;
+        triangles(i).Get(n1, n2, n3);
+        if (reversed) {
+            std::swap(n2, n3);
+        }
+
+        const uint32_t v1 = node_indices[n1 - nodes.Lower()];
+        const uint32_t v2 = node_indices[n2 - nodes.Lower()];
+        const uint32_t v3 = node_indices[n3 - nodes.Lower()];
+
+        // welding can collapse tiny triangles
+        if (v1 == v2 || v2 == v3 || v3 == v1) {
+            continue;
+        }
+
+        mesh.triangles.push_back(v1);
+        mesh.triangles.push_back(v2);
+        mesh.triangles.push_back(v3);
+    }
+}
+
+// called with (faces meshed, total faces). returning false stops meshing.
+typedef std::function<bool (size_t, size_t)> MeshProgress;
+
+// called with each face once it's been triangulated
+typedef std::function<void (const TopoDS_Face &)> MeshedFaceFunc;
+
+// drops a meshed copy's triangulation, and its edges' polygons on it
+static void release_face_triangulation(const TopoDS_Face &face)
+{
+    TopLoc_Location location;
+    const Handle(Poly_Triangulation) triangulation =
+        BRep_Tool::Triangulation(face, location);
+    if (triangulation.IsNull()) {
+        return;
+    }
+
+    BRep_Builder builder;
+    for (TopExp_Explorer ex(face, TopAbs_EDGE); ex.More(); ex.Next()) {
+        builder.UpdateEdge(TopoDS::Edge(ex.Current()),
+            Handle(Poly_PolygonOnTriangulation)(), triangulation, location);
+    }
+
+    builder.UpdateFace(face, Handle(Poly_Triangulation)());
+}
+
+// meshes shape's faces a chunk at a time, so that progress can be reported.
+// the faces are copied first, and the copies are meshed and passed to func,
+// so the shape itself (and any other shape sharing its faces) is left
+// alone, and several threads can mesh shapes sharing faces without a lock.
+// a copy's triangulation is dropped once it and all its neighbours have
+// been passed to func, so only the chunks' boundaries are kept.
+static void mesh_faces(const TopoDS_Shape &shape,
+    Standard_Real linear_deflection, Standard_Real angular_deflection,
+    const MeshProgress &progress, const MeshedFaceFunc &func)
+{
+    const size_t faces_per_chunk = 256;
+
+    std::vector<TopoDS_Face> faces;
+    BRep_Builder builder;
+    TopoDS_Compound surfaces;
+    builder.MakeCompound(surfaces);
+    for (TopExp_Explorer ex(shape, TopAbs_FACE); ex.More(); ex.Next()) {
+        const TopoDS_Face &face = TopoDS::Face(ex.Current());
+        faces.push_back(face);
+
+        // mesh shapes' faces already have their triangles, which the copy
+        // wouldn't keep
+        if (!is_mesh_face(face)) {
+            builder.Add(surfaces, face);
+        }
+    }
+
+    // the copy shares geometry with the original, but not topology, which
+    // is where triangulations are stored. faces keep sharing their edges
+    // with each other, so the mesh stays watertight.
+    std::vector<bool> need_meshing(faces.size(), false);
+    const TopoDS_Shape copy =
+        BRepBuilderAPI_Copy(surfaces, Standard_False).Shape();
+    surfaces.Nullify();
+    TopoDS_Iterator copied(copy);
+    std::unordered_map<const TopoDS_TShape *, size_t> face_chunks;
+    for (size_t i = 0; i < faces.size(); ++i) {
+        if (!is_mesh_face(faces[i])) {
+            faces[i] = TopoDS::Face(copied.Value());
+            need_meshing[i] = true;
+            copied.Next();
+
+            // a face listed twice is done after its last chunk
+            face_chunks[faces[i].TShape().operator->()] = i / faces_per_chunk;
+        }
+    }
+
+    // BRepMesh reuses the nodes a neighbouring face's triangulation has on
+    // their common edge, so each copy's triangulation is kept until the
+    // last chunk with one of its neighbours
+    TopTools_IndexedDataMapOfShapeListOfShape edge_faces;
+    TopExp::MapShapesAndAncestors(copy, TopAbs_EDGE, TopAbs_FACE, edge_faces);
+    const size_t num_chunks =
+        (faces.size() + faces_per_chunk - 1) / faces_per_chunk;
+    std::vector<std::vector<size_t> > releases(num_chunks);
+    for (size_t i = 0; i < faces.size(); ++i) {
+        if (!need_meshing[i]) {
+            continue;
+        }
+
+        size_t last_chunk =
+            face_chunks[faces[i].TShape().operator->()];
+        for (TopExp_Explorer ex(faces[i], TopAbs_EDGE); ex.More();
+            ex.Next())
+        {
+            TopTools_ListIteratorOfListOfShape neighbour(
+                edge_faces.FindFromKey(ex.Current()));
+            for (; neighbour.More(); neighbour.Next()) {
+                last_chunk = std::max(last_chunk,
+                    face_chunks[neighbour.Value().TShape().operator->()]);
+            }
+        }
+
+        releases[last_chunk].push_back(i);
+    }
+
+    for (size_t chunk_index = 0; chunk_index < num_chunks; ++chunk_index) {
+        const size_t start = chunk_index * faces_per_chunk;
+        const size_t end = std::min(faces.size(), start + faces_per_chunk);
+
+        TopoDS_Compound chunk;
+        builder.MakeCompound(chunk);
+        bool chunk_needs_meshing = false;
+        for (size_t i = start; i < end; ++i) {
+            if (need_meshing[i]) {
+                builder.Add(chunk, faces[i]);
+                chunk_needs_meshing = true;
+            }
+        }
+
+        // edges shared with earlier chunks keep their discretization
+        if (chunk_needs_meshing) {
+            mesh_shape(chunk, linear_deflection, angular_deflection);
+        }
+
+        for (size_t i = start; i < end; ++i) {
+            func(faces[i]);
+        }
+
+        const std::vector<size_t> &done = releases[chunk_index];
+        for (size_t i = 0; i < done.size(); ++i) {
+            release_face_triangulation(faces[done[i]]);
+        }
+
+        if (progress && !progress(end, faces.size())) {
+            raise_oce_error("meshing stopped");
+        }
+    }
+}
+
+// meshes shape's faces, then collects their triangles
+static IndexedMesh make_indexed_mesh(const TopoDS_Shape &shape,
+    Standard_Real linear_deflection, Standard_Real angular_deflection,
+    const MeshProgress &progress)
+{
+    ProfileScope scope("meshing", "tessellate");
+
+    IndexedMesh mesh;
+    VertexWelder welder(mesh);
+    mesh_faces(shape, linear_deflection, angular_deflection, progress,
+        [&](const TopoDS_Face &face) {
+            add_face_triangles(mesh, welder, face);
+        });
+
+    return mesh;
+}
+
+
+// IndexedMeshes of rendered shapes, so that hulls, mesh booleans and
+// exporters don't each mesh the same shape again. shapes are identified by
+// their TShape, location and orientation, and kept alive by the cache so
+// that their TShapes aren't reused. the least recently added meshes are
+// dropped once the cache grows beyond MAX_SIZE bytes.
+class TessellationCache
+{
+public:
+    typedef std::shared_ptr<const IndexedMesh> MeshPtr;
+
+    static const size_t MAX_SIZE = 512 << 20;
+
+    TessellationCache()
+        : total_size(0)
+    {
+    }
+
+    // meshes shape if it isn't in the cache
+    MeshPtr get(const TopoDS_Shape &shape, Standard_Real linear_deflection,
+        Standard_Real angular_deflection,
+        const MeshProgress &progress = MeshProgress());
+
+private:
+    struct Key
+    {
+        const TopoDS_TShape *tshape;
+        Standard_Real linear_deflection;
+        Standard_Real angular_deflection;
+
+        bool operator <(const Key &other) const
+        {
+            if (tshape != other.tshape) {
+                return tshape < other.tshape;
+            } else if (linear_deflection != other.linear_deflection) {
+                return linear_deflection < other.linear_deflection;
+            } else {
+                return angular_deflection < other.angular_deflection;
+            }
+        }
+    };
+
+    struct Entry
+    {
+        TopoDS_Shape shape;
+        MeshPtr mesh;
+    };
+
+    typedef std::multimap<Key, Entry> EntryMap;
+
+    static Key make_key(const TopoDS_Shape &shape,
+        Standard_Real linear_deflection, Standard_Real angular_deflection);
+    MeshPtr find_locked(const Key &key, const TopoDS_Shape &shape);
+
+    std::mutex mutex;
+    EntryMap entries;
+    std::deque<EntryMap::iterator> insertion_order;
+    size_t total_size;
+};
+
+TessellationCache::Key TessellationCache::make_key(const TopoDS_Shape &shape,
+    Standard_Real linear_deflection, Standard_Real angular_deflection)
+{
+    Key key;
+    key.tshape = shape.TShape().operator->();
+    key.linear_deflection = linear_deflection;
+    key.angular_deflection = angular_deflection;
+    return key;
+}
+
+TessellationCache::MeshPtr TessellationCache::find_locked(const Key &key,
+    const TopoDS_Shape &shape)
+{
+    std::pair<EntryMap::iterator, EntryMap::iterator> range =
+        entries.equal_range(key);
+    for (EntryMap::iterator it = range.first; it != range.second; ++it) {
+        // same TShape, location and orientation
+        if (it->second.shape.IsEqual(shape)) {
+            return it->second.mesh;
+        }
+    }
+
+    return MeshPtr();
+}
+
+TessellationCache::MeshPtr TessellationCache::get(const TopoDS_Shape &shape,
+    Standard_Real linear_deflection, Standard_Real angular_deflection,
+    const MeshProgress &progress)
+{
+    const Key key = make_key(shape, linear_deflection, angular_deflection);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        MeshPtr mesh = find_locked(key, shape);
+        if (mesh) {
+            return mesh;
+        }
+    }
+
+    // not holding the lock, so other shapes can be looked up meanwhile. if
+    // another thread meshes the same shape at the same time, the first
+    // result is kept.
+    MeshPtr mesh = std::make_shared<const IndexedMesh>(make_indexed_mesh(
+        shape, linear_deflection, angular_deflection, progress));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    MeshPtr existing = find_locked(key, shape);
+    if (existing) {
+        return existing;
+    }
+
+    Entry entry;
+    entry.shape = shape;
+    entry.mesh = mesh;
+    insertion_order.push_back(entries.insert(std::make_pair(key, entry)));
+    total_size += mesh->memory_size();
+
+    // always keep the newest mesh, even if it's larger than MAX_SIZE
+    while (total_size > MAX_SIZE && insertion_order.size() > 1) {
+        EntryMap::iterator oldest = insertion_order.front();
+        insertion_order.pop_front();
+        total_size -= oldest->second.mesh->memory_size();
+        entries.erase(oldest);
+    }
+
+    return mesh;
+}
+
+static TessellationCache tessellation_cache;
+
+// meshes shape with $tol as its linear deflection, or returns its cached
+// mesh
+static TessellationCache::MeshPtr get_tessellation(const TopoDS_Shape &shape,
+    Standard_Real tolerance, const MeshProgress &progress = MeshProgress())
+{
+    return tessellation_cache.get(shape, tolerance,
+        MESH_ANGULAR_DEFLECTION, progress);
+}
+
+
+// writes a face's triangulation, oriented so that normals point outwards
+static void write_face_triangles(StlFileWriter &writer,
+    const TopoDS_Face &face)
+{
+    TopLoc_Location loc;
+    Handle(Poly_Triangulation) tri = BRep_Tool::Triangulation(face, loc);
+    if (tri.IsNull()) {
+        raise_oce_error("No triangulation");
+    }
+
+    const bool reversed = (face.Orientation() == TopAbs_REVERSED);
+    const gp_Trsf trsf = loc.Transformation();
+    const TColgp_Array1OfPnt &nodes = tri->Nodes();
+    const Poly_Array1OfTriangle &triangles = tri->Triangles();
+
+    for (int i = triangles.Lower(); i <= triangles.Upper(); ++i) {
+        Standard_Integer n1, n2, n3;
+        triangles(i).Get(n1, n2, n3);
+        if (reversed) {
+            std::swap(n2, n3);
+        }
+
+        writer.add_triangle(
+            nodes(n1).Transformed(trsf),
+            nodes(n2).Transformed(trsf),
+            nodes(n3).Transformed(trsf));
+    }
+}
+
+// each chunk of faces is written as soon as it's meshed, and mesh_faces
+// drops its triangles once its neighbours are meshed; STL repeats every
+// vertex anyway, so it's not worth building (and caching) a welded mesh.
+// shapes are always meshed afresh, even if the tessellation cache has them,
+// so the file only depends on the shape and the tolerance.
+static void write_stl_file(const TopoDS_Shape &shape, const std::string &path,
+    Standard_Real tolerance, const MeshProgress &progress)
+{
+    StlFileWriter writer(path);
+    mesh_faces(shape, tolerance, MESH_ANGULAR_DEFLECTION, progress,
+        [&](const TopoDS_Face &face) {
+            write_face_triangles(writer, face);
+        });
+
+    writer.finish();
+}
+
+// if given a block, calls it with (faces meshed, total faces) as the shape
+// is meshed. the file is deleted if the block raises.
+void shape_write_stl(Object self, String path)
+{
+    const std::string path_str = path.str();
+    const Standard_Real tolerance = get_tolerance();
+    const TopoDS_Shape shape = *render_shape(self);
+    ProgressReporter progress(
+        rb_block_given_p() ? Object(rb_block_proc()) : Object(Qnil));
+
+    try {
+        without_gvl([&] {
+            ProfileScope scope("export", "export stl");
+            write_stl_file(shape, path_str, tolerance,
+                [&](size_t done, size_t total) {
+                    return progress.report(done, total);
+                });
+        });
+    } catch (const Standard_Failure &) {
+        // if the progress block raised, that's the more useful error
+        progress.check();
+        throw;
+    }
+}
+
+
+// a FILE that raises OCE exceptions on errors
+class OutputFile
+{
+public:
+    explicit OutputFile(const std::string &path)
+        : path(path)
+    {
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            raise_oce_error("failed opening %s: %s",
+                path.c_str(), strerror(errno));
+        }
+
+        setvbuf(file, NULL, _IOFBF, 1 << 20);
+    }
+
+    ~OutputFile()
+    {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    void write(const void *data, size_t size)
+    {
+        if (size > 0 && fwrite(data, size, 1, file) != 1) {
+            fail();
+        }
+    }
+
+    void write(const std::string &data)
+    {
+        write(data.data(), data.size());
+    }
+
+    void close()
+    {
+        const int err = fclose(file);
+        file = NULL;
+        if (err) {
+            fail();
+        }
+    }
+
+private:
+    void fail()
+    {
+        raise_oce_error("failed writing %s: %s",
+            path.c_str(), strerror(errno));
+    }
+
+    std::string path;
+    FILE *file;
+};
+
+// formats into a std::string, which is flushed to a file every so often
+class TextWriter
+{
+public:
+    explicit TextWriter(std::function<void (const std::string &)> flush_func)
+        : flush_func(flush_func)
+    {
+    }
+
+    void printf(const char *format, ...)
+    {
+        char line[256];
+
+        va_list args;
+        va_start(args, format);
+        const int len = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+
+        if (len > 0) {
+            text.append(line, std::min<size_t>(len, sizeof(line) - 1));
+        }
+        if (text.size() >= (1 << 16)) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        flush_func(text);
+        text.clear();
+    }
+
+private:
+    std::function<void (const std::string &)> flush_func;
+    std::string text;
+};
+
+static void write_obj(const IndexedMesh &mesh, const std::string &path)
+{
+    OutputFile file(path);
+    TextWriter text([&](const std::string &data) { file.write(data); });
+
+    text.printf("# written by rcad\n");
+
+    for (size_t i = 0; i < mesh.vertices.size(); i += 3) {
+        text.printf("v %.9g %.9g %.9g\n",
+            mesh.vertices[i], mesh.vertices[i + 1], mesh.vertices[i + 2]);
+    }
+
+    // OBJ indices start at 1
+    for (size_t i = 0; i < mesh.triangles.size(); i += 3) {
+        text.printf("f %u %u %u\n",
+            mesh.triangles[i] + 1,
+            mesh.triangles[i + 1] + 1,
+            mesh.triangles[i + 2] + 1);
+    }
+
+    text.flush();
+    file.close();
+}
+
+static void write_ply(const IndexedMesh &mesh, const std::string &path)
+{
+    OutputFile file(path);
+
+    char header[512];
+    snprintf(header, sizeof(header),
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "comment written by rcad\n"
+        "element vertex %lu\n"
+        "property float x\n"
+        "property float y\n"
+        "property float z\n"
+        "element face %lu\n"
+        "property list uchar uint vertex_indices\n"
+        "end_header\n",
+        static_cast<unsigned long>(mesh.num_vertices()),
+        static_cast<unsigned long>(mesh.num_triangles()));
+    file.write(header, strlen(header));
+
+    std::vector<char> buffer;
+    const size_t flush_size = 1 << 16;
+
+    for (size_t i = 0; i < mesh.vertices.size(); i += 3) {
+        char vertex[12];
+        char *out = vertex;
+        for (int j = 0; j < 3; ++j) {
+            out = put_float_le(out, mesh.vertices[i + j]);
+        }
+
+        buffer.insert(buffer.end(), vertex, vertex + sizeof(vertex));
+        if (buffer.size() >= flush_size) {
+            file.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    for (size_t i = 0; i < mesh.triangles.size(); i += 3) {
+        char face[13];
+        char *out = face;
+        *out++ = 3;
+        for (int j = 0; j < 3; ++j) {
+            out = put_uint32_le(out, mesh.triangles[i + j]);
+        }
+
+        buffer.insert(buffer.end(), face, face + sizeof(face));
+        if (buffer.size() >= flush_size) {
+            file.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    file.write(buffer.data(), buffer.size());
+    file.close();
+}
+
+
+static char *put_uint16_le(char *out, uint16_t value)
+{
+    out[0] = static_cast<char>(value & 0xff);
+    out[1] = static_cast<char>((value >> 8) & 0xff);
+    return out + 2;
+}
+
+// writes a zip archive, deflating each entry as it's written, so entries
+// never have to be held in memory. sizes and CRCs follow each entry's data
+// in a data descriptor. doesn't support zip64, so entries and the whole
+// archive are limited to 4GB.
+class ZipWriter
+{
+public:
+    explicit ZipWriter(OutputFile &file)
+        : file(file),
+          offset(0),
+          in_entry(false)
+    {
+    }
+
+    ~ZipWriter()
+    {
+        if (in_entry) {
+            deflateEnd(&stream);
+        }
+    }
+
+    void begin_entry(const std::string &name);
+    void write(const void *data, size_t size);
+    void end_entry();
+
+    // writes the central directory
+    void finish();
+
+private:
+    struct Entry
+    {
+        std::string name;
+        uint32_t crc;
+        uint32_t compressed_size;
+        uint32_t uncompressed_size;
+        uint32_t offset;
+    };
+
+    static const uint16_t VERSION = 20;
+    static const uint16_t FLAG_DATA_DESCRIPTOR = 0x0008;
+    static const uint16_t METHOD_DEFLATE = 8;
+
+    void deflate_input(int flush);
+    void write_raw(const void *data, size_t size);
+
+    OutputFile &file;
+    uint64_t offset;
+
+    std::vector<Entry> entries;
+    bool in_entry;
+    z_stream stream;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uLong crc;
+};
+
+void ZipWriter::begin_entry(const std::string &name)
+{
+    Entry entry;
+    entry.name = name;
+    entry.offset = static_cast<uint32_t>(offset);
+    entries.push_back(entry);
+
+    char header[30];
+    char *out = header;
+    out = put_uint32_le(out, 0x04034b50);
+    out = put_uint16_le(out, VERSION);
+    out = put_uint16_le(out, FLAG_DATA_DESCRIPTOR);
+    out = put_uint16_le(out, METHOD_DEFLATE);
+    out = put_uint16_le(out, 0);        // time
+    out = put_uint16_le(out, 0x21);     // date, 1980-01-01
+    out = put_uint32_le(out, 0);        // crc, in data descriptor
+    out = put_uint32_le(out, 0);        // compressed size, ditto
+    out = put_uint32_le(out, 0);        // uncompressed size, ditto
+    out = put_uint16_le(out, name.size());
+    out = put_uint16_le(out, 0);        // extra field length
+    write_raw(header, sizeof(header));
+    write_raw(name.data(), name.size());
+
+    memset(&stream, 0, sizeof(stream));
+    // negative window bits give raw deflate data, without a zlib header
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+            8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        raise_oce_error("failed initializing zlib");
+    }
+
+    in_entry = true;
+    compressed_size = 0;
+    uncompressed_size = 0;
+    crc = crc32(0, Z_NULL, 0);
+}
+
+void ZipWriter::write(const void *data, size_t size)
+{
+    const Bytef *bytes = static_cast<const Bytef *>(data);
+    crc = crc32(crc, bytes, size);
+    uncompressed_size += size;
+
+    stream.next_in = const_cast<Bytef *>(bytes);
+    stream.avail_in = size;
+    deflate_input(Z_NO_FLUSH);
+}
+
+void ZipWriter::end_entry()
+{
+    stream.next_in = Z_NULL;
+    stream.avail_in = 0;
+    deflate_input(Z_FINISH);
+    deflateEnd(&stream);
+    in_entry = false;
+
+    if (compressed_size > 0xffffffffu || uncompressed_size > 0xffffffffu) {
+        raise_oce_error("zip entry %s is too large",
+            entries.back().name.c_str());
+    }
+
+    Entry &entry = entries.back();
+    entry.crc = crc;
+    entry.compressed_size = compressed_size;
+    entry.uncompressed_size = uncompressed_size;
+
+    char descriptor[16];
+    char *out = descriptor;
+    out = put_uint32_le(out, 0x08074b50);
+    out = put_uint32_le(out, entry.crc);
+    out = put_uint32_le(out, entry.compressed_size);
+    out = put_uint32_le(out, entry.uncompressed_size);
+    write_raw(descriptor, sizeof(descriptor));
+}
+
+void ZipWriter::deflate_input(int flush)
+{
+    char buffer[1 << 16];
+
+    int err;
+    do {
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = sizeof(buffer);
+        err = deflate(&stream, flush);
+        if (err == Z_STREAM_ERROR) {
+            raise_oce_error("zlib error while writing zip file");
+        }
+
+        const size_t size = sizeof(buffer) - stream.avail_out;
+        write_raw(buffer, size);
+        compressed_size += size;
+    } while (stream.avail_out == 0 || (flush == Z_FINISH && err != Z_STREAM_END));
+}
+
+void ZipWriter::finish()
+{
+    const uint64_t dir_offset = offset;
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Entry &entry = entries[i];
+
+        char header[46];
+        char *out = header;
+        out = put_uint32_le(out, 0x02014b50);
+        out = put_uint16_le(out, VERSION);      // made by
+        out = put_uint16_le(out, VERSION);      // needed to extract
+        out = put_uint16_le(out, FLAG_DATA_DESCRIPTOR);
+        out = put_uint16_le(out, METHOD_DEFLATE);
+        out = put_uint16_le(out, 0);            // time
+        out = put_uint16_le(out, 0x21);         // date
+        out = put_uint32_le(out, entry.crc);
+        out = put_uint32_le(out, entry.compressed_size);
+        out = put_uint32_le(out, entry.uncompressed_size);
+        out = put_uint16_le(out, entry.name.size());
+        out = put_uint16_le(out, 0);            // extra field length
+        out = put_uint16_le(out, 0);            // comment length
+        out = put_uint16_le(out, 0);            // disk number
+        out = put_uint16_le(out, 0);            // internal attributes
+        out = put_uint32_le(out, 0);            // external attributes
+        out = put_uint32_le(out, entry.offset);
+        write_raw(header, sizeof(header));
+        write_raw(entry.name.data(), entry.name.size());
+    }
+
+    const uint64_t dir_size = offset - dir_offset;
+    if (offset > 0xffffffffu) {
+        raise_oce_error("zip file is too large");
+    }
+
+    char end[22];
+    char *out = end;
+    out = put_uint32_le(out, 0x06054b50);
+    out = put_uint16_le(out, 0);                // disk number
+    out = put_uint16_le(out, 0);                // disk with directory
+    out = put_uint16_le(out, entries.size());
+    out = put_uint16_le(out, entries.size());
+    out = put_uint32_le(out, dir_size);
+    out = put_uint32_le(out, dir_offset);
+    out = put_uint16_le(out, 0);                // comment length
+    write_raw(end, sizeof(end));
+}
+
+void ZipWriter::write_raw(const void *data, size_t size)
+{
+    file.write(data, size);
+    offset += size;
+}
+
+static void write_3mf(const IndexedMesh &mesh, const std::string &path)
+{
+    OutputFile file(path);
+    ZipWriter zip(file);
+
+    const std::string content_types =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/"
+            "content-types\">\n"
+        " <Default Extension=\"rels\" ContentType=\"application/"
+            "vnd.openxmlformats-package.relationships+xml\"/>\n"
+        " <Default Extension=\"model\" ContentType=\"application/"
+            "vnd.ms-package.3dmanufacturing-3dmodel+xml\"/>\n"
+        "</Types>\n";
+    zip.begin_entry("[Content_Types].xml");
+    zip.write(content_types.data(), content_types.size());
+    zip.end_entry();
+
+    const std::string rels =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/"
+            "2006/relationships\">\n"
+        " <Relationship Target=\"/3D/3dmodel.model\" Id=\"rel0\" "
+            "Type=\"http://schemas.microsoft.com/3dmanufacturing/2013/01/"
+            "3dmodel\"/>\n"
+        "</Relationships>\n";
+    zip.begin_entry("_rels/.rels");
+    zip.write(rels.data(), rels.size());
+    zip.end_entry();
+
+    zip.begin_entry("3D/3dmodel.model");
+    TextWriter text([&](const std::string &data) {
+        zip.write(data.data(), data.size());
+    });
+
+    text.printf(
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<model unit=\"millimeter\" xml:lang=\"en-US\" "
+            "xmlns=\"http://schemas.microsoft.com/3dmanufacturing/core/"
+            "2015/02\">\n"
+        " <resources>\n"
+        "  <object id=\"1\" type=\"model\">\n"
+        "   <mesh>\n"
+        "    <vertices>\n");
+
+    for (size_t i = 0; i < mesh.vertices.size(); i += 3) {
+        text.printf("     <vertex x=\"%.9g\" y=\"%.9g\" z=\"%.9g\"/>\n",
+            mesh.vertices[i], mesh.vertices[i + 1], mesh.vertices[i + 2]);
+    }
+
+    text.printf(
+        "    </vertices>\n"
+        "    <triangles>\n");
+
+    for (size_t i = 0; i < mesh.triangles.size(); i += 3) {
+        text.printf("     <triangle v1=\"%u\" v2=\"%u\" v3=\"%u\"/>\n",
+            mesh.triangles[i], mesh.triangles[i + 1], mesh.triangles[i + 2]);
+    }
+
+    text.printf(
+        "    </triangles>\n"
+        "   </mesh>\n"
+        "  </object>\n"
+        " </resources>\n"
+        " <build>\n"
+        "  <item objectid=\"1\"/>\n"
+        " </build>\n"
+        "</model>\n");
+    text.flush();
+    zip.end_entry();
+
+    zip.finish();
+    file.close();
+}
+
+// format is "obj", "ply" or "3mf". Shape#write_mesh picks it according to
+// the file's extension.
+void shape__write_mesh(Object self, String path, String format)
+{
+    const std::string path_str = path.str();
+    const std::string format_str = format.str();
+    const Standard_Real tolerance = get_tolerance();
+
+    void (*writer)(const IndexedMesh &, const std::string &);
+    if (format_str == "obj") {
+        writer = write_obj;
+    } else if (format_str == "ply") {
+        writer = write_ply;
+    } else if (format_str == "3mf") {
+        writer = write_3mf;
+    } else {
+        throw Exception(rb_eArgError, "unknown mesh format %s",
+            format_str.c_str());
+    }
+
+    const TopoDS_Shape shape = *render_shape(self);
+
+    without_gvl([&] {
+        ProfileScope scope("export", "export " + format_str);
+        writer(*get_tessellation(shape, tolerance), path_str);
+    });
+}
+
+Object shape__bbox(Object self)
+{
+    const TopoDS_Shape shape = *render_shape(self);
+
+    // from the exact geometry, not a cached mesh, whose chords can cut
+    // inside curved faces, so the box is the same whatever was done with
+    // the shape before
+    Standard_Real minXYZ[3];
+    Standard_Real maxXYZ[3];
+    without_gvl([&] {
+        Bnd_Box bbox;
+        BRepBndLib::Add(shape, bbox);
+        bbox.Get(
+            minXYZ[0], minXYZ[1], minXYZ[2],
+            maxXYZ[0], maxXYZ[1], maxXYZ[2]);
+
+        const Standard_Real gap = bbox.GetGap();
+        for (int i = 0; i < 3; ++i) {
+            minXYZ[i] += gap;
+            maxXYZ[i] -= gap;
+        }
+    });
+
+    Array res;
+    res.push(Array(minXYZ));
+    res.push(Array(maxXYZ));
+    return res;
+}
+
+
+// a triangle mesh in double precision, as used by the mesh booleans.
+// triangles are counter-clockwise seen from outside.
+struct TriangleMesh
+{
+    std::vector<gp_XYZ> vertices;
+    // vertex indices, 3 per triangle
+    std::vector<uint32_t> triangles;
+
+    size_t num_triangles() const
+    {
+        return triangles.size() / 3;
+    }
+
+    const gp_XYZ &corner(size_t triangle, int i) const
+    {
+        return vertices[triangles[3 * triangle + i]];
+    }
+};
+
+static TopoDS_Shape make_mesh_shape(const TriangleMesh &mesh)
+{
+    if (mesh.triangles.empty()) {
+        return make_empty_shape();
+    }
+
+    Handle(Poly_Triangulation) tri = new Poly_Triangulation(
+        mesh.vertices.size(), mesh.num_triangles(), Standard_False);
+
+    TColgp_Array1OfPnt &nodes = tri->ChangeNodes();
+    for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+        nodes.SetValue(i + 1, gp_Pnt(mesh.vertices[i]));
+    }
+
+    Poly_Array1OfTriangle &triangles = tri->ChangeTriangles();
+    for (size_t i = 0; i < mesh.num_triangles(); ++i) {
+        triangles.SetValue(i + 1, Poly_Triangle(
+            mesh.triangles[3 * i] + 1,
+            mesh.triangles[3 * i + 1] + 1,
+            mesh.triangles[3 * i + 2] + 1));
+    }
+
+    TopoDS_Face face;
+    BRep_Builder().MakeFace(face, tri);
+    return face;
+}
+
+static TriangleMesh get_mesh_shape_triangles(const TopoDS_Shape &shape)
+{
+    const TopoDS_Face &face = TopoDS::Face(shape);
+    TopLoc_Location loc;
+    Handle(Poly_Triangulation) tri = BRep_Tool::Triangulation(face, loc);
+
+    TriangleMesh mesh;
+    const gp_Trsf trsf = loc.Transformation();
+    const TColgp_Array1OfPnt &nodes = tri->Nodes();
+    mesh.vertices.reserve(nodes.Length());
+    for (int i = nodes.Lower(); i <= nodes.Upper(); ++i) {
+        mesh.vertices.push_back(nodes(i).Transformed(trsf).XYZ());
+    }
+
+    const bool reversed = (face.Orientation() == TopAbs_REVERSED);
+    const Poly_Array1OfTriangle &triangles = tri->Triangles();
+    mesh.triangles.reserve(3 * triangles.Length());
+    for (int i = triangles.Lower(); i <= triangles.Upper(); ++i) {
+        Standard_Integer n1, n2, n3;
+        triangles(i).Get(n1, n2, n3);
+        if (reversed) {
+            std::swap(n2, n3);
+        }
+
+        mesh.triangles.push_back(n1 - nodes.Lower());
+        mesh.triangles.push_back(n2 - nodes.Lower());
+        mesh.triangles.push_back(n3 - nodes.Lower());
+    }
+
+    return mesh;
+}
+
+// the triangles of a mesh shape, or of any other shape's tessellation
+static TriangleMesh get_triangle_mesh(const TopoDS_Shape &shape,
+    Standard_Real tolerance)
+{
+    if (is_mesh_shape(shape)) {
+        return get_mesh_shape_triangles(shape);
+    }
+
+    TessellationCache::MeshPtr indexed = get_tessellation(shape, tolerance);
+
+    TriangleMesh mesh;
+    mesh.vertices.reserve(indexed->num_vertices());
+    for (size_t i = 0; i < indexed->num_vertices(); ++i) {
+        mesh.vertices.push_back(indexed->vertex(i).XYZ());
+    }
+
+    mesh.triangles = indexed->triangles;
+    return mesh;
+}
+
+// hashes coordinates exactly, for welding vertices
+struct XYZKey
+{
+    Standard_Real coords[3];
+
+    explicit XYZKey(const gp_XYZ &xyz)
+    {
+        // adding 0 turns -0 into 0
+        coords[0] = xyz.X() + 0.0;
+        coords[1] = xyz.Y() + 0.0;
+        coords[2] = xyz.Z() + 0.0;
+    }
+
+    bool operator ==(const XYZKey &other) const
+    {
+        return memcmp(coords, other.coords, sizeof(coords)) == 0;
+    }
+};
+
+struct XYZKeyHash
+{
+    size_t operator ()(const XYZKey &key) const
+    {
+        uint64_t bits[3];
+        memcpy(bits, key.coords, sizeof(bits));
+
+        uint64_t hash = 14695981039346656037ull;
+        for (int i = 0; i < 3; ++i) {
+            hash = (hash ^ bits[i]) * 1099511628211ull;
+            hash ^= hash >> 29;
+        }
+
+        return static_cast<size_t>(hash);
+    }
+};
+
+typedef std::unordered_map<XYZKey, uint32_t, XYZKeyHash> XYZIndexMap;
+
+// STL import. the file is memory-mapped and split into ranges of
+// triangles (binary STL) or lines (ASCII STL), which are parsed by separate
+// threads. STL repeats a vertex for every triangle using it, so each thread
+// welds its range's vertices exactly as it goes. the ranges are then merged
+// into one indexed mesh, along with vertices closer than a weld tolerance.
+
+// a read-only mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    const char *data() const
+    {
+        return begin;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator =(const MappedFile &);
+
+    int fd;
+    const char *begin;
+    size_t length;
+};
+
+MappedFile::MappedFile(const std::string &path)
+    : fd(-1),
+      begin(NULL),
+      length(0)
+{
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        raise_oce_error("failed opening %s: %s",
+            path.c_str(), strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const int error = errno;
+        close(fd);
+        raise_oce_error("failed reading %s: %s",
+            path.c_str(), strerror(error));
+    }
+
+    // mmap refuses empty files
+    length = st.st_size;
+    if (0 == length) {
+        return;
+    }
+
+    void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == addr) {
+        const int error = errno;
+        close(fd);
+        raise_oce_error("failed mapping %s: %s",
+            path.c_str(), strerror(error));
+    }
+
+    madvise(addr, length, MADV_SEQUENTIAL);
+    begin = static_cast<const char *>(addr);
+}
+
+MappedFile::~MappedFile()
+{
+    if (begin) {
+        munmap(const_cast<char *>(begin), length);
+    }
+
+    close(fd);
+}
+
+// STL coordinates are single precision
+struct StlVertex
+{
+    float coords[3];
+
+    bool operator ==(const StlVertex &other) const
+    {
+        return memcmp(coords, other.coords, sizeof(coords)) == 0;
+    }
+};
+
+// gives each distinct vertex an index, in the order they're first seen.
+// there can be millions of them, so this is an open-addressing hash table
+// of indices rather than a std::unordered_map.
+class StlVertexSet
+{
+public:
+    StlVertexSet()
+        : slots(1024, 0)
+    {
+    }
+
+    uint32_t insert(const StlVertex &vertex);
+
+    std::vector<StlVertex> vertices;
+
+private:
+    static size_t hash(const StlVertex &vertex);
+    void grow();
+
+    // vertex index + 1, or 0 if empty
+    std::vector<uint32_t> slots;
+};
+
+size_t StlVertexSet::hash(const StlVertex &vertex)
+{
+    uint32_t bits[3];
+    memcpy(bits, vertex.coords, sizeof(bits));
+
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < 3; ++i) {
+        hash = (hash ^ bits[i]) * 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+
+    return static_cast<size_t>(hash);
+}
+
+uint32_t StlVertexSet::insert(const StlVertex &vertex)
+{
+    // keep the table at most half full
+    if (2 * (vertices.size() + 1) > slots.size()) {
+        grow();
+    }
+
+    const size_t mask = slots.size() - 1;
+    for (size_t slot = hash(vertex) & mask; ; slot = (slot + 1) & mask) {
+        if (0 == slots[slot]) {
+            vertices.push_back(vertex);
+            slots[slot] = vertices.size();
+            return vertices.size() - 1;
+        }
+
+        if (vertices[slots[slot] - 1] == vertex) {
+            return slots[slot] - 1;
+        }
+    }
+}
+
+void StlVertexSet::grow()
+{
+    std::vector<uint32_t> grown(2 * slots.size(), 0);
+    const size_t mask = grown.size() - 1;
+
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        size_t slot = hash(vertices[i]) & mask;
+        while (grown[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+
+        grown[slot] = i + 1;
+    }
+
+    slots.swap(grown);
+}
+
+// one thread's share of an STL file
+struct StlChunk
+{
+    StlChunk()
+        : malformed(false)
+    {
+    }
+
+    StlVertexSet vertices;
+    // an index into vertices for each triangle corner
+    std::vector<uint32_t> corners;
+    bool malformed;
+};
+
+static void add_stl_corner(StlChunk &chunk, StlVertex &vertex)
+{
+    // adding 0 turns -0 into 0, so they're welded together
+    for (int i = 0; i < 3; ++i) {
+        vertex.coords[i] += 0.0f;
+    }
+
+    chunk.corners.push_back(chunk.vertices.insert(vertex));
+}
+
+static void parse_binary_stl(const char *data, size_t first_triangle,
+    size_t end_triangle, StlChunk &chunk)
+{
+    // 80 byte header and triangle count, then for each triangle its normal,
+    // corners and a 2 byte attribute. assumes a little endian machine.
+    const size_t header_size = 84;
+    const size_t triangle_size = 50;
+
+    chunk.corners.reserve(3 * (end_triangle - first_triangle));
+    for (size_t t = first_triangle; t < end_triangle; ++t) {
+        const char *record = data + header_size + t * triangle_size;
+        for (int i = 0; i < 3; ++i) {
+            StlVertex vertex;
+            memcpy(vertex.coords, record + 12 * (i + 1),
+                sizeof(vertex.coords));
+            add_stl_corner(chunk, vertex);
+        }
+    }
+}
+
+static bool is_stl_space(char c)
+{
+    return ' ' == c || '\t' == c || '\r' == c;
+}
+
+// parses a number at p, which isn't followed by a terminating NUL, so
+// strtod can't be used
+static bool parse_stl_float(const char *&p, const char *end, float &value)
+{
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    while (p < end && is_stl_space(*p)) {
+        ++p;
+    }
+
+    bool negative = false;
+    if (p < end && ('-' == *p || '+' == *p)) {
+        negative = ('-' == *p);
+        ++p;
+    }
+
+    // digits beyond what a uint64_t holds only shift the exponent
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int num_digits = 0;
+    bool seen_point = false;
+    for (; p < end; ++p) {
+        if ('.' == *p && !seen_point) {
+            seen_point = true;
+        } else if (*p >= '0' && *p <= '9') {
+            if (mantissa < 1000000000000000000ull) {
+                mantissa = 10 * mantissa + (*p - '0');
+                exponent -= seen_point;
+            } else {
+                exponent += !seen_point;
+            }
+            ++num_digits;
+        } else {
+            break;
+        }
+    }
+
+    if (0 == num_digits) {
+        return false;
+    }
+
+    if (p < end && ('e' == *p || 'E' == *p)) {
+        ++p;
+        bool negative_exponent = false;
+        if (p < end && ('-' == *p || '+' == *p)) {
+            negative_exponent = ('-' == *p);
+            ++p;
+        }
+
+        if (p == end || *p < '0' || *p > '9') {
+            return false;
+        }
+
+        int written_exponent = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+            written_exponent = std::min(10 * written_exponent + (*p - '0'),
+                10000);
+        }
+
+        exponent += negative_exponent ? -written_exponent : written_exponent;
+    }
+
+    double result = static_cast<double>(mantissa);
+    if (exponent < 0 && exponent >= -22) {
+        result /= powers_of_ten[-exponent];
+    } else if (exponent > 0 && exponent <= 22) {
+        result *= powers_of_ten[exponent];
+    } else if (exponent != 0) {
+        result *= pow(10.0, exponent);
+    }
+
+    value = static_cast<float>(negative ? -result : result);
+    return true;
+}
+
+// only "vertex x y z" lines matter. facets are made of every 3 vertices,
+// even when a chunk's range ends in the middle of one.
+static void parse_ascii_stl(const char *p, const char *end, StlChunk &chunk)
+{
+    while (p < end) {
+        const char *line_end =
+            static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!line_end) {
+            line_end = end;
+        }
+
+        while (p < line_end && is_stl_space(*p)) {
+            ++p;
+        }
+
+        if (line_end - p > 6 && memcmp(p, "vertex", 6) == 0 &&
+            is_stl_space(p[6]))
+        {
+            p += 6;
+
+            StlVertex vertex;
+            for (int i = 0; i < 3; ++i) {
+                if (!parse_stl_float(p, line_end, vertex.coords[i])) {
+                    chunk.malformed = true;
+                    return;
+                }
+            }
+
+            add_stl_corner(chunk, vertex);
+        }
+
+        p = line_end + 1;
+    }
+}
+
+// calls func(i) for each i below count, each on its own thread. the
+// calling thread takes i = 0. func must not throw.
+static void run_on_threads(size_t count,
+    const std::function<void (size_t)> &func)
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; ++i) {
+        threads.push_back(std::thread(func, i));
+    }
+
+    func(0);
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+}
+
+static void parse_stl_chunks(const MappedFile &file, const std::string &path,
+    size_t num_threads, std::vector<StlChunk> &chunks)
+{
+    const char *data = file.data();
+    const size_t size = file.size();
+
+    uint32_t num_triangles = 0;
+    if (size >= 84) {
+        memcpy(&num_triangles, data + 80, sizeof(num_triangles));
+    }
+
+    // binary files may start with "solid" too, so the size is checked first
+    if (size >= 84 && 84 + 50 * uint64_t(num_triangles) == size) {
+        // a few thousand triangles per thread at least, or starting threads
+        // costs more than it saves
+        const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(
+            num_threads, num_triangles / 4096));
+        chunks.resize(num_chunks);
+
+        run_on_threads(num_chunks, [&](size_t i) {
+            parse_binary_stl(data, num_triangles * i / num_chunks,
+                num_triangles * (i + 1) / num_chunks, chunks[i]);
+        });
+
+        return;
+    }
+
+    const char *p = data;
+    while (p < data + size && (is_stl_space(*p) || '\n' == *p)) {
+        ++p;
+    }
+
+    if (data + size - p < 5 || memcmp(p, "solid", 5) != 0) {
+        raise_oce_error("%s isn't an STL file", path.c_str());
+    }
+
+    // chunks start at the beginning of lines
+    const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(
+        num_threads, size / (1024 * 1024)));
+    std::vector<const char *> starts(1, data);
+    for (size_t i = 1; i < num_chunks; ++i) {
+        const char *start =
+            std::max(starts.back(), data + size * i / num_chunks);
+        const char *newline = static_cast<const char *>(
+            memchr(start, '\n', data + size - start));
+        starts.push_back(newline ? newline + 1 : data + size);
+    }
+    starts.push_back(data + size);
+
+    chunks.resize(num_chunks);
+    run_on_threads(num_chunks, [&](size_t i) {
+        parse_ascii_stl(starts[i], starts[i + 1], chunks[i]);
+    });
+
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].malformed) {
+            raise_oce_error("%s has a malformed vertex", path.c_str());
+        }
+    }
+}
+
+// finds earlier vertices within tolerance of new ones, by looking in the
+// grid cells around them. vertices in a cell are chained through next.
+class WeldGrid
+{
+public:
+    WeldGrid(Standard_Real tolerance, std::vector<gp_XYZ> &vertices)
+        : tolerance(tolerance),
+          vertices(vertices)
+    {
+    }
+
+    uint32_t insert(const gp_XYZ &p);
+
+private:
+    uint64_t cell_key(int64_t x, int64_t y, int64_t z) const
+    {
+        // cells sharing a key just get searched together
+        return (uint64_t(x) * 73856093ull) ^ (uint64_t(y) * 19349663ull) ^
+            (uint64_t(z) * 83492791ull);
+    }
+
+    Standard_Real tolerance;
+    std::vector<gp_XYZ> &vertices;
+    std::unordered_map<uint64_t, uint32_t> cells;
+    std::vector<uint32_t> next;
+};
+
+uint32_t WeldGrid::insert(const gp_XYZ &p)
+{
+    const int64_t x = int64_t(floor(p.X() / tolerance));
+    const int64_t y = int64_t(floor(p.Y() / tolerance));
+    const int64_t z = int64_t(floor(p.Z() / tolerance));
+
+    for (int64_t dx = -1; dx <= 1; ++dx) {
+        for (int64_t dy = -1; dy <= 1; ++dy) {
+            for (int64_t dz = -1; dz <= 1; ++dz) {
+                std::unordered_map<uint64_t, uint32_t>::const_iterator cell =
+                    cells.find(cell_key(x + dx, y + dy, z + dz));
+                if (cell == cells.end()) {
+                    continue;
+                }
+
+                for (uint32_t i = cell->second; i != UINT32_MAX; i = next[i]) {
+                    if ((vertices[i] - p).SquareModulus()
+                        <= tolerance * tolerance)
+                    {
+                        return i;
+                    }
+                }
+            }
+        }
+    }
+
+    const uint32_t index = vertices.size();
+    vertices.push_back(p);
+
+    std::pair<std::unordered_map<uint64_t, uint32_t>::iterator, bool>
+        inserted = cells.insert(std::make_pair(cell_key(x, y, z), index));
+    next.push_back(inserted.second ? UINT32_MAX : inserted.first->second);
+    inserted.first->second = index;
+
+    return index;
+}
+
+// reads an STL file into an indexed mesh, merging vertices closer than
+// weld_tolerance (or only identical ones, if it's 0), and dropping
+// triangles that collapse as a result
+static TriangleMesh read_stl(const std::string &path,
+    Standard_Real weld_tolerance, size_t num_threads)
+{
+    std::vector<StlChunk> chunks;
+    {
+        const MappedFile file(path);
+        parse_stl_chunks(file, path, num_threads, chunks);
+    }
+
+    // the chunks' vertices were welded exactly, which leaves far fewer to
+    // merge here
+    TriangleMesh mesh;
+    StlVertexSet exact;
+    WeldGrid grid(weld_tolerance, mesh.vertices);
+    std::vector<uint32_t> triangle;
+
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        StlChunk &chunk = chunks[i];
+
+        std::vector<uint32_t> remap(chunk.vertices.vertices.size());
+        for (size_t j = 0; j < remap.size(); ++j) {
+            const StlVertex &vertex = chunk.vertices.vertices[j];
+            if (weld_tolerance > 0) {
+                remap[j] = grid.insert(gp_XYZ(vertex.coords[0],
+                    vertex.coords[1], vertex.coords[2]));
+                continue;
+            }
+
+            remap[j] = exact.insert(vertex);
+            if (remap[j] == mesh.vertices.size()) {
+                mesh.vertices.push_back(gp_XYZ(vertex.coords[0],
+                    vertex.coords[1], vertex.coords[2]));
+            }
+        }
+
+        mesh.triangles.reserve(mesh.triangles.size() + chunk.corners.size());
+        for (size_t j = 0; j < chunk.corners.size(); ++j) {
+            triangle.push_back(remap[chunk.corners[j]]);
+            if (triangle.size() < 3) {
+                continue;
+            }
+
+            if (triangle[0] != triangle[1] && triangle[1] != triangle[2] &&
+                triangle[2] != triangle[0])
+            {
+                mesh.triangles.insert(mesh.triangles.end(),
+                    triangle.begin(), triangle.end());
+            }
+            triangle.clear();
+        }
+
+        // done with it, so don't hold on to it while merging the rest
+        chunk = StlChunk();
+    }
+
+    if (!triangle.empty()) {
+        raise_oce_error("%s has a facet without 3 vertices", path.c_str());
+    }
+
+    return mesh;
+}
+
+
+// converts gtrsf to a gp_Trsf, if it's a rigid motion, possibly mirrored
+// and uniformly scaled. returns false for non-uniform scales and shears,
+// which gp_Trsf can't represent.
+static bool gtrsf_to_trsf(const gp_GTrsf &gtrsf, gp_Trsf &trsf)
+{
+    // relative to the scale
+    const Standard_Real tolerance = 1e-9;
+
+    // M is a scaled orthogonal matrix iff M^T * M == s^2 * I
+    const gp_Mat mat = gtrsf.VectorialPart();
+    gp_Mat mtm = mat.Transposed();
+    mtm.Multiply(mat);
+
+    const Standard_Real scale_sq = (mtm(1, 1) + mtm(2, 2) + mtm(3, 3)) / 3;
+    if (scale_sq < gp::Resolution()) {
+        return false;
+    }
+
+    for (int i = 1; i <= 3; ++i) {
+        for (int j = 1; j <= 3; ++j) {
+            const Standard_Real expected = (i == j) ? scale_sq : 0;
+            if (fabs(mtm(i, j) - expected) > tolerance * scale_sq) {
+                return false;
+            }
+        }
+    }
+
+    const gp_XYZ ofs = gtrsf.TranslationPart();
+    trsf.SetValues(
+        mat(1, 1), mat(1, 2), mat(1, 3), ofs.X(),
+        mat(2, 1), mat(2, 2), mat(2, 3), ofs.Y(),
+        mat(3, 1), mat(3, 2), mat(3, 3), ofs.Z(),
+        tolerance, Precision::Confusion());
+    return true;
+}
+
+// mesh shapes have no geometry for BRepBuilderAPI_(G)Transform to work on,
+// so anything but a rigid motion is applied to their vertices
+static TopoDS_Shape transform_mesh_shape(const TopoDS_Shape &shape,
+    const gp_GTrsf &gtrsf)
+{
+    TriangleMesh mesh = get_mesh_shape_triangles(shape);
+    for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+        gtrsf.Transforms(mesh.vertices[i]);
+    }
+
+    // mirrors turn triangles inside out
+    if (gtrsf.VectorialPart().Determinant() < 0) {
+        for (size_t i = 0; i < mesh.triangles.size(); i += 3) {
+            std::swap(mesh.triangles[i + 1], mesh.triangles[i + 2]);
+        }
+    }
+
+    return make_mesh_shape(mesh);
+}
+
+static TopoDS_Shape transform_shape(const TopoDS_Shape &shape,
+    const gp_GTrsf &gtrsf)
+{
+    gp_Trsf trsf;
+    if (!gtrsf_to_trsf(gtrsf, trsf)) {
+        if (is_mesh_shape(shape)) {
+            return transform_mesh_shape(shape, gtrsf);
+        }
+
+        return BRepBuilderAPI_GTransform(shape, gtrsf, Standard_True).Shape();
+    }
+
+    if (trsf.Form() == gp_Identity) {
+        return shape;
+    }
+
+    const bool is_rigid = !trsf.IsNegative()
+        && fabs(trsf.ScaleFactor() - 1) <= Precision::Confusion();
+    if (is_mesh_shape(shape) && !is_rigid) {
+        return transform_mesh_shape(shape, gtrsf);
+    }
+
+    // rigid motions only change the shape's location, and share its
+    // geometry. mirrors and uniform scales are applied to the geometry, but
+    // exactly, without approximating it.
+    return BRepBuilderAPI_Transform(shape, trsf, Standard_False).Shape();
+}
+
+static RenderTask *plan_transformed_shape(RenderPlan &plan, Object self)
+{
+    const gp_GTrsf transform = from_ruby<gp_GTrsf>(self.iv_get("@trsf"));
+    RenderTask *shape = plan.add_shape(self.iv_get("@shape"));
+
+    return plan.add_task(shape, [=](const TaskInputs &inputs) {
+        return transform_shape(inputs[0], transform);
+    });
+}
+
+typedef std::vector<size_t> Path;
+
+// points are either an Array of [x, y] or [x, y, z] Arrays, or a String of
+// packed native-endian doubles, packed_dim per point
+static std::vector<gp_Pnt> points_from_ruby(Object points, size_t packed_dim)
+{
+    std::vector<gp_Pnt> result;
+
+    if (points.is_a(rb_cString)) {
+        const String packed(points);
+        const size_t point_size = packed_dim * sizeof(double);
+        if (packed.length() % point_size != 0) {
+            throw Exception(rb_eArgError,
+                "packed points must have %lu doubles each",
+                (unsigned long)packed_dim);
+        }
+
+        const size_t num_points = packed.length() / point_size;
+        std::vector<double> coords(num_points * packed_dim);
+        memcpy(coords.data(), packed.c_str(), packed.length());
+
+        result.reserve(num_points);
+        for (size_t i = 0; i < num_points; ++i) {
+            const double *xyz = &coords[i * packed_dim];
+            result.push_back(gp_Pnt(xyz[0], xyz[1],
+                (packed_dim > 2) ? xyz[2] : 0));
+        }
+
+        return result;
+    }
+
+    const Array ary(points);
+    result.reserve(ary.size());
+
+    for (size_t i = 0; i < ary.size(); ++i) {
+        result.push_back(from_ruby<gp_Pnt>(ary[i]));
+    }
+
+    return result;
+}
+
+static void check_point_index(size_t idx, size_t num_points)
+{
+    if (idx >= num_points) {
+        throw Exception(rb_eArgError,
+            "path refers to point %lu, but there are only %lu points",
+            (unsigned long)idx, (unsigned long)num_points);
+    }
+}
+
+static Path path_from_ruby(Array path, size_t num_points)
+{
+    Path result;
+    result.reserve(path.size());
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        const size_t idx = from_ruby<size_t>(path[i]);
+        check_point_index(idx, num_points);
+        result.push_back(idx);
+    }
+
+    return result;
+}
+
+// paths are either an Array of Arrays of point indices, or a String of
+// packed native-endian int32s, with each path's length before its indices
+static std::vector<Path> paths_from_ruby(Object paths, size_t num_points)
+{
+    std::vector<Path> result;
+
+    if (paths.is_a(rb_cString)) {
+        const String packed(paths);
+        if (packed.length() % sizeof(int32_t) != 0) {
+            throw Exception(rb_eArgError, "packed paths must be int32s");
+        }
+
+        std::vector<int32_t> ints(packed.length() / sizeof(int32_t));
+        memcpy(ints.data(), packed.c_str(), packed.length());
+
+        for (size_t i = 0; i < ints.size(); ) {
+            const int32_t length = ints[i++];
+            if (length < 0 || static_cast<size_t>(length) > ints.size() - i) {
+                throw Exception(rb_eArgError,
+                    "packed path at %lu has bad length %d",
+                    (unsigned long)(i - 1), (int)length);
+            }
+
+            Path path;
+            path.reserve(length);
+            for (int32_t j = 0; j < length; ++j, ++i) {
+                if (ints[i] < 0) {
+                    throw Exception(rb_eArgError,
+                        "path refers to point %d", (int)ints[i]);
+                }
+
+                check_point_index(ints[i], num_points);
+                path.push_back(ints[i]);
+            }
+
+            result.push_back(path);
+        }
+
+        return result;
+    }
+
+    const Array ary(paths);
+    result.reserve(ary.size());
+
+    for (size_t i = 0; i < ary.size(); ++i) {
+        result.push_back(path_from_ruby(Array(ary[i]), num_points));
+    }
+
+    return result;
+}
+
+// creates each vertex and edge of a polygon mesh once, so that faces
+// sharing them are connected without sewing
+class MeshTopologyBuilder
+{
+public:
+    explicit MeshTopologyBuilder(const std::vector<gp_Pnt> &points)
+        : points(points),
+          vertices(points.size())
+    {
+    }
+
+    TopoDS_Wire make_wire(const Path &path);
+
+private:
+    const TopoDS_Vertex &vertex(size_t index);
+    // oriented from -> to
+    TopoDS_Edge edge(size_t from, size_t to);
+
+    const std::vector<gp_Pnt> &points;
+    std::vector<TopoDS_Vertex> vertices;
+    std::map<std::pair<size_t, size_t>, TopoDS_Edge> edges;
+};
+
+TopoDS_Wire MeshTopologyBuilder::make_wire(const Path &path)
+{
+    if (path.size() < 3) {
+        raise_oce_error("path has only %lu points", (unsigned long)path.size());
+    }
+
+    BRep_Builder builder;
+    TopoDS_Wire wire;
+    builder.MakeWire(wire);
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        builder.Add(wire, edge(path[i], path[(i + 1) % path.size()]));
+    }
+
+    wire.Closed(Standard_True);
+    return wire;
+}
+
+const TopoDS_Vertex &MeshTopologyBuilder::vertex(size_t index)
+{
+    TopoDS_Vertex &result = vertices[index];
+    if (result.IsNull()) {
+        result = BRepBuilderAPI_MakeVertex(points[index]);
+    }
+
+    return result;
+}
+
+TopoDS_Edge MeshTopologyBuilder::edge(size_t from, size_t to)
+{
+    if (from == to) {
+        raise_oce_error("path repeats point %lu", (unsigned long)from);
+    }
+
+    const bool forward = from < to;
+    TopoDS_Edge &result = edges[forward
+        ? std::make_pair(from, to)
+        : std::make_pair(to, from)];
+    if (result.IsNull()) {
+        result = BRepBuilderAPI_MakeEdge(
+            vertex(std::min(from, to)), vertex(std::max(from, to)));
+    }
+
+    return forward ? result : TopoDS::Edge(result.Reversed());
+}
+
+static RenderTask *plan_polygon(RenderPlan &plan, Object self)
+{
+    const std::vector<gp_Pnt> points = points_from_ruby(
+        self.iv_get("@points"), 2);
+    const std::vector<Path> paths = paths_from_ruby(
+        self.iv_get("@paths"), points.size());
+
+    if (paths.size() == 0) {
+        throw Exception(rb_eArgError,
+            "Polygon must have at least 1 path!");
+    }
+
+    return plan.add_task([=](const TaskInputs &) {
+        MeshTopologyBuilder topology(points);
+
+        BRepBuilderAPI_MakeFace face_maker(topology.make_wire(paths[0]));
+        for (size_t i = 1; i < paths.size(); ++i) {
+            TopoDS_Wire wire = topology.make_wire(paths[i]);
+
+            // all paths except the first are inner loops,
+            // so they should be reversed
+            face_maker.Add(TopoDS::Wire(wire.Oriented(TopAbs_REVERSED)));
+        }
+
+        return face_maker.Shape();
+    });
+}
+
+static RenderTask *plan_circle(RenderPlan &plan, Object self)
+{
+    const Standard_Real dia = from_ruby<Standard_Real>(self.iv_get("@dia"));
+
+    return plan.add_task([=](const TaskInputs &) {
+        gp_Circ circ(gp_Ax2(), dia / 2.0);
+        TopoDS_Edge edge = BRepBuilderAPI_MakeEdge(circ).Edge();
+        TopoDS_Wire wire = BRepBuilderAPI_MakeWire(edge).Wire();
+        return BRepBuilderAPI_MakeFace(wire).Shape();
+    });
+}
+
+
+static RenderTask *plan_box(RenderPlan &plan, Object self)
+{
+    const Standard_Real xsize = from_ruby<Standard_Real>(self.iv_get("@xsize"));
+    const Standard_Real ysize = from_ruby<Standard_Real>(self.iv_get("@ysize"));
+    const Standard_Real zsize = from_ruby<Standard_Real>(self.iv_get("@zsize"));
+
+    return plan.add_task([=](const TaskInputs &) {
+        return BRepPrimAPI_MakeBox(xsize, ysize, zsize).Shape();
+    });
+}
+
+
+static RenderTask *plan_cone(RenderPlan &plan, Object self)
+{
+    const Standard_Real height =
+        from_ruby<Standard_Real>(self.iv_get("@height"));
+    const Standard_Real dia1 =
+        from_ruby<Standard_Real>(self.iv_get("@bottom_dia"));
+    const Standard_Real dia2 =
+        from_ruby<Standard_Real>(self.iv_get("@top_dia"));
+
+    return plan.add_task([=](const TaskInputs &) {
+        return BRepPrimAPI_MakeCone(dia1 / 2.0, dia2 / 2.0, height).Shape();
+    });
+}
+
+
+static RenderTask *plan_cylinder(RenderPlan &plan, Object self)
+{
+    const Standard_Real height =
+        from_ruby<Standard_Real>(self.iv_get("@height"));
+    const Standard_Real dia = from_ruby<Standard_Real>(self.iv_get("@dia"));
+
+    return plan.add_task([=](const TaskInputs &) {
+        return BRepPrimAPI_MakeCylinder(dia / 2.0, height).Shape();
+    });
+}
+
+
+static RenderTask *plan_sphere(RenderPlan &plan, Object self)
+{
+    const Standard_Real dia = from_ruby<Standard_Real>(self.iv_get("@dia"));
+
+    return plan.add_task([=](const TaskInputs &) {
+        return BRepPrimAPI_MakeSphere(dia / 2.0).Shape();
+    });
+}
+
+
+// check if shape is inside-out and fix it if it is
+static void fix_inside_out_solid(TopoDS_Solid &solid)
+{
+    BRepClass3d_SolidClassifier classifier(solid);
+    classifier.PerformInfinitePoint(Precision::Confusion());
+    if (classifier.State() == TopAbs_IN) {
+        solid = TopoDS::Solid(solid.Oriented(TopAbs_REVERSED));
+    }
+}
+
+// faces may be off their plane by this fraction of their size, e.g. from
+// points rounded to floats. their edges and vertices get tolerances
+// covering it.
+static const Standard_Real POLYHEDRON_FLATNESS = 1e-6;
+
+// a face using an edge, and whether it goes from the edge's lower point to
+// its higher one
+struct PolyhedronEdgeUse
+{
+    size_t face;
+    bool forward;
+};
+
+// merges points closer than Precision::Confusion(), returning the merged
+// points, and faces referring to them. edges that become degenerate are
+// dropped from the faces.
+static void weld_polyhedron(const std::vector<gp_Pnt> &points,
+    const std::vector<Path> &faces, std::vector<gp_Pnt> &welded_points,
+    std::vector<Path> &welded_faces)
+{
+    std::vector<gp_XYZ> vertices;
+    WeldGrid grid(Precision::Confusion(), vertices);
+    std::vector<size_t> remap(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        remap[i] = grid.insert(points[i].XYZ());
+    }
+
+    welded_points.clear();
+    welded_points.reserve(vertices.size());
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        welded_points.push_back(gp_Pnt(vertices[i]));
+    }
+
+    welded_faces.clear();
+    welded_faces.reserve(faces.size());
+    for (size_t i = 0; i < faces.size(); ++i) {
+        Path face;
+        face.reserve(faces[i].size());
+        for (size_t j = 0; j < faces[i].size(); ++j) {
+            const size_t index = remap[faces[i][j]];
+            if (face.empty() || face.back() != index) {
+                face.push_back(index);
+            }
+        }
+
+        while (face.size() > 1 && face.back() == face.front()) {
+            face.pop_back();
+        }
+
+        if (face.size() < 3) {
+            raise_oce_error("polyhedron face %lu is degenerate",
+                (unsigned long)i);
+        }
+
+        welded_faces.push_back(face);
+    }
+}
+
+// decides which faces to reverse so that each edge is used once in each
+// direction, as sewing would. raises unless every edge is used by exactly
+// two faces, which would leave the shell open or non-manifold.
+static std::vector<bool> orient_polyhedron_faces(
+    const std::vector<gp_Pnt> &points, const std::vector<Path> &faces)
+{
+    typedef std::map<std::pair<size_t, size_t>,
+        std::vector<PolyhedronEdgeUse> > EdgeUseMap;
+    EdgeUseMap edges;
+    for (size_t i = 0; i < faces.size(); ++i) {
+        const Path &face = faces[i];
+        for (size_t j = 0; j < face.size(); ++j) {
+            const size_t from = face[j];
+            const size_t to = face[(j + 1) % face.size()];
+
+            PolyhedronEdgeUse use;
+            use.face = i;
+            use.forward = from < to;
+            edges[std::make_pair(std::min(from, to), std::max(from, to))]
+                .push_back(use);
+        }
+    }
+
+    // faces sharing an edge, and whether they go along it the same way
+    std::vector<std::vector<std::pair<size_t, bool> > > neighbours(
+        faces.size());
+    for (EdgeUseMap::const_iterator it = edges.begin(); it != edges.end();
+        ++it)
+    {
+        const std::vector<PolyhedronEdgeUse> &uses = it->second;
+        if (uses.size() != 2) {
+            const gp_Pnt &p = points[it->first.first];
+            const gp_Pnt &q = points[it->first.second];
+            raise_oce_error("polyhedron edge from (%g, %g, %g) to "
+                "(%g, %g, %g) is used by %lu faces, instead of 2",
+                p.X(), p.Y(), p.Z(), q.X(), q.Y(), q.Z(),
+                (unsigned long)uses.size());
+        }
+
+        const bool same = (uses[0].forward == uses[1].forward);
+        neighbours[uses[0].face].push_back(
+            std::make_pair(uses[1].face, same));
+        neighbours[uses[1].face].push_back(
+            std::make_pair(uses[0].face, same));
+    }
+
+    std::vector<bool> reversed(faces.size(), false);
+    std::vector<bool> visited(faces.size(), false);
+    std::vector<size_t> stack;
+    for (size_t start = 0; start < faces.size(); ++start) {
+        if (visited[start]) {
+            continue;
+        }
+
+        visited[start] = true;
+        stack.push_back(start);
+        while (!stack.empty()) {
+            const size_t face = stack.back();
+            stack.pop_back();
+
+            for (size_t i = 0; i < neighbours[face].size(); ++i) {
+                const size_t other = neighbours[face][i].first;
+                const bool flip = reversed[face] != neighbours[face][i].second;
+                if (!visited[other]) {
+                    visited[other] = true;
+                    reversed[other] = flip;
+                    stack.push_back(other);
+                } else if (reversed[other] != flip) {
+                    raise_oce_error("polyhedron faces can't be oriented "
+                        "consistently");
+                }
+            }
+        }
+    }
+
+    return reversed;
+}
+
+// faces share vertices and edges, so the shell is connected as built.
+// coincident points are merged first, and faces are reversed as needed so
+// that they agree with their neighbours. the whole solid is flipped at the
+// end if its faces turn out to be ordered inside-out.
+static TopoDS_Shape make_polyhedron(const std::vector<gp_Pnt> &input_points,
+    const std::vector<Path> &input_faces)
+{
+    std::vector<gp_Pnt> points;
+    std::vector<Path> faces;
+    weld_polyhedron(input_points, input_faces, points, faces);
+
+    const std::vector<bool> reversed = orient_polyhedron_faces(points, faces);
+    for (size_t i = 0; i < faces.size(); ++i) {
+        if (reversed[i]) {
+            std::reverse(faces[i].begin(), faces[i].end());
+        }
+    }
+
+    MeshTopologyBuilder topology(points);
+
+    BRep_Builder builder;
+    TopoDS_Shell shell;
+    builder.MakeShell(shell);
+
+    for (size_t i = 0; i < faces.size(); ++i) {
+        const Path &face = faces[i];
+        TopoDS_Wire wire = topology.make_wire(face);
+
+        // plane through the centroid, with a Newell normal
+        gp_XYZ center(0, 0, 0);
+        gp_XYZ normal(0, 0, 0);
+        for (size_t j = 0; j < face.size(); ++j) {
+            const gp_XYZ &p = points[face[j]].XYZ();
+            const gp_XYZ &q = points[face[(j + 1) % face.size()]].XYZ();
+            center += p;
+            normal += gp_XYZ(
+                (p.Y() - q.Y()) * (p.Z() + q.Z()),
+                (p.Z() - q.Z()) * (p.X() + q.X()),
+                (p.X() - q.X()) * (p.Y() + q.Y()));
+        }
+        center /= face.size();
+
+        if (normal.Modulus() <= gp::Resolution()) {
+            raise_oce_error("polyhedron face %lu is degenerate",
+                (unsigned long)i);
+        }
+
+        const gp_Dir dir(normal);
+        Standard_Real size = 0;
+        Standard_Real deviation = 0;
+        for (size_t j = 0; j < face.size(); ++j) {
+            const gp_XYZ offset = points[face[j]].XYZ() - center;
+            size = std::max(size, offset.Modulus());
+            deviation = std::max(deviation, fabs(offset * dir.XYZ()));
+        }
+
+        if (deviation >
+            std::max(Precision::Confusion(), size * POLYHEDRON_FLATNESS))
+        {
+            raise_oce_error("polyhedron face %lu isn't planar",
+                (unsigned long)i);
+        }
+
+        // tolerances are only ever raised, so shared edges and vertices
+        // end up covering all of their faces
+        if (deviation > Precision::Confusion()) {
+            for (TopExp_Explorer ex(wire, TopAbs_EDGE); ex.More();
+                ex.Next())
+            {
+                builder.UpdateEdge(TopoDS::Edge(ex.Current()), deviation);
+            }
+
+            for (TopExp_Explorer ex(wire, TopAbs_VERTEX); ex.More();
+                ex.Next())
+            {
+                builder.UpdateVertex(TopoDS::Vertex(ex.Current()),
+                    deviation);
+            }
+        }
+
+        builder.Add(shell, BRepBuilderAPI_MakeFace(
+            gp_Pln(gp_Pnt(center), dir), wire).Face());
+    }
+
+    // every edge is shared by exactly two faces
+    shell.Closed(Standard_True);
+
+    TopoDS_Solid solid;
+    builder.MakeSolid(solid);
+    builder.Add(solid, shell);
+
+    fix_inside_out_solid(solid);
+
+    return solid;
+}
+
+static RenderTask *plan_polyhedron(RenderPlan &plan, Object self)
+{
+    const std::vector<gp_Pnt> points = points_from_ruby(
+        self.iv_get("@points"), 3);
+    const std::vector<Path> faces = paths_from_ruby(
+        self.iv_get("@faces"), points.size());
+
+    if (faces.size() < 4) {
+        throw Exception(rb_eArgError,
+            "Polyhedron must have at least 4 faces!");
+    }
+
+    return plan.add_task([=](const TaskInputs &) {
+        return make_polyhedron(points, faces);
+    });
+}
+
+
+static RenderTask *plan_torus(RenderPlan &plan, Object self)
+{
+    const Standard_Real inner_dia = from_ruby<Standard_Real>(
+        self.iv_get("@inner_dia"));
+
+    const Standard_Real outer_dia = from_ruby<Standard_Real>(
+        self.iv_get("@outer_dia"));
+
+    const Standard_Real r1 = inner_dia / 2.0;
+    const Standard_Real r2 = outer_dia / 2.0;
+
+    Object angle = self.iv_get("@angle");
+    if (angle.is_nil()) {
+        return plan.add_task([=](const TaskInputs &) {
+            return BRepPrimAPI_MakeTorus(r1, r2).Shape();
+        });
+    } else {
+        const Standard_Real angle_num = from_ruby<Standard_Real>(angle);
+        return plan.add_task([=](const TaskInputs &) {
+            return BRepPrimAPI_MakeTorus(r1, r2, angle_num).Shape();
+        });
+    }
+}
+
+
+// the booleans update tolerances of their operands' sub-shapes in place, so
+// operands that other tasks may be using are copied first. mesh shapes never
+// get this far.
+static TopTools_MapOfShape get_shared_operands(const TaskInputs &inputs)
+{
+    TopTools_MapOfShape shared;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs.is_shared(i)) {
+            shared.Add(inputs[i]);
+        }
+    }
+
+    return shared;
+}
+
+static void copy_shared_operands(BOPCol_ListOfShape &operands,
+    const TopTools_MapOfShape &shared)
+{
+    BOPCol_ListOfShape result;
+    BOPCol_ListIteratorOfListOfShape it;
+    for (it.Initialize(operands); it.More(); it.Next()) {
+        result.Append(shared.Contains(it.Value())
+            ? BRepBuilderAPI_Copy(it.Value()).Shape()
+            : it.Value());
+    }
+
+    operands = result;
+}
+
+// runs a boolean operation between a group of argument shapes and a group
+// of tool shapes, each group being treated as the union of its members. all
+// shapes are intersected with each other in a single pass, which can use
+// several threads. operands in shared are copied first.
+static TopoDS_Shape perform_boolean(BOPAlgo_Operation operation,
+    BOPCol_ListOfShape arguments, BOPCol_ListOfShape tools,
+    const TopTools_MapOfShape &shared)
+{
+    ProfileScope scope("boolean", "BOPAlgo");
+    copy_shared_operands(arguments, shared);
+    copy_shared_operands(tools, shared);
+
+    BOPCol_ListOfShape all_shapes;
+    BOPCol_ListIteratorOfListOfShape it;
+    for (it.Initialize(arguments); it.More(); it.Next()) {
+        all_shapes.Append(it.Value());
+    }
+    for (it.Initialize(tools); it.More(); it.Next()) {
+        all_shapes.Append(it.Value());
+    }
+
+    BOPAlgo_PaveFiller filler;
+    filler.SetArguments(all_shapes);
+    filler.SetRunParallel(Standard_True);
+    filler.Perform();
+    if (filler.ErrorStatus()) {
+        raise_oce_error(
+            "boolean operation failed intersecting shapes (error %d)",
+            filler.ErrorStatus());
+    }
+
+    BOPAlgo_BOP bop;
+    for (it.Initialize(arguments); it.More(); it.Next()) {
+        bop.AddArgument(it.Value());
+    }
+    for (it.Initialize(tools); it.More(); it.Next()) {
+        bop.AddTool(it.Value());
+    }
+
+    bop.SetOperation(operation);
+    bop.SetRunParallel(Standard_True);
+    bop.PerformWithFiller(filler);
+    if (bop.ErrorStatus()) {
+        raise_oce_error(
+            "boolean operation failed building result (error %d)",
+            bop.ErrorStatus());
+    }
+
+    return bop.Shape();
+}
+
+static void append_unique_shape(BOPCol_ListOfShape &shapes,
+    const TopoDS_Shape &shape)
+{
+    BOPCol_ListIteratorOfListOfShape it;
+    for (it.Initialize(shapes); it.More(); it.Next()) {
+        if (it.Value().IsSame(shape)) {
+            return;
+        }
+    }
+
+    shapes.Append(shape);
+}
+
+// splits a Combination's rendered shapes into its first shape and the rest.
+// identical subtrees are rendered only once, so the same shape can appear
+// several times; duplicates in rest are dropped, since the booleans don't
+// handle them well.
+static void split_combination_inputs(const TaskInputs &inputs,
+    BOPCol_ListOfShape &first, BOPCol_ListOfShape &rest)
+{
+    first.Append(inputs[0]);
+    for (size_t i = 1; i < inputs.size(); ++i) {
+        append_unique_shape(rest, inputs[i]);
+    }
+}
+
+static std::vector<RenderTask *> plan_combination_shapes(RenderPlan &plan,
+    Object self)
+{
+    const Array shapes = self.iv_get("@shapes");
+
+    std::vector<RenderTask *> tasks;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        tasks.push_back(plan.add_shape(shapes[i]));
+    }
+
+    return tasks;
+}
+
+// a solid with a planar face per triangle, so that the B-rep booleans can
+// still be used on mesh shapes when asked to
+static TopoDS_Shape mesh_to_brep(const TopoDS_Shape &shape)
+{
+    const TriangleMesh mesh = get_mesh_shape_triangles(shape);
+
+    std::vector<gp_Pnt> points;
+    points.reserve(mesh.vertices.size());
+    for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+        points.push_back(gp_Pnt(mesh.vertices[i]));
+    }
+
+    std::vector<Path> faces;
+    faces.reserve(mesh.num_triangles());
+    for (size_t i = 0; i < mesh.triangles.size(); i += 3) {
+        faces.push_back(Path(&mesh.triangles[i], &mesh.triangles[i + 3]));
+    }
+
+    return make_polyhedron(points, faces);
+}
+
+
+// reads an STL file as a mesh shape, so that booleans with it use the mesh
+// engine. if brep is true, it's converted to a solid instead.
+static Object shape__from_stl(String path, Standard_Real weld_tolerance,
+    bool brep)
+{
+    if (weld_tolerance < 0) {
+        throw Exception(rb_eArgError, "weld tolerance must not be negative");
+    }
+
+    const std::string path_str = path.str();
+    const size_t num_threads = get_render_threads();
+
+    TopoDS_Shape shape;
+    without_gvl([&] {
+        ProfileScope scope("import", "import stl");
+        shape = make_mesh_shape(read_stl(path_str, weld_tolerance,
+            num_threads));
+        if (brep) {
+            shape = mesh_to_brep(shape);
+        }
+    });
+
+    return wrap_rendered_shape(shape);
+}
+
+// Mesh booleans, for combinations with mesh shapes (e.g. scanned parts read
+// from STL files), whose thousands of tiny faces are slow and fragile in the
+// B-rep booleans. they work like this:
+//
+// 1. triangles of each mesh that touch a triangle of the other mesh are cut
+//    along the other triangle's plane (or, if they lie in the same plane,
+//    along its edges), so that no piece crosses the other surface. other
+//    triangles are left whole.
+// 2. pieces are classified as inside or outside the other mesh by counting
+//    its triangles along a ray. triangles that weren't cut share a side with
+//    their uncut neighbours, so each connected group needs only one ray.
+//    pieces lying on the other surface are classified by their normals.
+// 3. pieces are kept or dropped according to the operation, and T-junctions
+//    left along the cuts are removed, so the result stays watertight. short
+//    cracks where cut points computed from different triangles don't quite
+//    meet are filled, if that can be done without folding the surface.
+//
+// whether triangles touch, and which side of a plane each of the meshes'
+// vertices is on, are decided exactly (see orient3d), so faces lying in one
+// plane and cuts through shared edges and vertices come out the same for
+// every triangle involved. points made by cutting only approximate where
+// they should be, so they count as lying on a plane when closer to it than
+// a small fraction of the meshes' size. rays break ties (e.g. passing
+// through an edge shared by two triangles) by a symbolic perturbation, so
+// they're counted once.
+
+enum MeshBooleanOp
+{
+    MESH_UNION,
+    MESH_DIFFERENCE,
+    MESH_INTERSECTION,
+};
+
+// relative to the diagonal of the meshes' bounding box
+static const Standard_Real MESH_BOOLEAN_EPSILON = 1e-6;
+
+// exact orientation tests, after Shewchuk's "Adaptive Precision
+// Floating-Point Arithmetic and Fast Robust Geometric Predicates". a
+// determinant is computed in floating point first, and only computed again
+// exactly, as a sum of non-overlapping doubles, if it's within the rounding
+// error bound of 0.
+
+// a + b == x + y exactly
+static inline void two_sum(Standard_Real a, Standard_Real b,
+    Standard_Real &x, Standard_Real &y)
+{
+    x = a + b;
+    const Standard_Real b_virtual = x - a;
+    const Standard_Real a_virtual = x - b_virtual;
+    y = (a - a_virtual) + (b - b_virtual);
+}
+
+// a * b == x + y exactly
+static inline void two_product(Standard_Real a, Standard_Real b,
+    Standard_Real &x, Standard_Real &y)
+{
+    x = a * b;
+    y = std::fma(a, b, -x);
+}
+
+// a sum of doubles, with no two overlapping, from the smallest up. each of
+// orient3d's 6 terms adds at most 8 * 4 of them.
+struct ExactSum
+{
+    Standard_Real parts[6 * 8 * 4];
+    size_t size;
+
+    ExactSum()
+        : size(0)
+    {
+    }
+
+    void add(Standard_Real b)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < size; ++i) {
+            Standard_Real part;
+            two_sum(b, parts[i], b, part);
+            if (part != 0) {
+                parts[n++] = part;
+            }
+        }
+
+        if (b != 0) {
+            parts[n++] = b;
+        }
+
+        size = n;
+    }
+
+    int sign() const
+    {
+        return (size == 0) ? 0 : (parts[size - 1] > 0) ? 1 : -1;
+    }
+};
+
+// a - b == diff[0] + diff[1] exactly
+static inline void exact_difference(Standard_Real a, Standard_Real b,
+    Standard_Real diff[2])
+{
+    two_sum(a, -b, diff[1], diff[0]);
+}
+
+// the sign of ((b - a) ^ (c - a)) * (p - a): positive if p is on the side of
+// the plane through a, b and c that they wind anticlockwise around
+static int orient3d(const gp_XYZ &a, const gp_XYZ &b, const gp_XYZ &c,
+    const gp_XYZ &p)
+{
+    const gp_XYZ u = b - a, v = c - a, w = p - a;
+    const Standard_Real det = u.X() * (v.Y() * w.Z() - v.Z() * w.Y())
+        - u.Y() * (v.X() * w.Z() - v.Z() * w.X())
+        + u.Z() * (v.X() * w.Y() - v.Y() * w.X());
+    const Standard_Real permanent =
+        fabs(u.X()) * (fabs(v.Y() * w.Z()) + fabs(v.Z() * w.Y()))
+        + fabs(u.Y()) * (fabs(v.X() * w.Z()) + fabs(v.Z() * w.X()))
+        + fabs(u.Z()) * (fabs(v.X() * w.Y()) + fabs(v.Y() * w.X()));
+    const Standard_Real epsilon =
+        std::numeric_limits<Standard_Real>::epsilon() / 2;
+    if (fabs(det) > (7 + 56 * epsilon) * epsilon * permanent) {
+        return (det > 0) ? 1 : -1;
+    }
+
+    Standard_Real du[3][2], dv[3][2], dw[3][2];
+    for (int i = 0; i < 3; ++i) {
+        exact_difference(b.Coord(i + 1), a.Coord(i + 1), du[i]);
+        exact_difference(c.Coord(i + 1), a.Coord(i + 1), dv[i]);
+        exact_difference(p.Coord(i + 1), a.Coord(i + 1), dw[i]);
+    }
+
+    // the determinant's terms, u[i] * v[j] * w[k] for each permutation
+    static const int terms[6][4] = {
+        { 0, 1, 2, 1 }, { 0, 2, 1, -1 }, { 1, 0, 2, -1 },
+        { 1, 2, 0, 1 }, { 2, 0, 1, 1 }, { 2, 1, 0, -1 },
+    };
+
+    ExactSum sum;
+    for (int t = 0; t < 6; ++t) {
+        const Standard_Real *x = du[terms[t][0]];
+        const Standard_Real *y = dv[terms[t][1]];
+        const Standard_Real *z = dw[terms[t][2]];
+        const Standard_Real sign = terms[t][3];
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                if (x[i] == 0 || y[j] == 0) {
+                    continue;
+                }
+
+                Standard_Real xy[2];
+                two_product(x[i], y[j], xy[1], xy[0]);
+                for (int k = 0; k < 2; ++k) {
+                    for (int m = 0; m < 2; ++m) {
+                        Standard_Real high, low;
+                        two_product(xy[m], z[k], high, low);
+                        sum.add(sign * low);
+                        sum.add(sign * high);
+                    }
+                }
+            }
+        }
+    }
+
+    return sum.sign();
+}
+
+// a plane, with three points on it to test mesh vertices against exactly.
+// the normal points to the side they wind anticlockwise around.
+struct MeshPlane
+{
+    gp_XYZ normal;
+    Standard_Real offset;
+    gp_XYZ points[3];
+
+    Standard_Real distance(const gp_XYZ &p) const
+    {
+        return normal * p - offset;
+    }
+
+    int side(const gp_XYZ &p) const
+    {
+        return orient3d(points[0], points[1], points[2], p);
+    }
+};
+
+static MeshPlane make_mesh_plane(const gp_XYZ &normal, const gp_XYZ &a,
+    const gp_XYZ &b, const gp_XYZ &c)
+{
+    MeshPlane plane = { normal, normal * a, { a, b, c } };
+    return plane;
+}
+
+static bool xyz_less(const gp_XYZ &a, const gp_XYZ &b)
+{
+    if (a.X() != b.X()) {
+        return a.X() < b.X();
+    } else if (a.Y() != b.Y()) {
+        return a.Y() < b.Y();
+    } else {
+        return a.Z() < b.Z();
+    }
+}
+
+// where segment pq crosses plane. computed the same way whichever way round
+// the segment is, so that triangles sharing an edge get identical points.
+static gp_XYZ plane_crossing(gp_XYZ p, gp_XYZ q, const MeshPlane &plane)
+{
+    if (xyz_less(q, p)) {
+        std::swap(p, q);
+    }
+
+    // the ends' sides were found exactly, and may not agree with their
+    // rounded distances
+    const Standard_Real dp = plane.distance(p);
+    const Standard_Real dq = plane.distance(q);
+    const Standard_Real t = (dp == dq)
+        ? 0.5
+        : std::min<Standard_Real>(1, std::max<Standard_Real>(0,
+            dp / (dp - dq)));
+    return p + (q - p) * t;
+}
+
+// splits a convex piece of the triangle with the given corners along plane.
+// returns false, leaving front and back alone, if it doesn't cross it.
+static bool split_polygon(const std::vector<gp_XYZ> &polygon,
+    const gp_XYZ corners[3], const MeshPlane &plane, Standard_Real eps,
+    std::vector<gp_XYZ> &front, std::vector<gp_XYZ> &back)
+{
+    std::vector<int> sides(polygon.size());
+    bool any_front = false;
+    bool any_back = false;
+    for (size_t i = 0; i < polygon.size(); ++i) {
+        const XYZKey p(polygon[i]);
+        if (p == XYZKey(corners[0]) || p == XYZKey(corners[1]) ||
+            p == XYZKey(corners[2]))
+        {
+            sides[i] = plane.side(polygon[i]);
+        } else {
+            const Standard_Real d = plane.distance(polygon[i]);
+            sides[i] = (d > eps) ? 1 : (d < -eps) ? -1 : 0;
+        }
+
+        any_front = any_front || sides[i] > 0;
+        any_back = any_back || sides[i] < 0;
+    }
+
+    if (!any_front || !any_back) {
+        return false;
+    }
+
+    front.clear();
+    back.clear();
+    for (size_t i = 0; i < polygon.size(); ++i) {
+        const size_t j = (i + 1) % polygon.size();
+        if (sides[i] >= 0) {
+            front.push_back(polygon[i]);
+        }
+        if (sides[i] <= 0) {
+            back.push_back(polygon[i]);
+        }
+
+        if (sides[i] * sides[j] < 0) {
+            const gp_XYZ p = plane_crossing(polygon[i], polygon[j], plane);
+            front.push_back(p);
+            back.push_back(p);
+        }
+    }
+
+    return true;
+}
+
+// whether triangle a, whose corners are on the given sides of b's plane,
+// reaches b. a[0] is alone on the positive side, and b[0] alone on its side
+// of a's plane (or they're on the planes). both triangles then meet the line
+// where the planes cross, and touch if they do so in overlapping intervals.
+// this is Guigue and Devillers' "Fast and Robust Triangle-Triangle Overlap
+// Test Using Orientation Predicates".
+static bool crossing_intervals_overlap(const gp_XYZ &a0, const gp_XYZ &a1,
+    const gp_XYZ &a2, const gp_XYZ &b0, const gp_XYZ &b1, const gp_XYZ &b2)
+{
+    return orient3d(a1, b0, a0, b1) <= 0 && orient3d(a0, b0, a2, b2) <= 0;
+}
+
+// puts b's corners in the order crossing_intervals_overlap expects, given
+// the sides of a's plane they're on, and with a already in order
+static bool triangles_overlap(const gp_XYZ &a0, const gp_XYZ &a1,
+    const gp_XYZ &a2, const gp_XYZ &b0, const gp_XYZ &b1, const gp_XYZ &b2,
+    int s0, int s1, int s2)
+{
+    if (s0 > 0) {
+        if (s1 > 0) {
+            return crossing_intervals_overlap(a0, a2, a1, b2, b0, b1);
+        } else if (s2 > 0) {
+            return crossing_intervals_overlap(a0, a2, a1, b1, b2, b0);
+        }
+        return crossing_intervals_overlap(a0, a1, a2, b0, b1, b2);
+    } else if (s0 < 0) {
+        if (s1 < 0) {
+            return crossing_intervals_overlap(a0, a1, a2, b2, b0, b1);
+        } else if (s2 < 0) {
+            return crossing_intervals_overlap(a0, a1, a2, b1, b2, b0);
+        }
+        return crossing_intervals_overlap(a0, a2, a1, b0, b1, b2);
+    } else if (s1 < 0) {
+        if (s2 >= 0) {
+            return crossing_intervals_overlap(a0, a2, a1, b1, b2, b0);
+        }
+        return crossing_intervals_overlap(a0, a1, a2, b0, b1, b2);
+    } else if (s1 > 0) {
+        if (s2 > 0) {
+            return crossing_intervals_overlap(a0, a2, a1, b0, b1, b2);
+        }
+        return crossing_intervals_overlap(a0, a1, a2, b1, b2, b0);
+    } else if (s2 > 0) {
+        return crossing_intervals_overlap(a0, a1, a2, b2, b0, b1);
+    }
+    return crossing_intervals_overlap(a0, a2, a1, b2, b0, b1);
+}
+
+// whether two triangles touch, and if so, whether they lie in one plane
+static bool triangles_touch(const gp_XYZ a[3], const gp_XYZ b[3],
+    bool &coplanar)
+{
+    int da[3], db[3];
+    for (int i = 0; i < 3; ++i) {
+        da[i] = orient3d(b[0], b[1], b[2], a[i]);
+    }
+    if (da[0] * da[1] > 0 && da[0] * da[2] > 0) {
+        return false;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        db[i] = orient3d(a[0], a[1], a[2], b[i]);
+    }
+    if (db[0] * db[1] > 0 && db[0] * db[2] > 0) {
+        return false;
+    }
+
+    coplanar = (da[0] == 0 && da[1] == 0 && da[2] == 0);
+    if (coplanar) {
+        // their boxes overlap, which is close enough
+        return true;
+    }
+
+    // a's corners are rotated so that the first is alone on its side of b's
+    // plane, keeping their winding. if that side is negative, b is turned
+    // over instead, which swaps the sides of a's plane its corners are on.
+    if (da[0] > 0) {
+        if (da[1] > 0) {
+            return triangles_overlap(a[2], a[0], a[1], b[0], b[2], b[1],
+                db[0], db[2], db[1]);
+        } else if (da[2] > 0) {
+            return triangles_overlap(a[1], a[2], a[0], b[0], b[2], b[1],
+                db[0], db[2], db[1]);
+        }
+        return triangles_overlap(a[0], a[1], a[2], b[0], b[1], b[2],
+            db[0], db[1], db[2]);
+    } else if (da[0] < 0) {
+        if (da[1] < 0) {
+            return triangles_overlap(a[2], a[0], a[1], b[0], b[1], b[2],
+                db[0], db[1], db[2]);
+        } else if (da[2] < 0) {
+            return triangles_overlap(a[1], a[2], a[0], b[0], b[1], b[2],
+                db[0], db[1], db[2]);
+        }
+        return triangles_overlap(a[0], a[1], a[2], b[0], b[2], b[1],
+            db[0], db[2], db[1]);
+    } else if (da[1] < 0) {
+        if (da[2] >= 0) {
+            return triangles_overlap(a[1], a[2], a[0], b[0], b[2], b[1],
+                db[0], db[2], db[1]);
+        }
+        return triangles_overlap(a[0], a[1], a[2], b[0], b[1], b[2],
+            db[0], db[1], db[2]);
+    } else if (da[1] > 0) {
+        if (da[2] > 0) {
+            return triangles_overlap(a[0], a[1], a[2], b[0], b[2], b[1],
+                db[0], db[2], db[1]);
+        }
+        return triangles_overlap(a[1], a[2], a[0], b[0], b[1], b[2],
+            db[0], db[1], db[2]);
+    } else if (da[2] > 0) {
+        return triangles_overlap(a[2], a[0], a[1], b[0], b[1], b[2],
+            db[0], db[1], db[2]);
+    }
+    return triangles_overlap(a[2], a[0], a[1], b[0], b[2], b[1],
+        db[0], db[2], db[1]);
+}
+
+// planes through a triangle's edges, perpendicular to it, facing out. each
+// goes exactly through its edge's ends.
+static void add_edge_planes(const gp_XYZ corners[3], const MeshPlane &plane,
+    std::vector<MeshPlane> &planes)
+{
+    for (int i = 0; i < 3; ++i) {
+        const gp_XYZ &u = corners[i];
+        const gp_XYZ &v = corners[(i + 1) % 3];
+        gp_XYZ normal = (v - u) ^ plane.normal;
+        const Standard_Real length = normal.Modulus();
+        if (length <= gp::Resolution()) {
+            continue;
+        }
+
+        normal.Divide(length);
+        planes.push_back(make_mesh_plane(normal, u, v,
+            u + plane.normal * length));
+    }
+}
+
+// which side of the line from u to v the point p is on, seen along the x
+// axis. never 0: ties are broken as if p were moved by an infinitesimal
+// (e, e^2) in y and z, the same way for every triangle sharing the edge.
+static int edge_side(gp_XYZ u, gp_XYZ v, const gp_XYZ &p)
+{
+    int sign = 1;
+    if (v.Y() < u.Y() || (v.Y() == u.Y() && v.Z() < u.Z())) {
+        std::swap(u, v);
+        sign = -1;
+    }
+
+    const Standard_Real orient =
+        (v.Y() - u.Y()) * (p.Z() - u.Z()) - (v.Z() - u.Z()) * (p.Y() - u.Y());
+    if (orient != 0) {
+        return (orient > 0) ? sign : -sign;
+    } else if (v.Z() != u.Z()) {
+        return (v.Z() < u.Z()) ? sign : -sign;
+    } else {
+        return (v.Y() > u.Y()) ? sign : -sign;
+    }
+}
+
+// a regular grid over the y and z extent of a mesh, with the triangles
+// overlapping each cell, for counting triangles along rays in the +x
+// direction
+class MeshRayCaster
+{
+public:
+    explicit MeshRayCaster(const TriangleMesh &mesh);
+
+    // whether p is inside the mesh, which should be closed
+    bool contains(const gp_XYZ &p) const;
+
+private:
+    const TriangleMesh &mesh;
+
+    Standard_Real min_y, min_z;
+    Standard_Real cell_size;
+    size_t num_y, num_z;
+
+    // triangles of cell (y, z) are cell_triangles[cell_starts[i] ...
+    // cell_starts[i + 1]], with i = y * num_z + z
+    std::vector<uint32_t> cell_starts;
+    std::vector<uint32_t> cell_triangles;
+};
+
+MeshRayCaster::MeshRayCaster(const TriangleMesh &mesh)
+    : mesh(mesh),
+      min_y(0),
+      min_z(0),
+      cell_size(1),
+      num_y(1),
+      num_z(1)
+{
+    const size_t num_triangles = mesh.num_triangles();
+    if (num_triangles == 0) {
+        cell_starts.assign(2, 0);
+        return;
+    }
+
+    Standard_Real max_y, max_z;
+    min_y = max_y = mesh.corner(0, 0).Y();
+    min_z = max_z = mesh.corner(0, 0).Z();
+    for (size_t i = 0; i < mesh.triangles.size(); ++i) {
+        const gp_XYZ &p = mesh.vertices[mesh.triangles[i]];
+        min_y = std::min(min_y, p.Y());
+        max_y = std::max(max_y, p.Y());
+        min_z = std::min(min_z, p.Z());
+        max_z = std::max(max_z, p.Z());
+    }
+
+    // roughly one triangle per cell, as a surface seen from the side
+    // covers about sqrt(n) cells in each direction
+    const size_t cells_per_side = std::min<size_t>(512,
+        std::max<size_t>(1, static_cast<size_t>(sqrt(num_triangles))));
+    const Standard_Real extent = std::max(max_y - min_y, max_z - min_z);
+    cell_size = std::max(extent / cells_per_side,
+        std::numeric_limits<Standard_Real>::min());
+    num_y = static_cast<size_t>((max_y - min_y) / cell_size) + 1;
+    num_z = static_cast<size_t>((max_z - min_z) / cell_size) + 1;
+
+    // counted first, then filled in
+    std::vector<size_t> cell_ranges(4 * num_triangles);
+    cell_starts.assign(num_y * num_z + 1, 0);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t t = 0; t < num_triangles; ++t) {
+            size_t *range = &cell_ranges[4 * t];
+            if (pass == 0) {
+                Standard_Real lo_y = mesh.corner(t, 0).Y(), hi_y = lo_y;
+                Standard_Real lo_z = mesh.corner(t, 0).Z(), hi_z = lo_z;
+                for (int i = 1; i < 3; ++i) {
+                    lo_y = std::min(lo_y, mesh.corner(t, i).Y());
+                    hi_y = std::max(hi_y, mesh.corner(t, i).Y());
+                    lo_z = std::min(lo_z, mesh.corner(t, i).Z());
+                    hi_z = std::max(hi_z, mesh.corner(t, i).Z());
+                }
+
+                range[0] = static_cast<size_t>((lo_y - min_y) / cell_size);
+                range[1] = std::min(num_y - 1,
+                    static_cast<size_t>((hi_y - min_y) / cell_size));
+                range[2] = static_cast<size_t>((lo_z - min_z) / cell_size);
+                range[3] = std::min(num_z - 1,
+                    static_cast<size_t>((hi_z - min_z) / cell_size));
+            }
+
+            for (size_t y = range[0]; y <= range[1]; ++y) {
+                for (size_t z = range[2]; z <= range[3]; ++z) {
+                    const size_t cell = y * num_z + z;
+                    if (pass == 0) {
+                        ++cell_starts[cell + 1];
+                    } else {
+                        cell_triangles[cell_starts[cell]++] = t;
+                    }
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (size_t i = 1; i < cell_starts.size(); ++i) {
+                cell_starts[i] += cell_starts[i - 1];
+            }
+
+            cell_triangles.resize(cell_starts.back());
+        } else {
+            // filling advanced each start to the next cell's start
+            for (size_t i = cell_starts.size() - 1; i > 0; --i) {
+                cell_starts[i] = cell_starts[i - 1];
+            }
+            cell_starts[0] = 0;
+        }
+    }
+}
+
+bool MeshRayCaster::contains(const gp_XYZ &p) const
+{
+    const Standard_Real y = (p.Y() - min_y) / cell_size;
+    const Standard_Real z = (p.Z() - min_z) / cell_size;
+    if (!(y >= 0 && y < num_y && z >= 0 && z < num_z)) {
+        return false;
+    }
+
+    const size_t cell = static_cast<size_t>(y) * num_z
+        + static_cast<size_t>(z);
+
+    bool inside = false;
+    for (uint32_t i = cell_starts[cell]; i < cell_starts[cell + 1]; ++i) {
+        const uint32_t t = cell_triangles[i];
+        const gp_XYZ &a = mesh.corner(t, 0);
+        const gp_XYZ &b = mesh.corner(t, 1);
+        const gp_XYZ &c = mesh.corner(t, 2);
+
+        // seen edge-on, the triangle's neighbours are hit instead
+        const gp_XYZ normal = (b - a) ^ (c - a);
+        if (normal.X() == 0) {
+            continue;
+        }
+
+        const int sign = (normal.X() > 0) ? 1 : -1;
+        if (edge_side(a, b, p) != sign || edge_side(b, c, p) != sign ||
+            edge_side(c, a, p) != sign)
+        {
+            continue;
+        }
+
+        // hit at or ahead of p
+        if (normal * (a - p) * sign >= 0) {
+            inside = !inside;
+        }
+    }
+
+    return inside;
+}
+
+// collects the pieces kept by a mesh boolean, welding their corners, and
+// removes T-junctions between them
+class MeshBooleanOutput
+{
+public:
+    explicit MeshBooleanOutput(Standard_Real eps)
+        : eps(eps)
+    {
+    }
+
+    // an uncut triangle. if near_cut, pieces' corners may lie on its edges,
+    // or nearly coincide with its corners.
+    void add_triangle(const gp_XYZ &a, const gp_XYZ &b, const gp_XYZ &c,
+        bool near_cut);
+
+    // a convex piece of a cut triangle
+    void add_piece(const std::vector<gp_XYZ> &polygon, bool flip);
+
+    TriangleMesh finish();
+
+private:
+    uint32_t add_vertex(const gp_XYZ &p, bool is_piece_corner);
+    void push_triangle(uint32_t a, uint32_t b, uint32_t c, bool check);
+    void find_points_on_edge(uint32_t u, uint32_t v,
+        std::vector<std::pair<Standard_Real, uint32_t> > &found) const;
+    Standard_Real distance_to_edge(uint32_t index, uint32_t u,
+        uint32_t v) const;
+    void close_small_holes();
+    void fill_hole(const std::vector<uint32_t> &loop);
+    bool fan_is_consistent(const std::vector<uint32_t> &loop,
+        size_t apex) const;
+    void check_watertight() const;
+
+    typedef std::unordered_map<uint64_t, std::vector<uint32_t> > CornerGrid;
+    // the key of the cell containing p, or of a neighbour of it
+    uint64_t cell_key(const gp_XYZ &p, int dx=0, int dy=0, int dz=0) const;
+
+    // cracks left where cut corners nearly coincide are this short
+    static const size_t MAX_HOLE_EDGES = 8;
+
+    Standard_Real eps;
+    TriangleMesh mesh;
+    XYZIndexMap indices;
+
+    // vertices that are corners of pieces (or of uncut triangles next to
+    // them), and triangles that may have one on an edge
+    std::vector<bool> is_piece_corner;
+    std::vector<uint32_t> piece_corners;
+    std::vector<uint32_t> triangles_to_check;
+
+    CornerGrid corner_grid;
+    gp_XYZ grid_origin;
+    Standard_Real cell_size;
+};
+
+uint32_t MeshBooleanOutput::add_vertex(const gp_XYZ &p, bool piece_corner)
+{
+    std::pair<XYZIndexMap::iterator, bool> inserted = indices.insert(
+        std::make_pair(XYZKey(p),
+            static_cast<uint32_t>(mesh.vertices.size())));
+    const uint32_t index = inserted.first->second;
+
+    if (inserted.second) {
+        mesh.vertices.push_back(p);
+        is_piece_corner.push_back(false);
+    }
+
+    if (piece_corner && !is_piece_corner[index]) {
+        is_piece_corner[index] = true;
+        piece_corners.push_back(index);
+    }
+
+    return index;
+}
+
+void MeshBooleanOutput::push_triangle(uint32_t a, uint32_t b, uint32_t c,
+    bool check)
+{
+    if (a == b || b == c || c == a) {
+        return;
+    }
+
+    if (check) {
+        triangles_to_check.push_back(mesh.num_triangles());
+    }
+
+    mesh.triangles.push_back(a);
+    mesh.triangles.push_back(b);
+    mesh.triangles.push_back(c);
+}
+
+void MeshBooleanOutput::add_triangle(const gp_XYZ &a, const gp_XYZ &b,
+    const gp_XYZ &c, bool near_cut)
+{
+    push_triangle(add_vertex(a, near_cut), add_vertex(b, near_cut),
+        add_vertex(c, near_cut), near_cut);
+}
+
+void MeshBooleanOutput::add_piece(const std::vector<gp_XYZ> &polygon,
+    bool flip)
+{
+    std::vector<uint32_t> corners;
+    for (size_t i = 0; i < polygon.size(); ++i) {
+        corners.push_back(add_vertex(polygon[i], true));
+    }
+
+    if (flip) {
+        std::reverse(corners.begin(), corners.end());
+    }
+
+    for (size_t i = 1; i + 1 < corners.size(); ++i) {
+        push_triangle(corners[0], corners[i], corners[i + 1], true);
+    }
+}
+
+// neighbours are found by index, rather than by moving p a cell's width,
+// which can round to a cell two away
+uint64_t MeshBooleanOutput::cell_key(const gp_XYZ &p, int dx, int dy,
+    int dz) const
+{
+    const gp_XYZ cell = (p - grid_origin) / cell_size;
+    const uint64_t x = static_cast<uint64_t>(std::max(0.0, cell.X())) + dx;
+    const uint64_t y = static_cast<uint64_t>(std::max(0.0, cell.Y())) + dy;
+    const uint64_t z = static_cast<uint64_t>(std::max(0.0, cell.Z())) + dz;
+    return (x << 42) | ((y & 0x1fffff) << 21) | (z & 0x1fffff);
+}
+
+Standard_Real MeshBooleanOutput::distance_to_edge(uint32_t index,
+    uint32_t u, uint32_t v) const
+{
+    const gp_XYZ edge = mesh.vertices[v] - mesh.vertices[u];
+    const gp_XYZ offset = mesh.vertices[index] - mesh.vertices[u];
+    const Standard_Real t = (offset * edge) / edge.SquareModulus();
+    return (offset - edge * t).Modulus();
+}
+
+// piece corners lying on the edge from u to v, with their positions along it
+void MeshBooleanOutput::find_points_on_edge(uint32_t u, uint32_t v,
+    std::vector<std::pair<Standard_Real, uint32_t> > &found) const
+{
+    const gp_XYZ &start = mesh.vertices[u];
+    const gp_XYZ edge = mesh.vertices[v] - start;
+    const Standard_Real length_sq = edge.SquareModulus();
+    if (length_sq <= eps * eps) {
+        return;
+    }
+
+    const Standard_Real length = sqrt(length_sq);
+
+    // corners within eps of u or v were merged with them, so anything else
+    // between them is a T-junction, however close to an end
+    auto check = [&](uint32_t index) {
+        if (index == u || index == v) {
+            return;
+        }
+
+        const gp_XYZ offset = mesh.vertices[index] - start;
+        const Standard_Real t = (offset * edge) / length_sq;
+        if (t <= 0 || t >= 1) {
+            return;
+        }
+
+        if ((offset - edge * t).SquareModulus() <= eps * eps) {
+            found.push_back(std::make_pair(t, index));
+        }
+    };
+
+    // long edges are compared with every corner, rather than walking
+    // through many empty cells
+    const size_t steps = static_cast<size_t>(2 * length / cell_size) + 1;
+    if (27 * steps >= piece_corners.size()) {
+        for (size_t i = 0; i < piece_corners.size(); ++i) {
+            check(piece_corners[i]);
+        }
+    } else {
+        for (size_t step = 0; step <= steps; ++step) {
+            const gp_XYZ p = start + edge * (Standard_Real(step) / steps);
+            for (int dx = -1; dx <= 1; ++dx) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dz = -1; dz <= 1; ++dz) {
+                        CornerGrid::const_iterator cell =
+                            corner_grid.find(cell_key(p, dx, dy, dz));
+                        if (cell == corner_grid.end()) {
+                            continue;
+                        }
+
+                        for (size_t i = 0; i < cell->second.size(); ++i) {
+                            check(cell->second[i]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // neighbouring samples share cells, so corners can be found twice
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+}
+
+TriangleMesh MeshBooleanOutput::finish()
+{
+    if (piece_corners.empty()) {
+        check_watertight();
+        return mesh;
+    }
+
+    gp_XYZ lo = mesh.vertices[piece_corners[0]];
+    gp_XYZ hi = lo;
+    for (size_t i = 1; i < piece_corners.size(); ++i) {
+        const gp_XYZ &p = mesh.vertices[piece_corners[i]];
+        lo.SetCoord(std::min(lo.X(), p.X()), std::min(lo.Y(), p.Y()),
+            std::min(lo.Z(), p.Z()));
+        hi.SetCoord(std::max(hi.X(), p.X()), std::max(hi.Y(), p.Y()),
+            std::max(hi.Z(), p.Z()));
+    }
+
+    // roughly one corner per cell, spread over a surface
+    const gp_XYZ size = hi - lo;
+    const Standard_Real extent =
+        std::max(size.X(), std::max(size.Y(), size.Z()));
+    cell_size = std::max(4 * eps,
+        extent / std::max(1.0, sqrt(Standard_Real(piece_corners.size()))));
+    grid_origin = lo - gp_XYZ(cell_size, cell_size, cell_size);
+
+    // pieces of the two meshes meet at corners that were computed
+    // separately, so corners closer than eps are merged
+    std::vector<uint32_t> merged(mesh.vertices.size());
+    for (size_t i = 0; i < merged.size(); ++i) {
+        merged[i] = i;
+    }
+
+    std::vector<uint32_t> kept_corners;
+    for (size_t i = 0; i < piece_corners.size(); ++i) {
+        const uint32_t corner = piece_corners[i];
+        const gp_XYZ &p = mesh.vertices[corner];
+
+        for (int dx = -1; dx <= 1 && merged[corner] == corner; ++dx) {
+            for (int dy = -1; dy <= 1 && merged[corner] == corner; ++dy) {
+                for (int dz = -1; dz <= 1 && merged[corner] == corner; ++dz) {
+                    CornerGrid::const_iterator cell =
+                        corner_grid.find(cell_key(p, dx, dy, dz));
+                    if (cell == corner_grid.end()) {
+                        continue;
+                    }
+
+                    for (size_t j = 0; j < cell->second.size(); ++j) {
+                        const uint32_t other = cell->second[j];
+                        if ((mesh.vertices[other] - p).SquareModulus()
+                            <= eps * eps)
+                        {
+                            merged[corner] = other;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (merged[corner] == corner) {
+            corner_grid[cell_key(p)].push_back(corner);
+            kept_corners.push_back(corner);
+        }
+    }
+
+    piece_corners.swap(kept_corners);
+    for (size_t i = 0; i < mesh.triangles.size(); ++i) {
+        mesh.triangles[i] = merged[mesh.triangles[i]];
+    }
+
+    // triangles with corners on their edges are replaced by a fan around
+    // their centroid, through those corners
+    std::vector<bool> replaced(mesh.num_triangles(), false);
+    for (size_t i = 0; i < triangles_to_check.size(); ++i) {
+        const size_t t = triangles_to_check[i];
+        const uint32_t corners[3] = {
+            mesh.triangles[3 * t],
+            mesh.triangles[3 * t + 1],
+            mesh.triangles[3 * t + 2],
+        };
+        if (corners[0] == corners[1] || corners[1] == corners[2] ||
+            corners[2] == corners[0])
+        {
+            continue;
+        }
+
+        std::vector<std::pair<Standard_Real, uint32_t> > found[3];
+        for (int j = 0; j < 3; ++j) {
+            find_points_on_edge(corners[j], corners[(j + 1) % 3], found[j]);
+        }
+
+        // near slivers, a corner can be close to two edges. it goes on the
+        // closer one.
+        for (int j = 0; j < 3; ++j) {
+            for (size_t k = 0; k < found[j].size(); ++k) {
+                const uint32_t index = found[j][k].second;
+                for (int other = j + 1; other < 3; ++other) {
+                    for (size_t m = 0; m < found[other].size(); ++m) {
+                        if (found[other][m].second != index) {
+                            continue;
+                        }
+
+                        const int farther = (distance_to_edge(index,
+                            corners[j], corners[(j + 1) % 3]) <=
+                            distance_to_edge(index, corners[other],
+                                corners[(other + 1) % 3])) ? other : j;
+                        found[farther][farther == j ? k : m].second =
+                            UINT32_MAX;
+                    }
+                }
+            }
+        }
+
+        std::vector<uint32_t> loop;
+        for (int j = 0; j < 3; ++j) {
+            loop.push_back(corners[j]);
+            for (size_t k = 0; k < found[j].size(); ++k) {
+                if (found[j][k].second != UINT32_MAX) {
+                    loop.push_back(found[j][k].second);
+                }
+            }
+        }
+
+        if (loop.size() == 3) {
+            continue;
+        }
+
+        replaced[t] = true;
+        const uint32_t center = add_vertex((mesh.vertices[corners[0]]
+            + mesh.vertices[corners[1]] + mesh.vertices[corners[2]]) / 3,
+            false);
+        for (size_t j = 0; j < loop.size(); ++j) {
+            push_triangle(loop[j], loop[(j + 1) % loop.size()], center,
+                false);
+        }
+    }
+
+    // merging corners can also collapse triangles
+    std::vector<uint32_t> triangles;
+    triangles.reserve(mesh.triangles.size());
+    for (size_t t = 0; t < mesh.num_triangles(); ++t) {
+        const uint32_t *corners = &mesh.triangles[3 * t];
+        if ((t < replaced.size() && replaced[t]) ||
+            corners[0] == corners[1] || corners[1] == corners[2] ||
+            corners[2] == corners[0])
+        {
+            continue;
+        }
+
+        triangles.insert(triangles.end(), corners, corners + 3);
+    }
+
+    mesh.triangles.swap(triangles);
+    close_small_holes();
+    check_watertight();
+    return mesh;
+}
+
+// approximate cut points can leave short cracks where the same crossing was
+// computed from two triangles. they're fanned shut, but only from an apex
+// whose fan triangles all face the same way as the loop, so a fill can't
+// fold over or turn inside out.
+void MeshBooleanOutput::close_small_holes()
+{
+    // a hole's boundary is made of edges without a twin going the other way
+    std::unordered_map<uint64_t, int> edge_balance;
+    for (size_t i = 0; i < mesh.triangles.size(); ++i) {
+        const uint64_t u = mesh.triangles[i];
+        const uint64_t v = mesh.triangles[i % 3 == 2 ? i - 2 : i + 1];
+        ++edge_balance[(u << 32) | v];
+        --edge_balance[(v << 32) | u];
+    }
+
+    // the edges that triangles filling the holes need
+    std::unordered_multimap<uint32_t, uint32_t> needed;
+    for (std::unordered_map<uint64_t, int>::const_iterator it =
+            edge_balance.begin(); it != edge_balance.end(); ++it)
+    {
+        for (int i = 0; i < it->second; ++i) {
+            needed.insert(std::make_pair(uint32_t(it->first),
+                uint32_t(it->first >> 32)));
+        }
+    }
+
+    while (!needed.empty()) {
+        // cracks that meet at a vertex are walked as one path, so loops are
+        // split off it whenever it comes back to a vertex it has been to
+        std::vector<uint32_t> path;
+        uint32_t current = needed.begin()->first;
+        while (path.size() <= MAX_HOLE_EDGES) {
+            std::vector<uint32_t>::iterator seen = std::find(path.begin(),
+                path.end(), current);
+            if (seen != path.end()) {
+                fill_hole(std::vector<uint32_t>(seen, path.end()));
+                path.erase(seen, path.end());
+                if (path.empty()) {
+                    break;
+                }
+            }
+
+            std::unordered_multimap<uint32_t, uint32_t>::iterator next =
+                needed.find(current);
+            if (next == needed.end()) {
+                break;
+            }
+
+            path.push_back(current);
+            current = next->second;
+            needed.erase(next);
+        }
+
+        // whatever is left is a real defect, which check_watertight reports
+    }
+}
+
+void MeshBooleanOutput::fill_hole(const std::vector<uint32_t> &loop)
+{
+    if (loop.size() < 3) {
+        return;
+    }
+
+    for (size_t apex = 0; apex < loop.size(); ++apex) {
+        if (!fan_is_consistent(loop, apex)) {
+            continue;
+        }
+
+        for (size_t i = 1; i + 1 < loop.size(); ++i) {
+            mesh.triangles.push_back(loop[apex]);
+            mesh.triangles.push_back(loop[(apex + i) % loop.size()]);
+            mesh.triangles.push_back(loop[(apex + i + 1) % loop.size()]);
+        }
+        return;
+    }
+}
+
+// whether every triangle of the fan from loop[apex] is strictly on the
+// positive side of the loop's (Newell) normal
+bool MeshBooleanOutput::fan_is_consistent(const std::vector<uint32_t> &loop,
+    size_t apex) const
+{
+    // taken about the apex, which keeps slivers far from the origin from
+    // cancelling out
+    const gp_XYZ &a = mesh.vertices[loop[apex]];
+    gp_XYZ normal(0, 0, 0);
+    for (size_t i = 0; i < loop.size(); ++i) {
+        const gp_XYZ &p = mesh.vertices[loop[i]];
+        const gp_XYZ &q = mesh.vertices[loop[(i + 1) % loop.size()]];
+        normal += (p - a) ^ (q - a);
+    }
+
+    const gp_XYZ above = a + normal;
+    for (size_t i = 1; i + 1 < loop.size(); ++i) {
+        const gp_XYZ &b = mesh.vertices[loop[(apex + i) % loop.size()]];
+        const gp_XYZ &c = mesh.vertices[loop[(apex + i + 1) % loop.size()]];
+        if (orient3d(a, b, c, above) <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// raises if any edge isn't matched by a twin going the other way, so that
+// leaking results don't silently flow into exports and later booleans
+void MeshBooleanOutput::check_watertight() const
+{
+    std::unordered_map<uint64_t, int> edge_balance;
+    for (size_t i = 0; i < mesh.triangles.size(); ++i) {
+        const uint64_t u = mesh.triangles[i];
+        const uint64_t v = mesh.triangles[i % 3 == 2 ? i - 2 : i + 1];
+        ++edge_balance[(u << 32) | v];
+        --edge_balance[(v << 32) | u];
+    }
+
+    size_t open_edges = 0;
+    for (std::unordered_map<uint64_t, int>::const_iterator it =
+            edge_balance.begin(); it != edge_balance.end(); ++it)
+    {
+        if (it->second > 0) {
+            open_edges += it->second;
+        }
+    }
+
+    if (open_edges > 0) {
+        raise_oce_error("mesh boolean result isn't watertight: %lu edges "
+            "have no matching neighbour (are both meshes closed?)",
+            (unsigned long)open_edges);
+    }
+}
+
+class MeshBoolean
+{
+public:
+    MeshBoolean(const TriangleMesh &a, const TriangleMesh &b,
+        Standard_Real eps);
+
+    TriangleMesh perform(MeshBooleanOp op);
+
+private:
+    enum Side
+    {
+        OUTSIDE,
+        INSIDE,
+        ON_SAME,
+        ON_OPPOSITE,
+    };
+
+    struct TriangleCuts
+    {
+        std::vector<MeshPlane> planes;
+        // the other mesh's triangles lying in the same plane
+        std::vector<uint32_t> coplanar;
+    };
+
+    struct Operand
+    {
+        // without slivers, which only confuse the plane tests
+        TriangleMesh mesh;
+        std::vector<MeshPlane> planes;
+        std::vector<Bnd_Box> boxes;
+        Bnd_Box box;
+        // only triangles touching the other mesh have cuts
+        std::unordered_map<uint32_t, TriangleCuts> cuts;
+    };
+
+    void prepare(Operand &operand, const TriangleMesh &mesh);
+    void find_touching_triangles();
+    void add_touching(uint32_t a, uint32_t b);
+    void add_kept_pieces(MeshBooleanOp op, int index,
+        MeshBooleanOutput &output);
+    static bool keep_side(MeshBooleanOp op, bool from_first, Side side,
+        bool &flip);
+
+    Operand operands[2];
+    Standard_Real eps;
+};
+
+MeshBoolean::MeshBoolean(const TriangleMesh &a, const TriangleMesh &b,
+    Standard_Real eps)
+    : eps(eps)
+{
+    prepare(operands[0], a);
+    prepare(operands[1], b);
+}
+
+void MeshBoolean::prepare(Operand &operand, const TriangleMesh &mesh)
+{
+    operand.mesh.vertices = mesh.vertices;
+
+    for (size_t t = 0; t < mesh.num_triangles(); ++t) {
+        const gp_XYZ corners[3] = {
+            mesh.corner(t, 0), mesh.corner(t, 1), mesh.corner(t, 2),
+        };
+
+        // twice the area is the longest edge times the height
+        gp_XYZ normal = (corners[1] - corners[0]) ^ (corners[2] - corners[0]);
+        const Standard_Real longest = std::max(
+            (corners[1] - corners[0]).Modulus(), std::max(
+                (corners[2] - corners[1]).Modulus(),
+                (corners[0] - corners[2]).Modulus()));
+        const Standard_Real twice_area = normal.Modulus();
+        if (twice_area <= eps * longest) {
+            continue;
+        }
+
+        operand.mesh.triangles.insert(operand.mesh.triangles.end(),
+            &mesh.triangles[3 * t], &mesh.triangles[3 * t + 3]);
+
+        normal.Divide(twice_area);
+        operand.planes.push_back(make_mesh_plane(normal, corners[0],
+            corners[1], corners[2]));
+
+        Bnd_Box box;
+        for (int i = 0; i < 3; ++i) {
+            box.Add(gp_Pnt(corners[i]));
+        }
+        box.Enlarge(eps);
+        operand.boxes.push_back(box);
+        operand.box.Add(box);
+    }
+}
+
+void MeshBoolean::add_touching(uint32_t a, uint32_t b)
+{
+    const Operand &first = operands[0];
+    const Operand &second = operands[1];
+
+    const gp_XYZ a_corners[3] = {
+        first.mesh.corner(a, 0), first.mesh.corner(a, 1),
+        first.mesh.corner(a, 2),
+    };
+    const gp_XYZ b_corners[3] = {
+        second.mesh.corner(b, 0), second.mesh.corner(b, 1),
+        second.mesh.corner(b, 2),
+    };
+
+    bool coplanar;
+    if (!triangles_touch(a_corners, b_corners, coplanar)) {
+        return;
+    }
+
+    TriangleCuts &a_cuts = operands[0].cuts[a];
+    TriangleCuts &b_cuts = operands[1].cuts[b];
+    if (coplanar) {
+        add_edge_planes(b_corners, second.planes[b], a_cuts.planes);
+        add_edge_planes(a_corners, first.planes[a], b_cuts.planes);
+        a_cuts.coplanar.push_back(b);
+        b_cuts.coplanar.push_back(a);
+    } else {
+        a_cuts.planes.push_back(second.planes[b]);
+        b_cuts.planes.push_back(first.planes[a]);
+    }
+}
+
+// only triangles in both meshes' boxes can touch. the second mesh's are put
+// in a grid over that region, which the first mesh's are looked up in.
+void MeshBoolean::find_touching_triangles()
+{
+    const Operand &first = operands[0];
+    const Operand &second = operands[1];
+    if (first.box.IsVoid() || second.box.IsVoid()) {
+        return;
+    }
+
+    Standard_Real lo[3], hi[3], second_lo[3], second_hi[3];
+    first.box.Get(lo[0], lo[1], lo[2], hi[0], hi[1], hi[2]);
+    second.box.Get(second_lo[0], second_lo[1], second_lo[2],
+        second_hi[0], second_hi[1], second_hi[2]);
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = std::max(lo[i], second_lo[i]);
+        hi[i] = std::min(hi[i], second_hi[i]);
+    }
+
+    Bnd_Box overlap;
+    overlap.Update(lo[0], lo[1], lo[2], hi[0], hi[1], hi[2]);
+
+    std::vector<uint32_t> near_second;
+    for (size_t t = 0; t < second.boxes.size(); ++t) {
+        if (!second.boxes[t].IsOut(overlap)) {
+            near_second.push_back(t);
+        }
+    }
+
+    if (near_second.empty()) {
+        return;
+    }
+
+    const size_t cells_per_side = std::min<size_t>(64, std::max<size_t>(1,
+        static_cast<size_t>(cbrt(Standard_Real(near_second.size())))));
+    Standard_Real cell_size[3];
+    for (int i = 0; i < 3; ++i) {
+        cell_size[i] = std::max((hi[i] - lo[i]) / cells_per_side,
+            std::numeric_limits<Standard_Real>::min());
+    }
+
+    // the cells a box covers, clamped to the grid
+    auto cell_range = [&](const Bnd_Box &box, size_t range[6]) {
+        Standard_Real box_lo[3], box_hi[3];
+        box.Get(box_lo[0], box_lo[1], box_lo[2],
+            box_hi[0], box_hi[1], box_hi[2]);
+        for (int i = 0; i < 3; ++i) {
+            const Standard_Real from = (box_lo[i] - lo[i]) / cell_size[i];
+            const Standard_Real to = (box_hi[i] - lo[i]) / cell_size[i];
+            range[2 * i] = static_cast<size_t>(std::max(0.0, from));
+            range[2 * i + 1] = std::min<size_t>(cells_per_side - 1,
+                static_cast<size_t>(std::max(0.0, to)));
+        }
+    };
+
+    std::vector<std::vector<uint32_t> > cells(
+        cells_per_side * cells_per_side * cells_per_side);
+    for (size_t i = 0; i < near_second.size(); ++i) {
+        size_t range[6];
+        cell_range(second.boxes[near_second[i]], range);
+        for (size_t x = range[0]; x <= range[1]; ++x) {
+            for (size_t y = range[2]; y <= range[3]; ++y) {
+                for (size_t z = range[4]; z <= range[5]; ++z) {
+                    cells[(x * cells_per_side + y) * cells_per_side + z]
+                        .push_back(near_second[i]);
+                }
+            }
+        }
+    }
+
+    // each pair is only tested once, even if they share several cells
+    std::vector<uint32_t> last_tested(second.boxes.size(), UINT32_MAX);
+    for (size_t a = 0; a < first.boxes.size(); ++a) {
+        if (first.boxes[a].IsOut(overlap)) {
+            continue;
+        }
+
+        size_t range[6];
+        cell_range(first.boxes[a], range);
+        for (size_t x = range[0]; x <= range[1]; ++x) {
+            for (size_t y = range[2]; y <= range[3]; ++y) {
+                for (size_t z = range[4]; z <= range[5]; ++z) {
+                    const std::vector<uint32_t> &cell =
+                        cells[(x * cells_per_side + y) * cells_per_side + z];
+                    for (size_t i = 0; i < cell.size(); ++i) {
+                        const uint32_t b = cell[i];
+                        if (last_tested[b] == a) {
+                            continue;
+                        }
+                        last_tested[b] = a;
+
+                        if (!first.boxes[a].IsOut(second.boxes[b])) {
+                            add_touching(a, b);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool MeshBoolean::keep_side(MeshBooleanOp op, bool from_first, Side side,
+    bool &flip)
+{
+    // pieces on both surfaces facing the same way are kept once, from the
+    // first mesh
+    flip = false;
+    switch (op) {
+    case MESH_UNION:
+        return side == OUTSIDE || (from_first && side == ON_SAME);
+
+    case MESH_INTERSECTION:
+        return side == INSIDE || (from_first && side == ON_SAME);
+
+    case MESH_DIFFERENCE:
+        if (from_first) {
+            return side == OUTSIDE || side == ON_OPPOSITE;
+        }
+
+        // the inside of the cut becomes the result's surface
+        flip = true;
+        return side == INSIDE;
+    }
+
+    return false;
+}
+
+static uint32_t find_root(std::vector<uint32_t> &parents, uint32_t i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+
+    return i;
+}
+
+void MeshBoolean::add_kept_pieces(MeshBooleanOp op, int index,
+    MeshBooleanOutput &output)
+{
+    const Operand &self = operands[index];
+    const Operand &other = operands[1 - index];
+    const TriangleMesh &mesh = self.mesh;
+    const size_t num_triangles = mesh.num_triangles();
+    const bool from_first = (index == 0);
+
+    MeshRayCaster rays(other.mesh);
+
+    // uncut triangles sharing an edge are on the same side of the other
+    // mesh, so they're grouped, and each group is classified once
+    std::vector<uint32_t> parents(num_triangles);
+    for (size_t t = 0; t < num_triangles; ++t) {
+        parents[t] = t;
+    }
+
+    std::vector<bool> near_cut(mesh.vertices.size(), false);
+    std::unordered_map<uint64_t, uint32_t> edge_triangles;
+    for (size_t t = 0; t < num_triangles; ++t) {
+        const bool is_cut = (self.cuts.count(t) != 0);
+
+        for (int i = 0; i < 3; ++i) {
+            const uint32_t u = mesh.triangles[3 * t + i];
+            const uint32_t v = mesh.triangles[3 * t + (i + 1) % 3];
+            if (is_cut) {
+                near_cut[u] = true;
+                continue;
+            }
+
+            const uint64_t key = (uint64_t(std::min(u, v)) << 32)
+                | std::max(u, v);
+            std::pair<std::unordered_map<uint64_t, uint32_t>::iterator,
+                bool> inserted = edge_triangles.insert(
+                    std::make_pair(key, static_cast<uint32_t>(t)));
+            if (!inserted.second) {
+                parents[find_root(parents, t)] =
+                    find_root(parents, inserted.first->second);
+            }
+        }
+    }
+
+    auto point_side = [&](const gp_XYZ &p) {
+        return rays.contains(p) ? INSIDE : OUTSIDE;
+    };
+
+    std::vector<signed char> group_sides(num_triangles, -1);
+    std::vector<gp_XYZ> polygon, front, back;
+    std::vector<std::vector<gp_XYZ> > pieces, next_pieces;
+
+    for (size_t t = 0; t < num_triangles; ++t) {
+        const gp_XYZ corners[3] = {
+            mesh.corner(t, 0), mesh.corner(t, 1), mesh.corner(t, 2),
+        };
+
+        std::unordered_map<uint32_t, TriangleCuts>::const_iterator cuts =
+            self.cuts.find(t);
+        if (cuts == self.cuts.end()) {
+            const uint32_t group = find_root(parents, t);
+            if (group_sides[group] < 0) {
+                group_sides[group] = self.boxes[t].IsOut(other.box)
+                    ? OUTSIDE
+                    : point_side((corners[0] + corners[1] + corners[2]) / 3);
+            }
+
+            bool flip;
+            if (keep_side(op, from_first, Side(group_sides[group]), flip)) {
+                const bool check = near_cut[mesh.triangles[3 * t]]
+                    || near_cut[mesh.triangles[3 * t + 1]]
+                    || near_cut[mesh.triangles[3 * t + 2]];
+                if (flip) {
+                    output.add_triangle(corners[0], corners[2], corners[1],
+                        check);
+                } else {
+                    output.add_triangle(corners[0], corners[1], corners[2],
+                        check);
+                }
+            }
+
+            continue;
+        }
+
+        pieces.assign(1, std::vector<gp_XYZ>(corners, corners + 3));
+        const std::vector<MeshPlane> &planes = cuts->second.planes;
+        for (size_t i = 0; i < planes.size(); ++i) {
+            next_pieces.clear();
+            for (size_t j = 0; j < pieces.size(); ++j) {
+                if (split_polygon(pieces[j], corners, planes[i], eps,
+                    front, back))
+                {
+                    next_pieces.push_back(front);
+                    next_pieces.push_back(back);
+                } else {
+                    next_pieces.push_back(pieces[j]);
+                }
+            }
+
+            pieces.swap(next_pieces);
+        }
+
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            const std::vector<gp_XYZ> &piece = pieces[i];
+
+            gp_XYZ center(0, 0, 0);
+            gp_XYZ normal(0, 0, 0);
+            for (size_t j = 0; j < piece.size(); ++j) {
+                center += piece[j];
+                normal += piece[j] ^ piece[(j + 1) % piece.size()];
+            }
+            center /= piece.size();
+
+            // slivers left over from cutting near a corner
+            if (normal.Modulus() <= eps * eps) {
+                continue;
+            }
+
+            Side side = OUTSIDE;
+            bool on_surface = false;
+            const std::vector<uint32_t> &coplanar = cuts->second.coplanar;
+            for (size_t j = 0; j < coplanar.size() && !on_surface; ++j) {
+                const uint32_t o = coplanar[j];
+                const MeshPlane &plane = other.planes[o];
+
+                on_surface = true;
+                for (int k = 0; k < 3 && on_surface; ++k) {
+                    const gp_XYZ &u = other.mesh.corner(o, k);
+                    const gp_XYZ &v = other.mesh.corner(o, (k + 1) % 3);
+                    on_surface = ((center - u) * ((v - u) ^ plane.normal)
+                        < 0);
+                }
+
+                if (on_surface) {
+                    side = (self.planes[t].normal * plane.normal > 0)
+                        ? ON_SAME
+                        : ON_OPPOSITE;
+                }
+            }
+
+            if (!on_surface) {
+                side = point_side(center);
+            }
+
+            bool flip;
+            if (keep_side(op, from_first, side, flip)) {
+                output.add_piece(piece, flip);
+            }
+        }
+    }
+}
+
+TriangleMesh MeshBoolean::perform(MeshBooleanOp op)
+{
+    find_touching_triangles();
+
+    MeshBooleanOutput output(eps);
+    add_kept_pieces(op, 0, output);
+    add_kept_pieces(op, 1, output);
+    return output.finish();
+}
+
+static Bnd_Box get_triangle_mesh_bbox(const TriangleMesh &mesh)
+{
+    Bnd_Box box;
+    for (size_t i = 0; i < mesh.triangles.size(); ++i) {
+        box.Add(gp_Pnt(mesh.vertices[mesh.triangles[i]]));
+    }
+
+    return box;
+}
+
+static void append_triangle_mesh(TriangleMesh &mesh,
+    const TriangleMesh &other)
+{
+    const uint32_t base = mesh.vertices.size();
+    mesh.vertices.insert(mesh.vertices.end(), other.vertices.begin(),
+        other.vertices.end());
+    for (size_t i = 0; i < other.triangles.size(); ++i) {
+        mesh.triangles.push_back(base + other.triangles[i]);
+    }
+}
+
+static TriangleMesh mesh_boolean(MeshBooleanOp op, const TriangleMesh &a,
+    const TriangleMesh &b)
+{
+    const Bnd_Box a_box = get_triangle_mesh_bbox(a);
+    const Bnd_Box b_box = get_triangle_mesh_bbox(b);
+
+    // meshes that can't touch are simply combined
+    if (a_box.IsVoid() || b_box.IsVoid() || a_box.IsOut(b_box)) {
+        TriangleMesh result;
+        if (op == MESH_UNION) {
+            result = a;
+            append_triangle_mesh(result, b);
+        } else if (op == MESH_DIFFERENCE) {
+            result = a;
+        }
+
+        return result;
+    }
+
+    Bnd_Box box = a_box;
+    box.Add(b_box);
+    const Standard_Real eps =
+        MESH_BOOLEAN_EPSILON * sqrt(box.SquareExtent());
+
+    ProfileScope scope("boolean", "mesh boolean");
+    MeshBoolean boolean(a, b, eps);
+    return boolean.perform(op);
+}
+
+// runs a Combination with the mesh booleans. B-rep shapes are replaced by
+// their tessellations.
+static TopoDS_Shape mesh_combine(MeshBooleanOp op,
+    const std::vector<TopoDS_Shape> &inputs, Standard_Real tolerance)
+{
+    BOPCol_ListOfShape first, rest;
+    if (op == MESH_UNION) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            append_unique_shape(rest, inputs[i]);
+        }
+
+        first.Append(rest.First());
+        rest.RemoveFirst();
+    } else {
+        split_combination_inputs(inputs, first, rest);
+    }
+
+    TriangleMesh result = get_triangle_mesh(first.First(), tolerance);
+    BOPCol_ListIteratorOfListOfShape it;
+    for (it.Initialize(rest); it.More(); it.Next()) {
+        result = mesh_boolean(op, result,
+            get_triangle_mesh(it.Value(), tolerance));
+    }
+
+    return make_mesh_shape(result);
+}
+
+// :in, :out or :on for each point, against the rendered shape's solids.
+// mesh shapes are ray cast, so their points are never :on. points are
+// split between the render threads, each with its own classifier.
+static Array shape_classify_points(Object self, Object points)
+{
+    const Standard_Real tolerance = get_tolerance();
+    const size_t num_threads = get_render_threads();
+    const std::vector<gp_Pnt> pnts = points_from_ruby(points, 3);
+    const TopoDS_Shape shape = *render_shape(self);
+
+    std::vector<TopAbs_State> states(pnts.size(), TopAbs_OUT);
+    without_gvl([&] {
+        Bnd_Box bbox;
+        BRepBndLib::Add(shape, bbox);
+        bbox.Enlarge(tolerance);
+
+        const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(
+            num_threads, pnts.size() / 256));
+
+        if (is_mesh_shape(shape)) {
+            const TriangleMesh mesh = get_mesh_shape_triangles(shape);
+            const MeshRayCaster caster(mesh);
+
+            run_on_threads(num_chunks, [&](size_t chunk) {
+                const size_t end = pnts.size() * (chunk + 1) / num_chunks;
+                for (size_t i = pnts.size() * chunk / num_chunks; i < end;
+                    ++i)
+                {
+                    if (!bbox.IsOut(pnts[i])
+                        && caster.contains(pnts[i].XYZ()))
+                    {
+                        states[i] = TopAbs_IN;
+                    }
+                }
+            });
+
+            return;
+        }
+
+        // OCE exceptions mustn't escape the threads
+        std::vector<std::string> errors(num_chunks);
+        run_on_threads(num_chunks, [&](size_t chunk) {
+            try {
+                BRepClass3d_SolidClassifier classifier(shape);
+
+                const size_t end = pnts.size() * (chunk + 1) / num_chunks;
+                for (size_t i = pnts.size() * chunk / num_chunks; i < end;
+                    ++i)
+                {
+                    if (!bbox.IsOut(pnts[i])) {
+                        classifier.Perform(pnts[i], tolerance);
+                        states[i] = classifier.State();
+                    }
+                }
+            } catch (const Standard_Failure &e) {
+                const char *message = e.GetMessageString();
+                errors[chunk] = (message && *message)
+                    ? message : "failed classifying points";
+            }
+        });
+
+        for (size_t i = 0; i < errors.size(); ++i) {
+            if (!errors[i].empty()) {
+                raise_oce_error("%s", errors[i].c_str());
+            }
+        }
+    });
+
+    const Symbol in("in"), out("out"), on("on");
+    Array result;
+    for (size_t i = 0; i < states.size(); ++i) {
+        switch (states[i]) {
+        case TopAbs_IN:
+            result.push(in);
+            break;
+        case TopAbs_ON:
+            result.push(on);
+            break;
+        default:
+            result.push(out);
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+enum BooleanEngine
+{
+    ENGINE_AUTO,
+    ENGINE_BREP,
+    ENGINE_MESH,
+};
+
+// a Combination's @engine: :brep or :mesh, or :auto (the default) to use
+// the mesh booleans only if one of its shapes renders to a mesh shape
+static BooleanEngine get_boolean_engine(Object self)
+{
+    const Object engine = self.iv_get("@engine");
+    if (engine.is_nil()) {
+        return ENGINE_AUTO;
+    }
+
+    const std::string name = engine.to_s().str();
+    if (name == "auto") {
+        return ENGINE_AUTO;
+    } else if (name == "brep") {
+        return ENGINE_BREP;
+    } else if (name == "mesh") {
+        return ENGINE_MESH;
+    } else {
+        throw Exception(rb_eArgError, "unknown boolean engine %s",
+            name.c_str());
+    }
+}
+
+static bool use_mesh_engine(BooleanEngine engine, const TaskInputs &inputs)
+{
+    if (engine != ENGINE_AUTO) {
+        return engine == ENGINE_MESH;
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (is_mesh_shape(inputs[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// inputs for the B-rep booleans, with mesh shapes turned into solids
+static TaskInputs get_brep_inputs(const TaskInputs &inputs)
+{
+    TaskInputs result;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const bool is_mesh = is_mesh_shape(inputs[i]);
+        result.push_back(is_mesh ? mesh_to_brep(inputs[i]) : inputs[i]);
+        result.shared.push_back(!is_mesh && inputs.is_shared(i));
+    }
+
+    return result;
+}
+
+// the booleans first compare their operands' bounding boxes, and skip the
+// full face-face intersection for operands that can't possibly touch. boxes
+// are enlarged by the tolerance, so shapes that just touch still go through
+// the boolean.
+static Bnd_Box get_bbox(const TopoDS_Shape &shape, Standard_Real tolerance)
+{
+    Bnd_Box bbox;
+    BRepBndLib::Add(shape, bbox);
+    bbox.Enlarge(tolerance);
+    return bbox;
+}
+
+// fuses shapes, which should all be different
+static TopoDS_Shape fuse_shapes(const std::vector<TopoDS_Shape> &shapes,
+    Standard_Real tolerance, const TopTools_MapOfShape &shared)
+{
+    std::vector<Bnd_Box> bboxes;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        bboxes.push_back(get_bbox(shapes[i], tolerance));
+    }
+
+    // group shapes whose boxes overlap, directly or through other
+    // shapes. each group is fused separately.
+    std::vector<size_t> group(shapes.size());
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        group[i] = i;
+    }
+
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        for (size_t j = i + 1; j < shapes.size(); ++j) {
+            if (group[i] == group[j] || bboxes[i].IsOut(bboxes[j])) {
+                continue;
+            }
+
+            const size_t old_group = group[j];
+            for (size_t k = 0; k < shapes.size(); ++k) {
+                if (group[k] == old_group) {
+                    group[k] = group[i];
+                }
+            }
+        }
+    }
+
+    std::vector<TopoDS_Shape> results;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (group[i] != i) {
+            continue;
+        }
+
+        BOPCol_ListOfShape first, rest;
+        first.Append(shapes[i]);
+        for (size_t j = i + 1; j < shapes.size(); ++j) {
+            if (group[j] == i) {
+                rest.Append(shapes[j]);
+            }
+        }
+
+        results.push_back(rest.IsEmpty()
+            ? shapes[i]
+            : perform_boolean(BOPAlgo_FUSE, first, rest, shared));
+    }
+
+    if (results.size() == 1) {
+        return results[0];
+    }
+
+    // the groups don't touch each other, so there's nothing to fuse
+    TopoDS_Compound compound;
+    BRep_Builder builder;
+    builder.MakeCompound(compound);
+    for (size_t i = 0; i < results.size(); ++i) {
+        builder.Add(compound, results[i]);
+    }
+
+    return TopoDS_Shape(compound);
+}
+
+// initialize is defined in Ruby code
+static RenderTask *plan_union(RenderPlan &plan, Object self)
+{
+    const Standard_Real tolerance = plan.tolerance();
+    const BooleanEngine engine = get_boolean_engine(self);
+
+    return plan.add_task(plan_combination_shapes(plan, self),
+        [=](const TaskInputs &rendered) {
+            if (use_mesh_engine(engine, rendered)) {
+                return mesh_combine(MESH_UNION, rendered, tolerance);
+            }
+
+            const TaskInputs inputs = get_brep_inputs(rendered);
+            BOPCol_ListOfShape unique;
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                append_unique_shape(unique, inputs[i]);
+            }
+
+            std::vector<TopoDS_Shape> shapes;
+            BOPCol_ListIteratorOfListOfShape it;
+            for (it.Initialize(unique); it.More(); it.Next()) {
+                shapes.push_back(it.Value());
+            }
+
+            return fuse_shapes(shapes, tolerance,
+                get_shared_operands(inputs));
+        });
+}
+
+
+static RenderTask *plan_difference(RenderPlan &plan, Object self)
+{
+    const Standard_Real tolerance = plan.tolerance();
+    const BooleanEngine engine = get_boolean_engine(self);
+
+    return plan.add_task(plan_combination_shapes(plan, self),
+        [=](const TaskInputs &rendered) {
+            if (use_mesh_engine(engine, rendered)) {
+                return mesh_combine(MESH_DIFFERENCE, rendered, tolerance);
+            }
+
+            const TaskInputs inputs = get_brep_inputs(rendered);
+            BOPCol_ListOfShape first, rest;
+            split_combination_inputs(inputs, first, rest);
+
+            // tools that are nowhere near the shape can't cut anything
+            const Bnd_Box first_bbox = get_bbox(first.First(), tolerance);
+            BOPCol_ListOfShape tools;
+            BOPCol_ListIteratorOfListOfShape it;
+            for (it.Initialize(rest); it.More(); it.Next()) {
+                if (!first_bbox.IsOut(get_bbox(it.Value(), tolerance))) {
+                    tools.Append(it.Value());
+                }
+            }
+
+            if (tools.IsEmpty()) {
+                return first.First();
+            }
+
+            // a - b - c == a - (b + c), so all tools are cut at once
+            return perform_boolean(BOPAlgo_CUT, first, tools,
+                get_shared_operands(inputs));
+        });
+}
+
+
+static RenderTask *plan_intersection(RenderPlan &plan, Object self)
+{
+    const Standard_Real tolerance = plan.tolerance();
+    const BooleanEngine engine = get_boolean_engine(self);
+
+    return plan.add_task(plan_combination_shapes(plan, self),
+        [=](const TaskInputs &rendered) {
+            if (use_mesh_engine(engine, rendered)) {
+                return mesh_combine(MESH_INTERSECTION, rendered, tolerance);
+            }
+
+            const TaskInputs inputs = get_brep_inputs(rendered);
+            BOPCol_ListOfShape first, rest;
+            split_combination_inputs(inputs, first, rest);
+
+            // if any two shapes are disjoint, so is the whole intersection
+            std::vector<Bnd_Box> bboxes;
+            bboxes.push_back(get_bbox(first.First(), tolerance));
+            BOPCol_ListIteratorOfListOfShape it;
+            for (it.Initialize(rest); it.More(); it.Next()) {
+                bboxes.push_back(get_bbox(it.Value(), tolerance));
+            }
+
+            for (size_t i = 0; i < bboxes.size(); ++i) {
+                for (size_t j = i + 1; j < bboxes.size(); ++j) {
+                    if (bboxes[i].IsOut(bboxes[j])) {
+                        return make_empty_shape();
+                    }
+                }
+            }
+
+            // the tools group is treated as a union, so common parts have
+            // to be found one tool at a time
+            const TopTools_MapOfShape shared = get_shared_operands(inputs);
+            TopoDS_Shape result = first.First();
+            size_t tool_index = 1;
+            for (it.Initialize(rest); it.More(); it.Next(), ++tool_index) {
+                // the result so far may have shrunk away from the next tool
+                if (tool_index > 1 &&
+                    get_bbox(result, tolerance).IsOut(bboxes[tool_index]))
+                {
+                    return make_empty_shape();
+                }
+
+                BOPCol_ListOfShape argument, tool;
+                argument.Append(result);
+                tool.Append(it.Value());
+                result = perform_boolean(BOPAlgo_COMMON, argument, tool,
+                    shared);
+            }
+
+            return result;
+        });
+}
+
+
+// copies of one shape, fused together. transforms is defined in Ruby code.
+static RenderTask *plan_pattern(RenderPlan &plan, Object self)
+{
+    const Array transforms_ary = self.call("transforms");
+    std::vector<gp_GTrsf> transforms;
+    for (size_t i = 0; i < transforms_ary.size(); ++i) {
+        transforms.push_back(from_ruby<gp_GTrsf>(transforms_ary[i]));
+    }
+
+    if (transforms.empty()) {
+        throw Exception(rb_eArgError, "pattern needs at least 1 copy");
+    }
+
+    // the shape is rendered once, and its copies are located instances
+    // sharing its geometry
+    RenderTask *shape = plan.add_shape(self.iv_get("@shape"));
+    const Standard_Real tolerance = plan.tolerance();
+
+    return plan.add_task(shape, [=](const TaskInputs &inputs) {
+        std::vector<TopoDS_Shape> copies;
+        TopTools_MapOfShape shared;
+        copies.reserve(transforms.size());
+        for (size_t i = 0; i < transforms.size(); ++i) {
+            copies.push_back(transform_shape(inputs[0], transforms[i]));
+            if (inputs.is_shared(0)) {
+                shared.Add(copies.back());
+            }
+        }
+
+        if (is_mesh_shape(inputs[0])) {
+            return mesh_combine(MESH_UNION, copies, tolerance);
+        }
+
+        return fuse_shapes(copies, tolerance, shared);
+    });
+}
+
+
+// twisted extrusions are built directly, rather than by sweeping each wire
+// and cutting the holes out. each profile edge sweeps one B-spline surface,
+// whose poles are the edge's poles carried along a helix. the helix is
+// interpolated once, at unit radius, and stretched to each pole, so the
+// surfaces only have a few spans along the extrusion. each vertex sweeps a
+// helical edge shared by its neighbouring faces, and the caps are built
+// from the swept edges, so a profile with holes becomes one solid.
+
+// the helix (cos(twist * v), sin(twist * v), v) for v from 0 to 1, close
+// enough to be off by at most tolerance at radius
+static Handle_Geom_BSplineCurve make_unit_helix(Standard_Real twist,
+    Standard_Real radius, Standard_Real tolerance)
+{
+    // clamped cubic interpolation is off by at most 5/384 * step^4 times
+    // the radius, with step the angle between interpolated points
+    const Standard_Real max_step = std::min(M_PI_2,
+        pow(384.0 * tolerance / (5.0 * std::max(radius, tolerance)), 0.25));
+    const int num_steps = std::max(1, (int)ceil(fabs(twist) / max_step));
+
+    Handle_TColgp_HArray1OfPnt points(
+        new TColgp_HArray1OfPnt(1, num_steps + 1));
+    Handle_TColStd_HArray1OfReal params(
+        new TColStd_HArray1OfReal(1, num_steps + 1));
+    for (int i = 0; i <= num_steps; ++i) {
+        const Standard_Real v = Standard_Real(i) / num_steps;
+        points->SetValue(i + 1,
+            gp_Pnt(cos(twist * v), sin(twist * v), v));
+        params->SetValue(i + 1, v);
+    }
+
+    GeomAPI_Interpolate interpolate(points, params, Standard_False,
+        Precision::Confusion());
+    interpolate.Load(gp_Vec(0, twist, 1),
+        gp_Vec(-twist * sin(twist), twist * cos(twist), 1), Standard_False);
+    interpolate.Perform();
+    if (!interpolate.IsDone()) {
+        raise_oce_error("failed interpolating twisted extrusion helix");
+    }
+
+    return interpolate.Curve();
+}
+
+class TwistSweeper
+{
+public:
+    TwistSweeper(const Handle_Geom_BSplineCurve &helix, Standard_Real height)
+        : helix(helix),
+          height(height)
+    {
+    }
+
+    TopoDS_Solid sweep(const TopoDS_Face &profile);
+
+private:
+    struct SweptVertex
+    {
+        TopoDS_Vertex bottom;
+        TopoDS_Vertex top;
+        // from bottom to top
+        TopoDS_Edge side;
+    };
+
+    struct SweptEdge
+    {
+        TopoDS_Edge bottom;
+        TopoDS_Edge top;
+        Handle_Geom_BSplineCurve bottom_curve;
+        Handle_Geom_BSplineCurve top_curve;
+    };
+
+    // p moved along the helix to the parameter of its jth pole
+    gp_Pnt twisted(const gp_Pnt &p, int j) const
+    {
+        const gp_Pnt &pole = helix->Pole(j);
+        return gp_Pnt(
+            pole.X() * p.X() - pole.Y() * p.Y(),
+            pole.X() * p.Y() + pole.Y() * p.X(),
+            p.Z() + pole.Z() * height);
+    }
+
+    Handle_Geom_BSplineCurve get_edge_curve(const TopoDS_Edge &edge) const;
+    const SweptVertex &sweep_vertex(const TopoDS_Vertex &vertex);
+    TopoDS_Edge make_edge(const Handle_Geom_Curve &curve,
+        const TopoDS_Vertex &first, const TopoDS_Vertex &last);
+    TopoDS_Face sweep_edge(const TopoDS_Edge &edge, SweptEdge &swept);
+    TopoDS_Face make_cap(const Handle_Geom_Plane &plane, bool top,
+        const std::vector<SweptEdge> &swept_edges);
+
+    Handle_Geom_BSplineCurve helix;
+    Standard_Real height;
+
+    TopoDS_Face profile;
+    Handle_Geom_Plane plane;
+    Standard_Real tolerance;
+    TopTools_IndexedMapOfShape vertices;
+    std::vector<SweptVertex> swept_vertices;
+    BRep_Builder builder;
+};
+
+TopoDS_Solid TwistSweeper::sweep(const TopoDS_Face &face)
+{
+    profile = TopoDS::Face(face.Oriented(TopAbs_FORWARD));
+    plane = Handle_Geom_Plane::DownCast(BRep_Tool::Surface(profile));
+    if (plane.IsNull()) {
+        raise_oce_error("twisted extrusion profiles must be planar");
+    }
+
+    vertices.Clear();
+    swept_vertices.clear();
+
+    // new edges and vertices are as far apart as the profile's were
+    tolerance = Precision::Confusion();
+    for (TopExp_Explorer ex(profile, TopAbs_VERTEX); ex.More(); ex.Next()) {
+        tolerance = std::max(tolerance,
+            BRep_Tool::Tolerance(TopoDS::Vertex(ex.Current())));
+    }
+
+    TopoDS_Shell shell;
+    builder.MakeShell(shell);
+
+    // in the order the cap's wires are explored
+    std::vector<SweptEdge> swept_edges;
+    for (TopExp_Explorer ex(profile, TopAbs_EDGE); ex.More(); ex.Next()) {
+        SweptEdge swept;
+        builder.Add(shell, sweep_edge(TopoDS::Edge(ex.Current()), swept));
+        swept_edges.push_back(swept);
+    }
+
+    // the bottom cap faces against the profile, like the prism's does
+    builder.Add(shell, make_cap(plane, false, swept_edges)
+        .Oriented(TopAbs_REVERSED));
+
+    gp_Trsf top_trsf;
+    top_trsf.SetRotation(gp::OZ(),
+        atan2(helix->EndPoint().Y(), helix->EndPoint().X()));
+    top_trsf.SetTranslationPart(gp_Vec(0, 0, height));
+    builder.Add(shell, make_cap(
+        Handle_Geom_Plane::DownCast(plane->Transformed(top_trsf)), true,
+        swept_edges));
+
+    shell.Closed(Standard_True);
+
+    TopoDS_Solid solid;
+    builder.MakeSolid(solid);
+    builder.Add(solid, shell);
+
+    fix_inside_out_solid(solid);
+    return solid;
+}
+
+Handle_Geom_BSplineCurve TwistSweeper::get_edge_curve(
+    const TopoDS_Edge &edge) const
+{
+    Standard_Real first, last;
+    Handle_Geom_Curve curve = BRep_Tool::Curve(edge, first, last);
+
+    // edges made in 2D (e.g. by cairo text) only have curves on the plane
+    if (curve.IsNull()) {
+        Handle_Geom2d_Curve pcurve =
+            BRep_Tool::CurveOnSurface(edge, profile, first, last);
+        if (pcurve.IsNull()) {
+            raise_oce_error("twisted extrusion profile edge has no curve");
+        }
+
+        curve = GeomAPI::To3d(pcurve, plane->Pln());
+    }
+
+    Handle_Geom_Curve trimmed(new Geom_TrimmedCurve(curve, first, last));
+    Handle_Geom_BSplineCurve bspline =
+        GeomConvert::CurveToBSplineCurve(trimmed);
+    if (bspline->IsPeriodic()) {
+        bspline->SetNotPeriodic();
+    }
+
+    return bspline;
+}
+
+const TwistSweeper::SweptVertex &TwistSweeper::sweep_vertex(
+    const TopoDS_Vertex &vertex)
+{
+    const int index = vertices.Add(vertex);
+    if (index <= static_cast<int>(swept_vertices.size())) {
+        return swept_vertices[index - 1];
+    }
+
+    const gp_Pnt p = BRep_Tool::Pnt(vertex);
+
+    // the helix, stretched to p
+    Handle_Geom_BSplineCurve side_curve =
+        Handle_Geom_BSplineCurve::DownCast(helix->Copy());
+    for (int j = 1; j <= helix->NbPoles(); ++j) {
+        side_curve->SetPole(j, twisted(p, j));
+    }
+
+    SweptVertex swept;
+    builder.MakeVertex(swept.bottom, p, tolerance);
+    builder.MakeVertex(swept.top, twisted(p, helix->NbPoles()), tolerance);
+    swept.side = make_edge(side_curve, swept.bottom, swept.top);
+
+    swept_vertices.push_back(swept);
+    return swept_vertices.back();
+}
+
+TopoDS_Edge TwistSweeper::make_edge(const Handle_Geom_Curve &curve,
+    const TopoDS_Vertex &first, const TopoDS_Vertex &last)
+{
+    TopoDS_Edge edge;
+    builder.MakeEdge(edge, curve, tolerance);
+    builder.Add(edge, first.Oriented(TopAbs_FORWARD));
+    builder.Add(edge, last.Oriented(TopAbs_REVERSED));
+    builder.Range(edge, curve->FirstParameter(), curve->LastParameter());
+    return edge;
+}
+
+// the face swept by edge, which goes counterclockwise in its (u, v)
+// parameters: u along the edge, and v up the helix
+TopoDS_Face TwistSweeper::sweep_edge(const TopoDS_Edge &edge,
+    SweptEdge &swept)
+{
+    Handle_Geom_BSplineCurve curve = get_edge_curve(edge);
+    const int num_u = curve->NbPoles();
+    const int num_v = helix->NbPoles();
+
+    TColgp_Array2OfPnt poles(1, num_u, 1, num_v);
+    for (int i = 1; i <= num_u; ++i) {
+        for (int j = 1; j <= num_v; ++j) {
+            poles(i, j) = twisted(curve->Pole(i), j);
+        }
+    }
+
+    TColStd_Array1OfReal u_knots(1, curve->NbKnots());
+    TColStd_Array1OfInteger u_mults(1, curve->NbKnots());
+    curve->Knots(u_knots);
+    curve->Multiplicities(u_mults);
+
+    TColStd_Array1OfReal v_knots(1, helix->NbKnots());
+    TColStd_Array1OfInteger v_mults(1, helix->NbKnots());
+    helix->Knots(v_knots);
+    helix->Multiplicities(v_mults);
+
+    Handle_Geom_BSplineSurface surface;
+    if (curve->IsRational()) {
+        TColStd_Array2OfReal weights(1, num_u, 1, num_v);
+        for (int i = 1; i <= num_u; ++i) {
+            for (int j = 1; j <= num_v; ++j) {
+                weights(i, j) = curve->Weight(i);
+            }
+        }
+
+        surface = new Geom_BSplineSurface(poles, weights, u_knots, v_knots,
+            u_mults, v_mults, curve->Degree(), helix->Degree());
+    } else {
+        surface = new Geom_BSplineSurface(poles, u_knots, v_knots,
+            u_mults, v_mults, curve->Degree(), helix->Degree());
+    }
+
+    // the surface's first and last rows of poles are the edge's, at the
+    // bottom and top
+    swept.bottom_curve = curve;
+    swept.top_curve = Handle_Geom_BSplineCurve::DownCast(curve->Copy());
+    for (int i = 1; i <= num_u; ++i) {
+        swept.top_curve->SetPole(i, poles(i, num_v));
+    }
+
+    // copied, since sweeping the last vertex may move the first
+    const SweptVertex first = sweep_vertex(TopExp::FirstVertex(edge));
+    const SweptVertex last = sweep_vertex(TopExp::LastVertex(edge));
+    swept.bottom = make_edge(swept.bottom_curve, first.bottom, last.bottom);
+    swept.top = make_edge(swept.top_curve, first.top, last.top);
+
+    TopoDS_Face face;
+    builder.MakeFace(face, surface, tolerance);
+
+    const Standard_Real u0 = curve->FirstParameter();
+    const Standard_Real u1 = curve->LastParameter();
+    const Standard_Real v1 = helix->LastParameter();
+    Handle_Geom2d_Curve bottom(
+        new Geom2d_Line(gp_Pnt2d(0, 0), gp_Dir2d(1, 0)));
+    Handle_Geom2d_Curve top(
+        new Geom2d_Line(gp_Pnt2d(0, v1), gp_Dir2d(1, 0)));
+    builder.UpdateEdge(swept.bottom, bottom, face, tolerance);
+    builder.UpdateEdge(swept.top, top, face, tolerance);
+
+    Handle_Geom2d_Curve last_side(
+        new Geom2d_Line(gp_Pnt2d(u1, 0), gp_Dir2d(0, 1)));
+    Handle_Geom2d_Curve first_side(
+        new Geom2d_Line(gp_Pnt2d(u0, 0), gp_Dir2d(0, 1)));
+    if (first.side.IsSame(last.side)) {
+        // a closed edge sweeps a closed surface, with its side as the seam
+        builder.UpdateEdge(first.side, last_side, first_side, face,
+            tolerance);
+    } else {
+        builder.UpdateEdge(last.side, last_side, face, tolerance);
+        builder.UpdateEdge(first.side, first_side, face, tolerance);
+    }
+
+    TopoDS_Wire wire;
+    builder.MakeWire(wire);
+    builder.Add(wire, swept.bottom);
+    builder.Add(wire, last.side);
+    builder.Add(wire, swept.top.Oriented(TopAbs_REVERSED));
+    builder.Add(wire, first.side.Oriented(TopAbs_REVERSED));
+    wire.Closed(Standard_True);
+    builder.Add(face, wire);
+
+    // edges going against the profile sweep faces facing the other way
+    return TopoDS::Face(face.Oriented(edge.Orientation()));
+}
+
+// a cap with the profile's wires, made of the swept edges' bottoms or tops
+TopoDS_Face TwistSweeper::make_cap(const Handle_Geom_Plane &cap_plane,
+    bool top, const std::vector<SweptEdge> &swept_edges)
+{
+    TopoDS_Face face;
+    builder.MakeFace(face, cap_plane, tolerance);
+
+    size_t edge_index = 0;
+    for (TopExp_Explorer wire_ex(profile, TopAbs_WIRE); wire_ex.More();
+        wire_ex.Next())
+    {
+        TopoDS_Wire wire;
+        builder.MakeWire(wire);
+
+        for (TopExp_Explorer ex(wire_ex.Current(), TopAbs_EDGE); ex.More();
+            ex.Next(), ++edge_index)
+        {
+            const SweptEdge &swept = swept_edges[edge_index];
+            const TopoDS_Edge &edge = top ? swept.top : swept.bottom;
+            const Handle_Geom_BSplineCurve &curve =
+                top ? swept.top_curve : swept.bottom_curve;
+
+            builder.UpdateEdge(edge, GeomAPI::To2d(curve, cap_plane->Pln()),
+                face, tolerance);
+            builder.Add(wire, edge.Oriented(ex.Current().Orientation()));
+        }
+
+        wire.Closed(Standard_True);
+        builder.Add(face, wire);
+    }
+
+    return face;
+}
+
+static TopoDS_Shape twist_extrude(TopoDS_Shape shape, Standard_Real height,
+    Standard_Real twist, Standard_Real tolerance)
+{
+    ProfileScope scope("extrusion", "twist");
+
+    BRep_Builder builder;
+    TopoDS_Compound compound;
+    builder.MakeCompound(compound);
+
+    Bnd_Box bbox;
+    BRepBndLib::Add(shape, bbox);
+    if (bbox.IsVoid()) {
+        return compound;
+    }
+
+    // the profile's farthest point from the axis it's twisted around
+    Standard_Real xmin, ymin, zmin, xmax, ymax, zmax;
+    bbox.Get(xmin, ymin, zmin, xmax, ymax, zmax);
+    const Standard_Real radius = sqrt(
+        std::max(xmin * xmin, xmax * xmax) +
+        std::max(ymin * ymin, ymax * ymax));
+
+    TwistSweeper sweeper(make_unit_helix(twist, radius, tolerance / 2),
+        height);
+    for (TopExp_Explorer ex(shape, TopAbs_FACE); ex.More(); ex.Next()) {
+        builder.Add(compound, sweeper.sweep(TopoDS::Face(ex.Current())));
+    }
+
+    return compound;
+}
+
+// initialize is defined in Ruby code
+static RenderTask *plan_linear_extrusion(RenderPlan &plan, Object self)
+{
+    RenderTask *profile = plan.add_shape(self.iv_get("@profile"));
+    const Standard_Real height =
+        from_ruby<Standard_Real>(self.iv_get("@height"));
+    const Standard_Real twist =
+        from_ruby<Standard_Real>(self.iv_get("@twist"));
+    const Standard_Real tolerance = plan.tolerance();
+
+    return plan.add_task(profile,
+        [=](const TaskInputs &inputs) -> TopoDS_Shape {
+            if (0 == twist) {
+                return BRepPrimAPI_MakePrism(inputs[0], gp_Vec(0, 0, height),
+                    Standard_True).Shape();
+            } else {
+                return twist_extrude(inputs[0], height, twist, tolerance);
+            }
+        });
+}
+
+
+static RenderTask *plan_revolution(RenderPlan &plan, Object self)
+{
+    RenderTask *profile = plan.add_shape(self.iv_get("@profile"));
+
+    Object angle = self.iv_get("@angle");
+    const bool full_circle = angle.is_nil();
+
+    Standard_Real angle_num = 0;
+    if (!full_circle) {
+        angle_num = from_ruby<Standard_Real>(angle);
+        angle_num = std::max(angle_num, 0.0);
+        angle_num = std::min(angle_num, M_PI * 2);
+    }
+
+    // the whole profile is swept at once, so faces with holes become solids
+    // with holes directly, with no boolean
+    return plan.add_task(profile, [=](const TaskInputs &inputs) {
+        ProfileScope scope("extrusion", "revolve");
+
+        // around the y axis, turning x towards z
+        const gp_Ax1 axis(gp::Origin(), -gp::DY());
+        if (full_circle) {
+            return BRepPrimAPI_MakeRevol(inputs[0], axis).Shape();
+        } else {
+            return BRepPrimAPI_MakeRevol(inputs[0], axis, angle_num).Shape();
+        }
+    });
+}
+
+
+// hull points are extracted in stages:
+// 1. planes, cylinders and cones are ruled surfaces, so their hulls are the
+//    hulls of their boundaries. shapes made only of them (and of mesh
+//    faces, which contribute their nodes) only have their edges sampled.
+//    shapes with other faces contribute all the vertices of their cached
+//    tessellation.
+// 2. duplicates (e.g. nodes on edges shared by curved faces) are removed.
+// 3. points that are inside a polyhedron spanned by a few extreme points
+//    can't be hull vertices, and are dropped (Akl-Toussaint).
+
+static bool is_ruled_face(const TopoDS_Face &face)
+{
+    switch (BRepAdaptor_Surface(face, Standard_False).GetType()) {
+    case GeomAbs_Plane:
+    case GeomAbs_Cylinder:
+    case GeomAbs_Cone:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static void add_edge_points(const TopoDS_Edge &edge,
+    Standard_Real tolerance, std::vector<gp_Pnt> &points)
+{
+    if (BRep_Tool::Degenerated(edge)) {
+        // e.g. a cone's apex; its vertex is still added
+        TopoDS_Vertex v1, v2;
+        TopExp::Vertices(edge, v1, v2);
+        if (!v1.IsNull()) {
+            points.push_back(BRep_Tool::Pnt(v1));
+        }
+        return;
+    }
+
+    // sampled as finely as the mesh would be, so the hull is as accurate
+    BRepAdaptor_Curve curve(edge);
+    GCPnts_TangentialDeflection sampler(curve, MESH_ANGULAR_DEFLECTION,
+        tolerance);
+    for (Standard_Integer i = 1; i <= sampler.NbPoints(); ++i) {
+        points.push_back(sampler.Value(i));
+    }
+}
+
+static void add_face_nodes(const TopoDS_Face &face,
+    std::vector<gp_Pnt> &points)
+{
+    TopLoc_Location loc;
+    Handle(Poly_Triangulation) tri = BRep_Tool::Triangulation(face, loc);
+    if (tri.IsNull()) {
+        raise_oce_error("No triangulation");
+    }
+
+    const gp_Trsf trsf = loc.Transformation();
+    const TColgp_Array1OfPnt &nodes = tri->Nodes();
+    for (Standard_Integer i = nodes.Lower(); i <= nodes.Upper(); ++i) {
+        points.push_back(nodes(i).Transformed(trsf));
+    }
+}
+
+static void add_hull_points(const TopoDS_Shape &shape,
+    Standard_Real tolerance, std::vector<gp_Pnt> &points)
+{
+    bool have_curved_faces = false;
+    for (TopExp_Explorer ex(shape, TopAbs_FACE);
+        ex.More() && !have_curved_faces; ex.Next())
+    {
+        const TopoDS_Face &face = TopoDS::Face(ex.Current());
+        have_curved_faces = !is_mesh_face(face) && !is_ruled_face(face);
+    }
+
+    if (have_curved_faces) {
+        // the whole shape's mesh, as kept in the tessellation cache, so
+        // it's shared with exports and mesh booleans of the same shape
+        TessellationCache::MeshPtr mesh = get_tessellation(shape, tolerance);
+        for (size_t i = 0; i < mesh->num_vertices(); ++i) {
+            points.push_back(mesh->vertex(i));
+        }
+    } else {
+        TopTools_IndexedMapOfShape ruled_edges;
+        for (TopExp_Explorer ex(shape, TopAbs_FACE); ex.More(); ex.Next()) {
+            const TopoDS_Face &face = TopoDS::Face(ex.Current());
+            if (is_mesh_face(face)) {
+                add_face_nodes(face, points);
+            } else {
+                // shared edges are only sampled once
+                TopExp::MapShapes(face, TopAbs_EDGE, ruled_edges);
+            }
+        }
+
+        for (int i = 1; i <= ruled_edges.Extent(); ++i) {
+            add_edge_points(TopoDS::Edge(ruled_edges(i)), tolerance, points);
+        }
+    }
+
+    // shapes without faces, e.g. wires, only have edges
+    for (TopExp_Explorer ex(shape, TopAbs_EDGE, TopAbs_FACE); ex.More();
+        ex.Next())
+    {
+        add_edge_points(TopoDS::Edge(ex.Current()), tolerance, points);
+    }
+}
+
+static bool pnt_less(const gp_Pnt &a, const gp_Pnt &b)
+{
+    if (a.X() != b.X()) {
+        return a.X() < b.X();
+    } else if (a.Y() != b.Y()) {
+        return a.Y() < b.Y();
+    } else {
+        return a.Z() < b.Z();
+    }
+}
+
+static bool pnt_equal(const gp_Pnt &a, const gp_Pnt &b)
+{
+    return a.X() == b.X() && a.Y() == b.Y() && a.Z() == b.Z();
+}
+
+// volume of tetrahedron (a, b, c, d) times 6, positive if d is on the side
+// of (a, b, c) that its normal points to
+static Standard_Real signed_volume(const gp_XYZ &a, const gp_XYZ &b,
+    const gp_XYZ &c, const gp_XYZ &d)
+{
+    return ((b - a) ^ (c - a)) * (d - a);
+}
+
+// drops points that are strictly inside one of 8 tetrahedra, each spanned
+// by the centroid of the 6 axis-extreme points, and one extreme point for
+// each axis. the tetrahedra are inside the hull, so none of the dropped
+// points can be hull vertices.
+static void drop_interior_points(std::vector<gp_Pnt> &points)
+{
+    if (points.size() < 16) {
+        return;
+    }
+
+    // min and max points along each axis
+    gp_XYZ extremes[3][2];
+    for (int axis = 0; axis < 3; ++axis) {
+        size_t min_index = 0, max_index = 0;
+        for (size_t i = 1; i < points.size(); ++i) {
+            const Standard_Real value = points[i].Coord(axis + 1);
+            if (value < points[min_index].Coord(axis + 1)) {
+                min_index = i;
+            }
+            if (value > points[max_index].Coord(axis + 1)) {
+                max_index = i;
+            }
+        }
+
+        extremes[axis][0] = points[min_index].XYZ();
+        extremes[axis][1] = points[max_index].XYZ();
+    }
+
+    gp_XYZ center(0, 0, 0);
+    for (int axis = 0; axis < 3; ++axis) {
+        center += extremes[axis][0] + extremes[axis][1];
+    }
+    center /= 6;
+
+    struct Tetrahedron
+    {
+        gp_XYZ vertices[4];
+        Standard_Real epsilon;
+    };
+
+    std::vector<Tetrahedron> tetrahedra;
+    for (int i = 0; i < 8; ++i) {
+        Tetrahedron tet;
+        tet.vertices[0] = center;
+        tet.vertices[1] = extremes[0][i & 1];
+        tet.vertices[2] = extremes[1][(i >> 1) & 1];
+        tet.vertices[3] = extremes[2][(i >> 2) & 1];
+
+        Standard_Real volume = signed_volume(tet.vertices[0],
+            tet.vertices[1], tet.vertices[2], tet.vertices[3]);
+        if (volume < 0) {
+            std::swap(tet.vertices[1], tet.vertices[2]);
+            volume = -volume;
+        }
+
+        // flat tetrahedra can't contain anything. points on or very near
+        // a tetrahedron's faces are kept.
+        if (volume < gp::Resolution()) {
+            continue;
+        }
+        tet.epsilon = volume * 1e-9;
+        tetrahedra.push_back(tet);
+    }
+
+    size_t num_kept = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+        const gp_XYZ &p = points[i].XYZ();
+
+        bool inside = false;
+        for (size_t t = 0; t < tetrahedra.size() && !inside; ++t) {
+            const gp_XYZ *v = tetrahedra[t].vertices;
+            const Standard_Real eps = tetrahedra[t].epsilon;
+            inside = signed_volume(v[0], v[1], v[2], p) > eps
+                && signed_volume(v[0], v[2], v[3], p) > eps
+                && signed_volume(v[0], v[3], v[1], p) > eps
+                && signed_volume(v[1], v[3], v[2], p) > eps;
+        }
+
+        if (!inside) {
+            points[num_kept++] = points[i];
+        }
+    }
+
+    points.resize(num_kept);
+}
+
+static std::vector<gp_Pnt> get_points_from_shapes(const TaskInputs &shapes,
+    Standard_Real tolerance)
+{
+    std::vector<gp_Pnt> points;
+
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        add_hull_points(shapes[i], tolerance, points);
+    }
+
+    std::sort(points.begin(), points.end(), pnt_less);
+    points.erase(std::unique(points.begin(), points.end(), pnt_equal),
+        points.end());
+
+    drop_interior_points(points);
+
+    return points;
+}
+
+
+// builds the hull's B-rep straight from qhull's facets. each qhull vertex
+// becomes one TopoDS_Vertex, and each pair of adjacent vertices one edge,
+// shared by the two facets on either side of it. facets are planar faces
+// whose normals are qhull's outward facet normals, so the solid is
+// oriented correctly without sewing or classification.
+static TopoDS_Solid make_solid_from_qhull(qhT *qh)
+{
+    std::map<unsigned int, TopoDS_Vertex> vertices;
+    std::map<std::pair<unsigned int, unsigned int>, TopoDS_Edge> edges;
+
+    BRep_Builder builder;
+    TopoDS_Shell shell;
+    builder.MakeShell(shell);
+
+    facetT *facet;
+    FORALLfacets {
+        // in order around the facet. merged (non-simplicial) facets have
+        // more than 3.
+        setT *facet_vertices = qh_facet3vertex(qh, facet);
+
+        std::vector<vertexT *> ordered;
+        vertexT *vertex, **vertexp;
+        FOREACHvertex_(facet_vertices) {
+            ordered.push_back(vertex);
+        }
+        qh_settempfree(qh, &facet_vertices);
+
+        const gp_Dir normal(facet->normal[0], facet->normal[1],
+            facet->normal[2]);
+
+        // qhull's order may be either way around, so compare with the
+        // outward normal (Newell's method)
+        gp_XYZ order_normal(0, 0, 0);
+        for (size_t i = 0; i < ordered.size(); ++i) {
+            const coordT *p = ordered[i]->point;
+            const coordT *q = ordered[(i + 1) % ordered.size()]->point;
+            order_normal += gp_XYZ(
+                (p[1] - q[1]) * (p[2] + q[2]),
+                (p[2] - q[2]) * (p[0] + q[0]),
+                (p[0] - q[0]) * (p[1] + q[1]));
+        }
+
+        if (order_normal * normal.XYZ() < 0) {
+            std::reverse(ordered.begin(), ordered.end());
+        }
+
+        TopoDS_Wire wire;
+        builder.MakeWire(wire);
+
+        for (size_t i = 0; i < ordered.size(); ++i) {
+            vertexT *from = ordered[i];
+            vertexT *to = ordered[(i + 1) % ordered.size()];
+
+            const bool forward = from->id < to->id;
+            const std::pair<unsigned int, unsigned int> edge_key = forward
+                ? std::make_pair(from->id, to->id)
+                : std::make_pair(to->id, from->id);
+
+            TopoDS_Edge &edge = edges[edge_key];
+            if (edge.IsNull()) {
+                TopoDS_Vertex v[2];
+                vertexT *qh_v[2] = {
+                    forward ? from : to,
+                    forward ? to : from,
+                };
+
+                for (int j = 0; j < 2; ++j) {
+                    TopoDS_Vertex &shared = vertices[qh_v[j]->id];
+                    if (shared.IsNull()) {
+                        shared = BRepBuilderAPI_MakeVertex(gp_Pnt(
+                            qh_v[j]->point[0],
+                            qh_v[j]->point[1],
+                            qh_v[j]->point[2]));
+                    }
+                    v[j] = shared;
+                }
+
+                edge = BRepBuilderAPI_MakeEdge(v[0], v[1]);
+            }
+
+            builder.Add(wire, forward ? edge : TopoDS::Edge(edge.Reversed()));
+        }
+
+        wire.Closed(Standard_True);
+
+        const gp_Pnt origin(
+            -facet->offset * normal.X(),
+            -facet->offset * normal.Y(),
+            -facet->offset * normal.Z());
+        builder.Add(shell,
+            BRepBuilderAPI_MakeFace(gp_Pln(origin, normal), wire).Face());
+    }
+
+    shell.Closed(Standard_True);
+
+    TopoDS_Solid solid;
+    builder.MakeSolid(solid);
+    builder.Add(solid, shell);
+    return solid;
+}
+
+// a reentrant qhull context. it's freed when destroyed, even if building
+// the hull throws, so each hull can have its own.
+class QhullContext
+{
+public:
+    QhullContext()
+    {
+        qh_zero(&qh, stderr);
+    }
+
+    ~QhullContext()
+    {
+        qh_freeqhull(&qh, !qh_ALL);
 
-    TopoDS_Shell shell = TopoDS::Shell(sewing.SewedShape());
-    // TODO: check for free/multiple edges and problems from sewing object
+        int curlong, totlong;
+        qh_memfreeshort(&qh, &curlong, &totlong);
+        if (curlong || totlong) {
+            fprintf(stderr,
+                "qhull did not free %d bytes of long memory (%d pieces)\n",
+                totlong, curlong);
+        }
+    }
 
-    TopoDS_Solid solid = BRepBuilderAPI_MakeSolid(shell).Solid();
+    qhT *get()
+    {
+        return &qh;
+    }
 
-    fix_inside_out_solid(solid);
+private:
+    QhullContext(const QhullContext &);
+    QhullContext &operator =(const QhullContext &);
 
-    return solid;
+    qhT qh;
+};
+
+static TopoDS_Shape make_hull(const TaskInputs &shapes,
+    Standard_Real tolerance)
+{
+    ProfileScope scope("hull", "qhull");
+    std::vector<gp_Pnt> points = get_points_from_shapes(shapes, tolerance);
+
+    QhullContext context;
+    qhT *qh = context.get();
+
+    char flags[128];
+    // without Qt, coplanar facets are merged into single polygonal faces
+    strcpy(flags, "qhull");
+    int err = qh_new_qhull(qh, 3, points.size(),
+        // each point contains a gp_XYZ which contains X,Y,Z as Standard_Reals
+        reinterpret_cast<Standard_Real*>(points.data()),
+        false, flags, NULL, stderr);
+    if (err) {
+        raise_oce_error("Error running qhull");
+    }
+
+    return make_solid_from_qhull(qh);
 }
 
 static Object _hull(Array shapes)
 {
     try {
-        std::vector<gp_Pnt> points = get_points_from_shapes(shapes);
-
-        char flags[128];
-        strcpy(flags, "qhull Qt");
-        int err = qh_new_qhull(3, points.size(),
-            // each point contains a gp_XYZ which contains X,Y,Z as Standard_Reals
-            reinterpret_cast<Standard_Real*>(points.data()),
-            false, flags, NULL, stderr);
-        if (err) {
-            throw Exception(rb_cOCEError, "Error running qhull");
-        }
-
-        TopoDS_Solid solid = make_solid_from_qhull();
+        RenderPlan plan;
 
-        qh_freeqhull(!qh_ALL);
-        int curlong, totlong;
-        qh_memfreeshort(&curlong, &totlong);
-        if (curlong || totlong) {
-            throw Exception(rb_cOCEError,
-                "did not free %d bytes of long memory (%d pieces)",
-                totlong, curlong);
+        std::vector<RenderTask *> inputs;
+        {
+            ProfileScope scope("plan", "plan");
+            for (size_t i = 0; i < shapes.size(); ++i) {
+                inputs.push_back(plan.add_shape(shapes[i]));
+            }
         }
 
-        return wrap_rendered_shape(solid);
+        const Standard_Real tolerance = plan.tolerance();
+        RenderTask *hull = plan.add_task(inputs,
+            [=](const TaskInputs &inputs) {
+                return make_hull(inputs, tolerance);
+            });
+
+        plan.run();
+        return wrap_rendered_shape(hull->result);
     } catch (const Standard_Failure &e) {
         // this throws an exception, so return won't be reached
         translate_oce_exception(e);
@@ -910,6 +6798,623 @@ static Object _hull(Array shapes)
     }
 }
 
+// for each item, the innermost of the items containing it, or -1, given
+// every item's containers. with nothing crossing, that's the container
+// with one fewer container of its own.
+static std::vector<int> innermost_containers(
+    const std::vector<std::vector<int> > &containers)
+{
+    std::vector<int> parents(containers.size(), -1);
+    for (size_t i = 0; i < containers.size(); ++i) {
+        for (size_t k = 0; k < containers[i].size(); ++k) {
+            const int j = containers[i][k];
+            if (containers[j].size() + 1 == containers[i].size()) {
+                parents[i] = j;
+            }
+        }
+    }
+
+    return parents;
+}
+
+// nests wires in the XY plane, which mustn't cross, by testing one point
+// on each against the others. returns the innermost wire containing each,
+// or -1. only wires whose bounding boxes enclose each other are tested,
+// and each containing wire gets a single classifier.
+static std::vector<int> nest_wires(const std::vector<TopoDS_Wire> &wires,
+    const std::vector<gp_Pnt2d> &points)
+{
+    const size_t num_wires = wires.size();
+
+    std::vector<Standard_Real> boxes(num_wires * 4);
+    Standard_Real max_width = 0;
+    for (size_t i = 0; i < num_wires; ++i) {
+        Bnd_Box bbox;
+        BRepBndLib::Add(wires[i], bbox);
+
+        Standard_Real *box = &boxes[i * 4];
+        Standard_Real zmin, zmax;
+        bbox.Get(box[0], box[1], zmin, box[2], box[3], zmax);
+        max_width = std::max(max_width, box[2] - box[0]);
+    }
+
+    // a container's box starts at most max_width left of what it contains
+    std::vector<size_t> order(num_wires);
+    for (size_t i = 0; i < num_wires; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return boxes[a * 4] < boxes[b * 4];
+    });
+
+    std::vector<Standard_Real> lefts;
+    for (size_t i = 0; i < num_wires; ++i) {
+        lefts.push_back(boxes[order[i] * 4]);
+    }
+
+    std::vector<TopoDS_Face> faces(num_wires);
+    std::vector<gp_Pln> planes(num_wires);
+    std::vector<std::unique_ptr<BRepTopAdaptor_FClass2d> >
+        classifiers(num_wires);
+    std::vector<std::vector<int> > containers(num_wires);
+
+    for (size_t j = 0; j < num_wires; ++j) {
+        const Standard_Real *inner = &boxes[j * 4];
+
+        size_t k = std::lower_bound(lefts.begin(), lefts.end(),
+            inner[0] - max_width) - lefts.begin();
+        for (; k < num_wires && lefts[k] <= inner[0]; ++k) {
+            const size_t i = order[k];
+            const Standard_Real *outer = &boxes[i * 4];
+            if (i == j || outer[1] > inner[1] || outer[2] < inner[2]
+                || outer[3] < inner[3])
+            {
+                continue;
+            }
+
+            if (!classifiers[i]) {
+                faces[i] = BRepBuilderAPI_MakeFace(wires[i], Standard_True);
+
+                BRepAdaptor_Surface surface(faces[i]);
+                if (surface.GetType() != GeomAbs_Plane) {
+                    raise_oce_error("wire %lu isn't planar", (unsigned long)i);
+                }
+
+                planes[i] = surface.Plane();
+                classifiers[i].reset(new BRepTopAdaptor_FClass2d(faces[i],
+                    Precision::PConfusion()));
+            }
+
+            Standard_Real u, v;
+            ElSLib::Parameters(planes[i],
+                gp_Pnt(points[j].X(), points[j].Y(), 0), u, v);
+            if (classifiers[i]->Perform(gp_Pnt2d(u, v)) == TopAbs_IN) {
+                containers[j].push_back(i);
+            }
+        }
+    }
+
+    return innermost_containers(containers);
+}
+
+#ifdef HAVE_FREETYPE
+
+// a closed glyph contour, in font units scaled to the text size. each
+// segment is a line (2 poles) or a Bezier curve (3 or 4 poles), and starts
+// where the previous one ends.
+struct GlyphContour
+{
+    std::vector<std::vector<gp_Pnt2d> > segments;
+    // the segments' ends, plus a few points along each curve. only used to
+    // find the contour's orientation and which contours are inside which.
+    std::vector<gp_Pnt2d> polygon;
+};
+
+// receives a glyph outline from FT_Outline_Decompose
+class GlyphOutlineReader
+{
+public:
+    explicit GlyphOutlineReader(Standard_Real scale)
+        : scale(scale)
+    {
+    }
+
+    std::vector<GlyphContour> read(FT_Outline &outline);
+
+private:
+    static int move_to(const FT_Vector *to, void *user);
+    static int line_to(const FT_Vector *to, void *user);
+    static int conic_to(const FT_Vector *control, const FT_Vector *to,
+        void *user);
+    static int cubic_to(const FT_Vector *control1, const FT_Vector *control2,
+        const FT_Vector *to, void *user);
+
+    gp_Pnt2d point(const FT_Vector *v) const
+    {
+        return gp_Pnt2d(v->x * scale, v->y * scale);
+    }
+
+    void add_segment(const std::vector<gp_Pnt2d> &poles);
+    void close_contour();
+
+    Standard_Real scale;
+    std::vector<GlyphContour> contours;
+    GlyphContour contour;
+    gp_Pnt2d start;
+};
+
+std::vector<GlyphContour> GlyphOutlineReader::read(FT_Outline &outline)
+{
+    FT_Outline_Funcs funcs;
+    funcs.move_to = move_to;
+    funcs.line_to = line_to;
+    funcs.conic_to = conic_to;
+    funcs.cubic_to = cubic_to;
+    funcs.shift = 0;
+    funcs.delta = 0;
+
+    contours.clear();
+    contour = GlyphContour();
+    if (FT_Outline_Decompose(&outline, &funcs, this) != 0) {
+        raise_oce_error("failed reading glyph outline");
+    }
+
+    close_contour();
+    return contours;
+}
+
+int GlyphOutlineReader::move_to(const FT_Vector *to, void *user)
+{
+    GlyphOutlineReader *reader = static_cast<GlyphOutlineReader *>(user);
+    reader->close_contour();
+    reader->start = reader->point(to);
+    reader->contour.polygon.push_back(reader->start);
+    return 0;
+}
+
+int GlyphOutlineReader::line_to(const FT_Vector *to, void *user)
+{
+    GlyphOutlineReader *reader = static_cast<GlyphOutlineReader *>(user);
+    std::vector<gp_Pnt2d> poles(1, reader->point(to));
+    reader->add_segment(poles);
+    return 0;
+}
+
+int GlyphOutlineReader::conic_to(const FT_Vector *control,
+    const FT_Vector *to, void *user)
+{
+    GlyphOutlineReader *reader = static_cast<GlyphOutlineReader *>(user);
+    std::vector<gp_Pnt2d> poles;
+    poles.push_back(reader->point(control));
+    poles.push_back(reader->point(to));
+    reader->add_segment(poles);
+    return 0;
+}
+
+int GlyphOutlineReader::cubic_to(const FT_Vector *control1,
+    const FT_Vector *control2, const FT_Vector *to, void *user)
+{
+    GlyphOutlineReader *reader = static_cast<GlyphOutlineReader *>(user);
+    std::vector<gp_Pnt2d> poles;
+    poles.push_back(reader->point(control1));
+    poles.push_back(reader->point(control2));
+    poles.push_back(reader->point(to));
+    reader->add_segment(poles);
+    return 0;
+}
+
+// adds a segment from the current point through poles
+void GlyphOutlineReader::add_segment(const std::vector<gp_Pnt2d> &poles)
+{
+    const gp_Pnt2d from = contour.polygon.back();
+
+    // skip segments that don't go anywhere, which fonts do have
+    bool degenerate = true;
+    for (size_t i = 0; i < poles.size(); ++i) {
+        degenerate = degenerate && poles[i].IsEqual(from, 0.0);
+    }
+    if (degenerate) {
+        return;
+    }
+
+    std::vector<gp_Pnt2d> segment(1, from);
+    segment.insert(segment.end(), poles.begin(), poles.end());
+
+    // sample curves with de Casteljau's algorithm
+    if (segment.size() > 2) {
+        for (int step = 1; step < 4; ++step) {
+            const Standard_Real t = step / 4.0;
+            std::vector<gp_XY> p;
+            for (size_t i = 0; i < segment.size(); ++i) {
+                p.push_back(segment[i].XY());
+            }
+            for (size_t n = p.size() - 1; n > 0; --n) {
+                for (size_t i = 0; i < n; ++i) {
+                    p[i] = p[i] * (1.0 - t) + p[i + 1] * t;
+                }
+            }
+            contour.polygon.push_back(gp_Pnt2d(p[0]));
+        }
+    }
+
+    contour.segments.push_back(segment);
+    contour.polygon.push_back(segment.back());
+}
+
+void GlyphOutlineReader::close_contour()
+{
+    if (contour.polygon.empty()) {
+        return;
+    }
+
+    // FreeType contours are implicitly closed
+    if (!contour.polygon.back().IsEqual(start, 0.0)) {
+        add_segment(std::vector<gp_Pnt2d>(1, start));
+    }
+
+    // contours of fewer than 2 segments enclose nothing
+    if (contour.segments.size() >= 2) {
+        contour.polygon.pop_back();
+        contours.push_back(contour);
+    }
+
+    contour = GlyphContour();
+}
+
+// twice the signed area of a polygon. positive if counterclockwise.
+static Standard_Real polygon_area(const std::vector<gp_Pnt2d> &polygon)
+{
+    Standard_Real area = 0;
+    for (size_t i = 0; i < polygon.size(); ++i) {
+        const gp_Pnt2d &a = polygon[i];
+        const gp_Pnt2d &b = polygon[(i + 1) % polygon.size()];
+        area += a.X() * b.Y() - b.X() * a.Y();
+    }
+
+    return area;
+}
+
+static bool is_pnt_in_polygon(const gp_Pnt2d &p,
+    const std::vector<gp_Pnt2d> &polygon)
+{
+    bool inside = false;
+    for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+        const gp_Pnt2d &a = polygon[i];
+        const gp_Pnt2d &b = polygon[j];
+        if ((a.Y() > p.Y()) != (b.Y() > p.Y())
+            && p.X() < a.X() + (b.X() - a.X()) * (p.Y() - a.Y())
+                / (b.Y() - a.Y()))
+        {
+            inside = !inside;
+        }
+    }
+
+    return inside;
+}
+
+// for each contour, the index of the innermost contour containing it, or
+// -1. glyph contours don't cross, so one point of each is enough.
+static std::vector<int> nest_glyph_contours(
+    const std::vector<GlyphContour> &contours)
+{
+    std::vector<std::vector<int> > containers(contours.size());
+    for (size_t i = 0; i < contours.size(); ++i) {
+        for (size_t j = 0; j < contours.size(); ++j) {
+            if (i != j && is_pnt_in_polygon(contours[i].polygon[0],
+                contours[j].polygon))
+            {
+                containers[i].push_back(j);
+            }
+        }
+    }
+
+    return innermost_containers(containers);
+}
+
+static TopoDS_Wire make_glyph_wire(const GlyphContour &contour,
+    bool counterclockwise)
+{
+    const std::vector<std::vector<gp_Pnt2d> > &segments = contour.segments;
+
+    // each segment shares its end vertex with the next one
+    std::vector<TopoDS_Vertex> vertices;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const gp_Pnt2d &p = segments[i][0];
+        vertices.push_back(BRepBuilderAPI_MakeVertex(gp_Pnt(p.X(), p.Y(), 0)));
+    }
+
+    BRep_Builder builder;
+    TopoDS_Wire wire;
+    builder.MakeWire(wire);
+
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const std::vector<gp_Pnt2d> &segment = segments[i];
+        const TopoDS_Vertex &from = vertices[i];
+        const TopoDS_Vertex &to = vertices[(i + 1) % vertices.size()];
+
+        if (segment.size() == 2) {
+            builder.Add(wire, BRepBuilderAPI_MakeEdge(from, to).Edge());
+            continue;
+        }
+
+        TColgp_Array1OfPnt poles(1, segment.size());
+        for (size_t k = 0; k < segment.size(); ++k) {
+            poles.SetValue(k + 1, gp_Pnt(segment[k].X(), segment[k].Y(), 0));
+        }
+
+        Handle_Geom_Curve curve(new Geom_BezierCurve(poles));
+        builder.Add(wire, BRepBuilderAPI_MakeEdge(curve, from, to).Edge());
+    }
+
+    wire.Closed(Standard_True);
+
+    const bool is_counterclockwise = polygon_area(contour.polygon) > 0;
+    return is_counterclockwise == counterclockwise
+        ? wire
+        : TopoDS::Wire(wire.Reversed());
+}
+
+// a compound of a glyph's faces, or a null shape if it has none (e.g. a
+// space). contours nested an even number of levels deep are outer wires,
+// and the contours directly inside them are their holes, so fonts with
+// either winding convention work.
+static TopoDS_Shape make_glyph_faces(const std::vector<GlyphContour> &contours)
+{
+    if (contours.empty()) {
+        return TopoDS_Shape();
+    }
+
+    const std::vector<int> parents = nest_glyph_contours(contours);
+
+    std::vector<bool> is_hole(contours.size(), false);
+    for (size_t i = 0; i < contours.size(); ++i) {
+        for (int j = parents[i]; j >= 0; j = parents[j]) {
+            is_hole[i] = !is_hole[i];
+        }
+    }
+
+    BRep_Builder builder;
+    TopoDS_Compound compound;
+    builder.MakeCompound(compound);
+
+    for (size_t i = 0; i < contours.size(); ++i) {
+        if (is_hole[i]) {
+            continue;
+        }
+
+        BRepBuilderAPI_MakeFace face_maker(gp_Pln(),
+            make_glyph_wire(contours[i], true));
+        for (size_t j = 0; j < contours.size(); ++j) {
+            if (parents[j] == static_cast<int>(i)) {
+                face_maker.Add(make_glyph_wire(contours[j], false));
+            }
+        }
+
+        builder.Add(compound, face_maker.Face());
+    }
+
+    return compound;
+}
+
+struct Glyph
+{
+    // faces, with the glyph's origin at 0, 0
+    TopoDS_Shape faces;
+    // in font units
+    FT_Pos advance;
+};
+
+// a font face, and the glyphs built from it so far at each size
+struct GlyphFont
+{
+    FT_Face face;
+    // style the font itself doesn't have, so is faked like cairo does
+    bool embolden;
+    bool oblique;
+    std::map<std::pair<Standard_Real, FT_UInt>, Glyph> glyphs;
+};
+
+// FreeType faces can't be used by several threads at once, so text is laid
+// out by one thread at a time
+static std::mutex glyph_mutex;
+static FT_Library glyph_library;
+// keyed by font name and style
+static std::map<std::string, std::unique_ptr<GlyphFont> > glyph_fonts;
+
+static GlyphFont &get_glyph_font(const std::string &font_name, bool bold,
+    bool italic)
+{
+    const std::string key = font_name
+        + (bold ? ":bold" : "") + (italic ? ":italic" : "");
+
+    std::map<std::string, std::unique_ptr<GlyphFont> >::const_iterator
+        found = glyph_fonts.find(key);
+    if (found != glyph_fonts.end()) {
+        return *found->second;
+    }
+
+    if (!glyph_library && FT_Init_FreeType(&glyph_library) != 0) {
+        raise_oce_error("failed initializing FreeType");
+    }
+
+    FcPattern *pattern = FcPatternCreate();
+    FcPatternAddString(pattern, FC_FAMILY,
+        reinterpret_cast<const FcChar8 *>(font_name.c_str()));
+    FcPatternAddInteger(pattern, FC_WEIGHT,
+        bold ? FC_WEIGHT_BOLD : FC_WEIGHT_REGULAR);
+    FcPatternAddInteger(pattern, FC_SLANT,
+        italic ? FC_SLANT_ITALIC : FC_SLANT_ROMAN);
+    FcPatternAddBool(pattern, FC_SCALABLE, FcTrue);
+    FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+
+    FcResult result;
+    FcPattern *match = FcFontMatch(NULL, pattern, &result);
+    FcPatternDestroy(pattern);
+
+    FcChar8 *file;
+    if (!match || FcPatternGetString(match, FC_FILE, 0, &file)
+        != FcResultMatch)
+    {
+        if (match) {
+            FcPatternDestroy(match);
+        }
+        raise_oce_error("no font found for '%s'", font_name.c_str());
+    }
+
+    const std::string path(reinterpret_cast<const char *>(file));
+    int index = 0;
+    int weight = FC_WEIGHT_REGULAR;
+    int slant = FC_SLANT_ROMAN;
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    FcPatternGetInteger(match, FC_WEIGHT, 0, &weight);
+    FcPatternGetInteger(match, FC_SLANT, 0, &slant);
+    FcPatternDestroy(match);
+
+    FT_Face face;
+    if (FT_New_Face(glyph_library, path.c_str(), index, &face) != 0) {
+        raise_oce_error("failed loading font %s", path.c_str());
+    }
+
+    if (!FT_IS_SCALABLE(face)) {
+        FT_Done_Face(face);
+        raise_oce_error("font %s has no outlines", path.c_str());
+    }
+
+    GlyphFont *font = new GlyphFont();
+    font->face = face;
+    font->embolden = bold && weight < FC_WEIGHT_DEMIBOLD;
+    font->oblique = italic && slant == FC_SLANT_ROMAN;
+
+    glyph_fonts[key].reset(font);
+    return *font;
+}
+
+static const Glyph &get_glyph(GlyphFont &font, Standard_Real size,
+    FT_UInt index)
+{
+    const std::pair<Standard_Real, FT_UInt> key(size, index);
+    std::map<std::pair<Standard_Real, FT_UInt>, Glyph>::const_iterator
+        found = font.glyphs.find(key);
+    if (found != font.glyphs.end()) {
+        return found->second;
+    }
+
+    // unhinted outlines in font units, which we scale ourselves
+    FT_Face face = font.face;
+    if (FT_Load_Glyph(face, index, FT_LOAD_NO_SCALE | FT_LOAD_NO_BITMAP) != 0
+        || face->glyph->format != FT_GLYPH_FORMAT_OUTLINE)
+    {
+        raise_oce_error("failed loading glyph %u", index);
+    }
+
+    FT_Outline &outline = face->glyph->outline;
+    Glyph glyph;
+    glyph.advance = face->glyph->advance.x;
+
+    if (font.oblique) {
+        FT_Matrix shear = { 0x10000, 0x0366A, 0, 0x10000 };
+        FT_Outline_Transform(&outline, &shear);
+    }
+
+    if (font.embolden) {
+        const FT_Pos strength = face->units_per_EM / 24;
+        FT_Outline_Embolden(&outline, strength);
+        glyph.advance += strength;
+    }
+
+    GlyphOutlineReader reader(size / face->units_per_EM);
+    glyph.faces = make_glyph_faces(reader.read(outline));
+
+    return font.glyphs[key] = glyph;
+}
+
+// lays out text on one line starting at the origin, with y up. each
+// distinct glyph is built once per font and size, then placed wherever
+// it's used. the cached faces are shared by every text, and extrusions
+// reuse their profile's edges, so each text gets its own copy of a glyph
+// rather than the cache's, and only its repeats share one.
+static TopoDS_Shape layout_text(const std::vector<uint32_t> &codepoints,
+    const std::string &font_name, Standard_Real size, bool bold, bool italic)
+{
+    ProfileScope scope("text", "glyphs");
+    std::lock_guard<std::mutex> lock(glyph_mutex);
+
+    GlyphFont &font = get_glyph_font(font_name, bold, italic);
+    FT_Face face = font.face;
+    const Standard_Real scale = size / face->units_per_EM;
+
+    BRep_Builder builder;
+    TopoDS_Compound compound;
+    builder.MakeCompound(compound);
+
+    FT_Pos pen_x = 0;
+    FT_UInt prev_index = 0;
+    std::map<FT_UInt, TopoDS_Shape> copies;
+
+    for (size_t i = 0; i < codepoints.size(); ++i) {
+        // there's only one line, so skip line breaks and the like
+        if (codepoints[i] < 0x20) {
+            continue;
+        }
+
+        const FT_UInt index = FT_Get_Char_Index(face, codepoints[i]);
+
+        FT_Vector kerning;
+        if (prev_index != 0 && FT_HAS_KERNING(face)
+            && FT_Get_Kerning(face, prev_index, index, FT_KERNING_UNSCALED,
+                &kerning) == 0)
+        {
+            pen_x += kerning.x;
+        }
+
+        const Glyph &glyph = get_glyph(font, size, index);
+        if (!glyph.faces.IsNull()) {
+            TopoDS_Shape &faces = copies[index];
+            if (faces.IsNull()) {
+                faces = BRepBuilderAPI_Copy(glyph.faces).Shape();
+            }
+
+            gp_Trsf placement;
+            placement.SetTranslation(gp_Vec(pen_x * scale, 0, 0));
+            builder.Add(compound, faces.Moved(TopLoc_Location(placement)));
+        }
+
+        pen_x += glyph.advance;
+        prev_index = index;
+    }
+
+    return compound;
+}
+
+static RenderTask *plan_text(RenderPlan &plan, Object self)
+{
+    const std::string font_name =
+        String(self.iv_get("@font_name").call("to_s")).str();
+    const Standard_Real font_size =
+        from_ruby<Standard_Real>(self.iv_get("@font_size"));
+    const bool bold = self.iv_get("@bold").test();
+    const bool italic = self.iv_get("@italic").test();
+
+    if (font_size <= 0) {
+        throw Exception(rb_eArgError, "Text must have a positive font size");
+    }
+
+    const Array codepoints_ary(
+        self.iv_get("@text").call("to_s").call("codepoints"));
+    std::vector<uint32_t> codepoints;
+    codepoints.reserve(codepoints_ary.size());
+    for (size_t i = 0; i < codepoints_ary.size(); ++i) {
+        codepoints.push_back(from_ruby<unsigned int>(codepoints_ary[i]));
+    }
+
+    return plan.add_task([=](const TaskInputs &) {
+        return layout_text(codepoints, font_name, font_size, bold, italic);
+    });
+}
+
+#endif
+
 static TopoDS_Shape _new_line2D(Object p1, Object p2)
 {
     gp_Pnt2d gp1 = from_ruby<gp_Pnt2d>(p1);
@@ -984,29 +7489,101 @@ static TopoDS_Shape _new_compound(Array shapes)
     return compound;
 }
 
-static bool _is_pnt2D_in_face(Object p, TopoDS_Shape face_shape)
+// [parent index or nil] for each wire, given a point on each. see
+// nest_wires.
+static Array _nest_wires(Array wires, Array points)
+{
+    if (points.size() != wires.size()) {
+        throw Exception(rb_eArgError,
+            "need one point per wire, but got %lu points for %lu wires",
+            (unsigned long)points.size(), (unsigned long)wires.size());
+    }
+
+    std::vector<TopoDS_Wire> wire_shapes;
+    std::vector<gp_Pnt2d> pnts;
+    for (size_t i = 0; i < wires.size(); ++i) {
+        wire_shapes.push_back(TopoDS::Wire(from_ruby<TopoDS_Shape>(wires[i])));
+        pnts.push_back(from_ruby<gp_Pnt2d>(points[i]));
+    }
+
+    std::vector<int> parents;
+    without_gvl([&] {
+        parents = nest_wires(wire_shapes, pnts);
+    });
+
+    Array result;
+    for (size_t i = 0; i < parents.size(); ++i) {
+        result.push(parents[i] < 0 ? Object(Qnil) : to_ruby(parents[i]));
+    }
+
+    return result;
+}
+
+
+static void profiler__start()
+{
+    profile_log.start();
+}
+
+static void profiler__stop()
+{
+    profile_log.stop();
+}
+
+// [path, category, thread, start, wall, self_wall, cpu, memory_delta,
+// faces, edges] for each recorded scope, in the order they ended. times
+// are in microseconds.
+static Array profiler__events()
 {
-    gp_Pnt2d gpnt = from_ruby<gp_Pnt2d>(p);
-    TopoDS_Face face = TopoDS::Face(face_shape);
+    const std::vector<ProfileEvent> events = profile_log.events();
+
+    Array events_ary;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const ProfileEvent &event = events[i];
+
+        Array event_ary;
+        event_ary.push(String(event.path));
+        event_ary.push(String(event.category));
+        event_ary.push(static_cast<int>(event.thread));
+        event_ary.push(event.start);
+        event_ary.push(event.wall);
+        event_ary.push(event.self_wall);
+        event_ary.push(event.cpu);
+        event_ary.push(event.memory_delta);
+        event_ary.push(event.faces);
+        event_ary.push(event.edges);
+        events_ary.push(event_ary);
+    }
 
-    BRepTopAdaptor_FClass2d fclass2D(face, Precision::PConfusion());
-    return (fclass2D.Perform(gpnt) == TopAbs_IN);
+    return events_ary;
 }
 
 
 extern "C"
 void Init__rcad()
 {
+    // shapes are rendered by several threads at once
+    Standard::SetReentrant(Standard_True);
+
     rb_cRenderedShape = define_class<TopoDS_Shape>("RenderedShape")
+        .add_handler<Standard_Failure>(translate_oce_exception)
         .define_method("_reversed", &rendered_shape__reversed)
+        .define_method("_write_brep", &rendered_shape__write_brep)
+        .define_method("_bbox", &shape__bbox)
+        .define_singleton_method("_read_brep", &rendered_shape__read_brep)
         .define_singleton_method("_new_line2D", &_new_line2D)
         .define_singleton_method("_new_curve2D", &_new_curve2D)
         .define_singleton_method("_new_wire", &_new_wire)
         .define_singleton_method("_new_face", &_new_face)
+        .define_singleton_method("_nest_wires", &_nest_wires)
         .define_singleton_method("_new_compound", &_new_compound);
 
-    Data_Type<Standard_Failure> rb_cOCEError =
-        define_class("OCEError", rb_eRuntimeError);
+    rb_cOCEError = define_class("OCEError", rb_eRuntimeError);
+
+    define_class("Profiler")
+        .define_singleton_method("_start", &profiler__start)
+        .define_singleton_method("_stop", &profiler__stop)
+        .define_singleton_method("_events", &profiler__events);
 
     Class rb_cTransform = define_class<gp_GTrsf>("Transform")
         .add_handler<Standard_Failure>(translate_oce_exception)
@@ -1028,70 +7605,97 @@ void Init__rcad()
     rb_cShape = define_class("Shape")
         .add_handler<Standard_Failure>(translate_oce_exception)
         .define_method("write_stl", &shape_write_stl)
+        .define_method("_write_mesh", &shape__write_mesh)
         .define_method("_bbox", &shape__bbox)
-        .define_singleton_method("from_stl", &shape_from_stl);
+        .define_method("classify_points", &shape_classify_points)
+        .define_singleton_method("_from_stl", &shape__from_stl);
 
     Class rb_cTransformedShape = define_class("TransformedShape", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &transformed_shape_render);
+        .define_method("render", &render_with_planner<plan_transformed_shape>);
+    register_planner(rb_cTransformedShape, plan_transformed_shape);
 
     Class rb_cPolygon = define_class("Polygon", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &polygon_render);
+        .define_method("render", &render_with_planner<plan_polygon>);
+    register_planner(rb_cPolygon, plan_polygon);
 
     Class rb_cCircle = define_class("Circle", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &circle_render);
+        .define_method("render", &render_with_planner<plan_circle>);
+    register_planner(rb_cCircle, plan_circle);
 
 
     Class rb_cBox = define_class("Box", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &box_render);
+        .define_method("render", &render_with_planner<plan_box>);
+    register_planner(rb_cBox, plan_box);
 
     Class rb_cCone = define_class("Cone", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &cone_render);
+        .define_method("render", &render_with_planner<plan_cone>);
+    register_planner(rb_cCone, plan_cone);
 
     Class rb_cCylinder = define_class("Cylinder", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &cylinder_render);
+        .define_method("render", &render_with_planner<plan_cylinder>);
+    register_planner(rb_cCylinder, plan_cylinder);
 
     Class rb_cSphere = define_class("Sphere", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &sphere_render);
+        .define_method("render", &render_with_planner<plan_sphere>);
+    register_planner(rb_cSphere, plan_sphere);
 
     Class rb_cPolyhedron = define_class("Polyhedron", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &polyhedron_render);
+        .define_method("render", &render_with_planner<plan_polyhedron>);
+    register_planner(rb_cPolyhedron, plan_polyhedron);
 
     Class rb_cTorus = define_class("Torus", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &torus_render);
+        .define_method("render", &render_with_planner<plan_torus>);
+    register_planner(rb_cTorus, plan_torus);
 
     Class rb_cCombination = define_class("Combination", rb_cShape)
-        .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("initialize", &combination_initialize);
+        .add_handler<Standard_Failure>(translate_oce_exception);
 
     Class rb_cUnion = define_class("Union", rb_cCombination)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &union_render);
+        .define_method("render", &render_with_planner<plan_union>);
+    register_planner(rb_cUnion, plan_union);
 
     Class rb_cDifference = define_class("Difference", rb_cCombination)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &difference_render);
+        .define_method("render", &render_with_planner<plan_difference>);
+    register_planner(rb_cDifference, plan_difference);
 
     Class rb_cIntersection = define_class("Intersection", rb_cCombination)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &intersection_render);
+        .define_method("render", &render_with_planner<plan_intersection>);
+    register_planner(rb_cIntersection, plan_intersection);
+
+    Class rb_cPattern = define_class("Pattern", rb_cShape)
+        .add_handler<Standard_Failure>(translate_oce_exception)
+        .define_method("render", &render_with_planner<plan_pattern>);
+    register_planner(rb_cPattern, plan_pattern);
 
     Class rb_cLinearExtrusion = define_class("LinearExtrusion", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &linear_extrusion_render);
+        .define_method("render", &render_with_planner<plan_linear_extrusion>);
+    register_planner(rb_cLinearExtrusion, plan_linear_extrusion);
 
     Class rb_cRevolution = define_class("Revolution", rb_cShape)
         .add_handler<Standard_Failure>(translate_oce_exception)
-        .define_method("render", &revolution_render);
+        .define_method("render", &render_with_planner<plan_revolution>);
+    register_planner(rb_cRevolution, plan_revolution);
+
+#ifdef HAVE_FREETYPE
+    // otherwise, Text is rendered through cairo in Ruby
+    Class rb_cText = define_class("Text", rb_cShape)
+        .add_handler<Standard_Failure>(translate_oce_exception)
+        .define_method("render", &render_with_planner<plan_text>);
+    register_planner(rb_cText, plan_text);
+#endif
 
     define_global_function("_hull", &_hull);
-    define_global_function("_is_pnt2D_in_face", &_is_pnt2D_in_face);
 }
@@ -11,7 +11,11 @@ dir_config('TKPrim',   OCE_INCLUDE_DIR, OCE_LIB_DIR)
 dir_config('TKOffset', OCE_INCLUDE_DIR, OCE_LIB_DIR)
 dir_config('TKBO',     OCE_INCLUDE_DIR, OCE_LIB_DIR)
 dir_config('TKSTL',    OCE_INCLUDE_DIR, OCE_LIB_DIR)
-dir_config('qhull')
+dir_config('qhull_r')
+
+# rendering uses std::thread
+$CXXFLAGS << ' -std=c++11 -pthread'
+$LDFLAGS << ' -pthread'
 
 
 # HACK: modify compiled src so that test function can try to call main()
@@ -34,6 +38,14 @@ have_oce_lib('Prim')   or raise
 have_oce_lib('Offset') or raise
 have_oce_lib('BO')     or raise
 have_oce_lib('STL')    or raise
-fixed_have_lib('qhull') or raise
+fixed_have_lib('qhull_r') or raise
+have_library('z', 'deflate', 'zlib.h') or raise
+
+# Text is laid out natively when FreeType and fontconfig are available, and
+# through cairo in Ruby otherwise
+if pkg_config('freetype2') && pkg_config('fontconfig') &&
+   have_header('ft2build.h') && have_header('fontconfig/fontconfig.h')
+  $defs << '-DHAVE_FREETYPE'
+end
 
 create_makefile('rcad/_rcad')
@@ -4,3 +4,4 @@ require 'rcad/base'
 require 'rcad/flat_shapes'
 require 'rcad/text'
 require 'rcad/solids'
+require 'rcad/profiler'
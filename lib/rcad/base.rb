@@ -1,4 +1,6 @@
+require 'digest/sha1'
 require 'rcad/_rcad'
+require 'rcad/render_cache'
 
 
 class Numeric
@@ -31,6 +33,17 @@ end
 # global tolerance value used by C++ extension when rendering shapes
 $tol = 50.um
 
+# number of threads used to render independent parts of a shape tree.
+# nil means one per hardware thread.
+$render_threads = nil
+
+# rendered shapes, keyed by [Shape#render_key, $tol]. shapes that are
+# structurally identical are only rendered once. set to nil to disable.
+# if RCAD_CACHE_DIR is set, rendered shapes are also kept there between runs
+# (up to RCAD_CACHE_MAX_MB megabytes).
+$render_cache = RenderCache.new(ENV['RCAD_CACHE_DIR'],
+                                RenderCache.env_max_size)
+
 
 def to_polar(r, a)
   return [r * Math.cos(a), r * Math.sin(a)]
@@ -137,12 +150,39 @@ end
 class Shape
   include TransformableMixin
 
+  # instance variables that cache results rather than describe the shape
+  NON_STRUCTURAL_IVARS = [:@bbox, :@exact_bbox]
+
   # if @shape isn't defined in a Shape's initialize() method, then render()
   # should be overridden to create and return it on-the-fly.
   def render
     @shape
   end
 
+  # digest of the shape's class and parameters (including those of any
+  # shapes it's made of). shapes with equal keys render to the same thing,
+  # so the renderer can share results between them. nil if some parameter
+  # can't be described, in which case the shape is never cached.
+  #
+  # parameters can be changed after a shape is made, so keys aren't kept on
+  # the shapes. a render plan passes memo, a Hash compared by identity, so
+  # that each shape's key is only worked out once per render.
+  def render_key(memo=nil)
+    return memo[self] if memo && memo.key?(self)
+
+    key = catch(:no_render_key) do
+      ivars = (instance_variables - NON_STRUCTURAL_IVARS).sort
+      params = ivars.map do |name|
+        [name, Shape.structural_value(instance_variable_get(name), memo)]
+      end
+
+      Digest::SHA1.hexdigest([self.class.name, params].inspect)
+    end
+
+    memo[self] = key if memo
+    key
+  end
+
   def +(right)
     Union.new(self, right)
   end
@@ -186,8 +226,73 @@ class Shape
     TransformedShape.new(self, I.mirror(*args))
   end
 
+  MESH_FORMATS = {
+    ".stl" => :stl,
+    ".obj" => :obj,
+    ".ply" => :ply,
+    ".3mf" => :"3mf",
+  }
+
+  # writes the shape as a triangle mesh, in a format chosen by the file's
+  # extension. formats other than STL share vertices between triangles.
+  def write_mesh(path, &block)
+    format = MESH_FORMATS[File.extname(path).downcase]
+    if format.nil?
+      fail ArgumentError, "unknown mesh format for #{path}, " +
+        "expected one of #{MESH_FORMATS.keys.join(', ')}"
+    end
+
+    if format == :stl
+      write_stl(path, &block)
+    else
+      _write_mesh(path, format.to_s)
+    end
+  end
+
+  # reads a binary or ASCII STL file as a mesh, which Combinations handle
+  # with their mesh engine. opts:
+  # * weld_tolerance: vertices closer than this are merged (by default,
+  #   only identical ones are)
+  # * brep: if true, makes a solid with a face per triangle instead, for
+  #   operations that need one. raises OCEError if the mesh isn't closed.
+  def self.from_stl(path, opts={})
+    _from_stl(path, opts.fetch(:weld_tolerance, 0).to_f,
+              opts.fetch(:brep, false))
+  end
+
+  # [[minx, miny, minz], [maxx, maxy, maxz]]. worked out from the shape's
+  # parameters where possible, so it can be looser than the rendered shape's
+  # box (a Difference's is its first shape's, for instance). parts of the
+  # tree that can't be boxed that way (e.g. Text) are rendered on their own.
   def bbox
-    @bbox ||= _bbox
+    @bbox ||= (analytic_bbox || exact_bbox)
+  end
+
+  # the rendered shape's bbox
+  def exact_bbox
+    @exact_bbox ||= _bbox
+  end
+
+  # the bbox of what render returns, or nil if render isn't written in
+  # Ruby. natively rendered shapes override this. if render returns a
+  # rendered shape (e.g. from hull), it's stored in $render_cache, so that
+  # it isn't rendered again when the whole tree is.
+  def analytic_bbox
+    # render isn't written in Ruby, so it would render the shape
+    return nil if method(:render).source_location.nil?
+
+    # the renderer's own key for this shape
+    key = render_key if $render_cache
+    cache_key = [key, $tol.to_f] if key
+    cached = $render_cache[cache_key] if cache_key
+    return cached._bbox if cached
+
+    rendered = render
+    if cache_key && rendered.is_a?(RenderedShape)
+      $render_cache[cache_key] = rendered
+    end
+
+    Shape.analytic_bbox_of(rendered)
   end
 
   def minx
@@ -294,6 +399,76 @@ class Shape
     self.transform(at * combined.inverse)
   end
 
+  # the box of a shape that's part of another. shapes that can't be boxed
+  # from their parameters are rendered, but only them, not the whole tree.
+  def Shape.analytic_bbox_of(shape)
+    case shape
+    when Shape
+      shape.bbox
+    when RenderedShape
+      shape._bbox
+    end
+  end
+
+  def Shape.bbox_of_points(points)
+    coords = points.transpose
+    [coords.map(&:min), coords.map(&:max)]
+  end
+
+  def Shape.transform_bbox(bbox, trsf)
+    mat = trsf.mat_part
+    ofs = trsf.ofs_part
+
+    corners = bbox[0].zip(bbox[1]).reduce([[]]) do |partial, range|
+      partial.product(range.uniq).map { |p, c| p + [c] }
+    end
+
+    bbox_of_points(corners.map do |p|
+      (0..2).map do |i|
+        mat[i][0] * p[0] + mat[i][1] * p[1] + mat[i][2] * p[2] + ofs[i]
+      end
+    end)
+  end
+
+  # the points in the plane that bound [u, v] points turned from u towards v
+  # by 0 to angle (nil for a whole turn): each point at both ends, and
+  # wherever it crosses an axis in between
+  def Shape.swept_extremes(points, angle=nil)
+    angle = angle.nil? ? 2 * Math::PI : [[angle, 0].max, 2 * Math::PI].min
+
+    points.flat_map do |u, v|
+      r = Math.hypot(u, v)
+      start = Math.atan2(v, u)
+      ends = [0, angle].map do |a|
+        [r * Math.cos(start + a), r * Math.sin(start + a)]
+      end
+
+      crossed = [[r, 0], [0, r], [-r, 0], [0, -r]].select.with_index do |_, i|
+        (i * Math::PI / 2 - start) % (2 * Math::PI) <= angle
+      end
+      ends + crossed
+    end
+  end
+
+  def Shape.structural_value(value, memo=nil)
+    case value
+    when Shape
+      value.render_key(memo) or throw :no_render_key
+    when Transform
+      [value.mat_part, value.ofs_part]
+    when Array
+      value.map { |v| structural_value(v, memo) }
+    when Hash
+      value.map do |k, v|
+        [structural_value(k, memo), structural_value(v, memo)]
+      end
+    when Numeric, String, Symbol, true, false, nil
+      value
+    else
+      throw :no_render_key
+    end
+  end
+
   protected
 
   def magic_shape_params(args, *expected)
@@ -329,6 +504,38 @@ class Shape
       end
     end
   end
+
+  # Numo arrays of dim-coordinate points become Strings of packed doubles,
+  # which the renderer reads without converting each point. other values
+  # are left as they are.
+  def pack_points(points, dim)
+    return points unless defined?(Numo::NArray) and points.is_a? Numo::NArray
+
+    points = Numo::DFloat.cast(points)
+    if points.ndim != 2 or points.shape[1] != dim
+      fail ArgumentError, "expected an array of #{dim}-coordinate points, " +
+        "got shape #{points.shape.inspect}"
+    end
+
+    points.to_binary
+  end
+
+  # 2-dimensional Numo arrays of point indices, one path per row, become
+  # Strings of packed int32s, with each path's length before its indices.
+  # other values are left as they are.
+  def pack_paths(paths)
+    return paths unless defined?(Numo::NArray) and paths.is_a? Numo::NArray
+
+    paths = Numo::Int32.cast(paths)
+    if paths.ndim != 2
+      fail ArgumentError, "expected one path per row, " +
+        "got shape #{paths.shape.inspect}"
+    end
+
+    rows, length = paths.shape
+    Numo::Int32.new(rows, 1).fill(length).concatenate(paths, axis: 1)
+      .to_binary
+  end
 end
 
 $shape_stack = []
@@ -347,16 +554,25 @@ def _shape_mode_block(mode, &block)
   res
 end
 
-def add(&block)
-  _shape_mode_block(:+, &block)
+# opts are passed on to the resulting Combination, e.g. sub(engine: :mesh)
+def add(opts={}, &block)
+  _with_combination_opts(_shape_mode_block(:+, &block), opts)
 end
 
-def sub(&block)
-  _shape_mode_block(:-, &block)
+def sub(opts={}, &block)
+  _with_combination_opts(_shape_mode_block(:-, &block), opts)
 end
 
-def mul(&block)
-  _shape_mode_block(:*, &block)
+def mul(opts={}, &block)
+  _with_combination_opts(_shape_mode_block(:*, &block), opts)
+end
+
+def _with_combination_opts(shape, opts)
+  if opts.key?(:engine) and shape.is_a? Combination
+    shape.with_engine(opts[:engine])
+  else
+    shape
+  end
 end
 
 def hull(&block)
@@ -371,9 +587,16 @@ def hull(&block)
   res
 end
 
-def write_stl(*args)
+# if given a block, calls it with (faces written, total faces) as the file
+# is written
+def write_stl(*args, &block)
+  $shape != nil or raise
+  $shape.write_stl(*args, &block)
+end
+
+def write_mesh(*args, &block)
   $shape != nil or raise
-  $shape.write_stl(*args)
+  $shape.write_mesh(*args, &block)
 end
 
 def clear_shape
@@ -401,6 +624,11 @@ class TransformedShape < Shape
     sprintf("%s*%s", @trsf, @shape)
   end
 
+  def analytic_bbox
+    bbox = Shape.analytic_bbox_of(@shape)
+    bbox && Shape.transform_bbox(bbox, @trsf)
+  end
+
   def transform(trsf)
     TransformedShape.new(@shape, trsf * @trsf)
   end
@@ -423,6 +651,169 @@ class TransformedShape < Shape
 end
 
 
+# render methods of Combination's subclasses are defined in the C++
+# extension. each renders all of its shapes with a single boolean operation.
+#
+# engine: picks how: :brep runs OCE's booleans, and :mesh runs booleans on
+# triangle meshes, which is much faster for meshes with many triangles (like
+# those from Shape.from_stl) and gives a mesh. :auto (the default) uses :mesh
+# if any of the shapes renders to a mesh.
+class Combination < Shape
+  ENGINES = [:auto, :brep, :mesh]
+
+  attr_reader :shapes
+
+  def initialize(*shapes)
+    opts = shapes.last.is_a?(Hash) ? shapes.pop : {}
+    if shapes.size < 2
+      fail ArgumentError, "#{self.class} needs at least 2 shapes"
+    end
+
+    engine = opts.fetch(:engine, :auto)
+    if !ENGINES.include?(engine)
+      fail ArgumentError, "unknown boolean engine #{engine.inspect}, " +
+        "expected one of #{ENGINES.map(&:inspect).join(', ')}"
+    end
+
+    @shapes = shapes
+    # left unset for :auto, so that existing shapes keep their render keys
+    @engine = engine if engine != :auto
+  end
+
+  def engine
+    @engine || :auto
+  end
+
+  def with_engine(engine)
+    self.class.new(*shapes, engine: engine)
+  end
+end
+
+# the operators below extend an existing combination instead of nesting it,
+# so that e.g. ~ing many holes in a sub block gives one Difference with many
+# tools, rather than a long chain of Differences.
+
+class Union < Combination
+  def +(right)
+    Union.new(*shapes, right, engine: engine)
+  end
+
+  def analytic_bbox
+    boxes = shapes.map { |shape| Shape.analytic_bbox_of(shape) }
+    return nil if boxes.include?(nil)
+
+    Shape.bbox_of_points(boxes.flatten(1))
+  end
+end
+
+class Difference < Combination
+  # (a - b) - c == a - (b + c)
+  def -(right)
+    Difference.new(*shapes, right, engine: engine)
+  end
+
+  def analytic_bbox
+    Shape.analytic_bbox_of(shapes[0])
+  end
+end
+
+class Intersection < Combination
+  def *(right)
+    Intersection.new(*shapes, right, engine: engine)
+  end
+
+  # the overlap of its shapes' boxes. if they don't overlap, the shape is
+  # rendered, which fails since it's empty.
+  def analytic_bbox
+    boxes = shapes.map { |shape| Shape.analytic_bbox_of(shape) }.compact
+    return nil if boxes.empty?
+
+    lo = boxes.map(&:first).transpose.map(&:max)
+    hi = boxes.map(&:last).transpose.map(&:min)
+    return nil if lo.zip(hi).any? { |l, h| l > h }
+
+    [lo, hi]
+  end
+end
+
+
+# copies of a shape, fused together. the shape is rendered only once, and
+# the copies share its geometry. render is defined in the C++ extension;
+# subclasses define transforms, which places each copy.
+class Pattern < Shape
+  attr_reader :shape, :count
+
+  def initialize(shape, count)
+    if count < 1
+      fail ArgumentError, "#{self.class} needs at least 1 copy"
+    end
+
+    @shape = shape
+    @count = count
+  end
+
+  def analytic_bbox
+    bbox = Shape.analytic_bbox_of(shape)
+    return nil if bbox.nil?
+
+    boxes = transforms.map { |trsf| Shape.transform_bbox(bbox, trsf) }
+    Shape.bbox_of_points(boxes.flatten(1))
+  end
+end
+
+# count copies, each moved by step ([x, y, z]) from the previous one
+class LinearArray < Pattern
+  attr_reader :step
+
+  def initialize(shape, count, step)
+    super(shape, count)
+    @step = step
+  end
+
+  def transforms
+    (0...count).map { |i| I.move(*step.map { |c| c * i }) }
+  end
+end
+
+# count copies, rotated around axis, and spread evenly over angle. if angle
+# is a full turn, the last copy isn't placed on top of the first one.
+class PolarArray < Pattern
+  attr_reader :angle, :axis
+
+  def initialize(shape, count, angle=2 * Math::PI, axis=[0, 0, 1])
+    super(shape, count)
+    @angle = angle
+    @axis = axis
+  end
+
+  def transforms
+    full_turn = ((angle.abs - 2 * Math::PI).abs < 1e-9)
+    step_angle =
+      if full_turn
+        angle / count
+      elsif count > 1
+        angle / (count - 1)
+      else
+        0
+      end
+
+    (0...count).map { |i| I.rotate(step_angle * i, axis) }
+  end
+end
+
+# pattern(shape, count, x: 10) makes a LinearArray, moving each copy 10mm
+# along the x axis. pattern(shape, count, angle: 90.deg_to_rad, axis: [...])
+# makes a PolarArray (angle defaults to a full turn, and axis to z).
+def pattern(shape, count, opts={})
+  if opts.key?(:angle) || opts.key?(:axis)
+    PolarArray.new(shape, count,
+                   opts.fetch(:angle, 2 * Math::PI), opts.fetch(:axis, [0, 0, 1]))
+  else
+    LinearArray.new(shape, count, [opts[:x] || 0, opts[:y] || 0, opts[:z] || 0])
+  end
+end
+
+
 def make_maker(name, klass)
   Object.send(:define_method, name, &klass.method(:new))
 end
@@ -2,12 +2,45 @@ require 'rcad/_rcad'
 require 'rcad/base'
 
 
+# points are [x, y] pairs, or a String of packed native-endian doubles (as
+# from pack('d*')), or a Numo array with one point per row. paths are Arrays
+# of point indices, or a String of packed int32s (as from pack('l*')) with
+# each path's length before its indices, or a Numo array with one path per
+# row. the first path is the outline, and any others are holes.
 class Polygon < Shape
   attr_reader :points, :paths
 
   def initialize(points, paths=nil)
-    @points = points
-    @paths = paths || [(0...points.size).to_a]
+    @points = pack_points(points, 2)
+    @paths = pack_paths(paths) || default_paths
+  end
+
+  # holes are inside the outline, so only its points count
+  def analytic_bbox
+    outline =
+      if @paths.is_a? String
+        @paths.unpack("x4l#{@paths.unpack('l')[0]}")
+      else
+        @paths[0]
+      end
+
+    coords = @points.is_a?(String) ? @points.unpack('d*').each_slice(2).to_a
+                                   : @points
+    points = outline.map { |i| coords[i] }
+    return nil if points.empty? || points.include?(nil)
+
+    Shape.bbox_of_points(points.map { |x, y| [x, y, 0] })
+  end
+
+  private
+
+  def default_paths
+    if @points.is_a? String
+      count = @points.bytesize / (2 * 8)
+      [count, *(0...count)].pack('l*')
+    else
+      [(0...@points.size).to_a]
+    end
   end
 end
 
@@ -55,6 +88,11 @@ class Circle < Shape
   def initialize(*args)
     @dia, = magic_shape_params(args, :d)
   end
+
+  def analytic_bbox
+    r = dia / 2.0
+    [[-r, -r, 0], [r, r, 0]]
+  end
 end
 
 
@@ -0,0 +1,135 @@
+require 'json'
+require 'rcad/_rcad'
+
+
+# Records where rendering time goes. While it's running, rendering each
+# Shape node is recorded under the path of classes leading to it from the
+# shape being rendered (e.g. "Union;Difference;Cylinder"), as are the
+# booleans, sweeps, meshing, hulls, STL imports and exports within them.
+#
+#   Profiler.profile { write_stl("out.stl") }
+#   Profiler.write("out")  # writes out.txt, out.trace.json and out.folded
+class Profiler
+  # times are in microseconds. memory_delta is the change in the whole
+  # process's resident memory, in bytes. faces and edges are the result's,
+  # or -1 if the scope has no result.
+  Event = Struct.new(:path, :category, :thread, :start, :wall, :self_wall,
+                     :cpu, :memory_delta, :faces, :edges)
+
+  # starts recording, forgetting anything recorded before
+  def self.start
+    _start
+  end
+
+  def self.stop
+    _stop
+  end
+
+  def self.profile
+    start
+    yield
+  ensure
+    stop
+  end
+
+  def self.events
+    _events.map { |event| Event.new(*event) }
+  end
+
+  # an indented tree of paths. total is the time spent in a path and
+  # everything below it, and self excludes the paths below it.
+  def self.tree_report
+    nodes = Hash.new do |hash, path|
+      hash[path] = { calls: 0, self_wall: 0.0, cpu: 0.0, memory_delta: 0,
+                     faces: -1, edges: -1, children: [] }
+    end
+
+    events.each do |event|
+      node = nodes[event.path]
+      node[:calls] += 1
+      node[:self_wall] += event.self_wall
+      node[:cpu] += event.cpu
+      node[:memory_delta] += event.memory_delta
+      node[:faces] = event.faces if event.faces >= 0
+      node[:edges] = event.edges if event.edges >= 0
+    end
+
+    # paths whose only events are below them, like a gear's shape tree
+    nodes.keys.each do |path|
+      parts = path.split(";")
+      (1...parts.size).each { |n| nodes[parts.take(n).join(";")] }
+    end
+
+    roots = []
+    nodes.each do |path, node|
+      parent = path.rpartition(";").first
+      (parent.empty? ? roots : nodes[parent][:children]) << path
+    end
+
+    totals = {}
+    total_of = lambda do |path|
+      totals[path] ||= nodes[path][:self_wall] +
+        nodes[path][:children].map { |child| total_of.(child) }.reduce(0, :+)
+    end
+
+    lines = [format("%10s %10s %10s %6s %8s %8s %10s  %s", "total ms",
+                    "self ms", "cpu ms", "calls", "faces", "edges",
+                    "mem KB", "path")]
+    print_node = lambda do |path, depth|
+      node = nodes[path]
+      lines << format("%10.1f %10.1f %10.1f %6d %8s %8s %10d  %s%s",
+                      total_of.(path) / 1000.0, node[:self_wall] / 1000.0,
+                      node[:cpu] / 1000.0, node[:calls],
+                      node[:faces] < 0 ? "" : node[:faces],
+                      node[:edges] < 0 ? "" : node[:edges],
+                      node[:memory_delta] / 1024, "  " * depth,
+                      path.split(";").last)
+
+      node[:children].sort_by { |child| -total_of.(child) }
+        .each { |child| print_node.(child, depth + 1) }
+    end
+
+    roots.sort_by { |path| -total_of.(path) }
+      .each { |path| print_node.(path, 0) }
+    lines.join("\n") + "\n"
+  end
+
+  # for chrome://tracing or Perfetto, with a row per thread
+  def self.chrome_trace
+    trace_events = events.map do |event|
+      {
+        name: event.path.split(";").last,
+        cat: event.category,
+        ph: "X",
+        ts: event.start,
+        dur: event.wall,
+        pid: Process.pid,
+        tid: event.thread,
+        args: {
+          path: event.path,
+          cpu_ms: event.cpu / 1000.0,
+          memory_delta: event.memory_delta,
+          faces: event.faces,
+          edges: event.edges,
+        },
+      }
+    end
+
+    JSON.generate(traceEvents: trace_events, displayTimeUnit: "ms")
+  end
+
+  # "path self_microseconds" lines, as flamegraph.pl and speedscope take
+  def self.folded_stacks
+    self_times = Hash.new(0)
+    events.each { |event| self_times[event.path] += event.self_wall }
+
+    self_times.select { |_, time| time >= 1 }
+      .map { |path, time| "#{path} #{time.round}\n" }.join
+  end
+
+  def self.write(prefix)
+    File.write(prefix + ".txt", tree_report)
+    File.write(prefix + ".trace.json", chrome_trace)
+    File.write(prefix + ".folded", folded_stacks)
+  end
+end
@@ -0,0 +1,135 @@
+require 'digest/sha1'
+require 'fileutils'
+require 'rcad/version'
+require 'rcad/_rcad'
+
+
+# Cache of rendered shapes, used as $render_cache. Always keeps shapes in
+# memory; if given a directory, also stores them there as BREP files, so
+# that unchanged subtrees are loaded instead of re-rendered by later runs.
+#
+# Files are named by a digest of their key, so several processes can share
+# a directory. When the directory grows beyond max_size bytes, the least
+# recently used files are deleted.
+#
+# Files are only loaded by the same rcad version and build of the extension
+# that wrote them. Keys describe a shape by its class and parameters, not by
+# the code that renders it, so after changing a Shape's render method,
+# delete the directory to have its shapes rendered again.
+class RenderCache
+  DEFAULT_MAX_SIZE = 1024 * 1024 * 1024
+
+  # identifies the code that rendered a file: the rcad version, and the
+  # size and modification time of the compiled extension
+  def RenderCache.build_id
+    ext = $LOADED_FEATURES.find { |path| File.basename(path, ".*") == "_rcad" }
+    stat = File.stat(ext) if ext
+    [Rcad::VERSION, stat && [stat.size, stat.mtime.to_i]]
+  rescue SystemCallError
+    [Rcad::VERSION, nil]
+  end
+
+  BUILD_ID = build_id
+
+  # the size limit set by RCAD_CACHE_MAX_MB, in bytes
+  def RenderCache.env_max_size
+    mb = ENV['RCAD_CACHE_MAX_MB']
+    mb ? mb.to_i * 1024 * 1024 : DEFAULT_MAX_SIZE
+  end
+
+  attr_reader :dir, :max_size
+
+  def initialize(dir=nil, max_size=DEFAULT_MAX_SIZE)
+    @shapes = {}
+    @dir = dir
+    @max_size = max_size
+
+    if @dir
+      FileUtils.mkdir_p(@dir)
+      @dir_size = dir_entries.map { |path| File.size(path) }.reduce(0, :+)
+    end
+  end
+
+  def [](key)
+    @shapes.fetch(key) do
+      return nil unless @dir
+
+      path = path_for(key)
+      begin
+        shape = RenderedShape._read_brep(path)
+      rescue OCEError
+        # missing, or left over from a process that crashed mid-write.
+        # either way, it'll be re-rendered and overwritten
+        return nil
+      end
+
+      # mark as recently used
+      File.utime(nil, nil, path) rescue nil
+
+      @shapes[key] = shape
+    end
+  end
+
+  def []=(key, shape)
+    @shapes[key] = shape
+    store(key, shape) if @dir
+  end
+
+  # forget shapes kept in memory. files in the cache directory are kept.
+  def clear
+    @shapes.clear
+  end
+
+  private
+
+  def path_for(key)
+    File.join(@dir, Digest::SHA1.hexdigest([BUILD_ID, key].inspect) + ".brep")
+  end
+
+  def dir_entries
+    Dir.glob(File.join(@dir, "*.brep"))
+  end
+
+  def store(key, shape)
+    path = path_for(key)
+    return if File.exist?(path)
+
+    # write to a temporary name first, so other processes never see a
+    # partially written file. threads storing the same key each get their
+    # own name.
+    tmp_path = sprintf("%s.%d.%d.tmp", path, Process.pid,
+                       Thread.current.object_id)
+    shape._write_brep(tmp_path)
+    File.rename(tmp_path, path)
+
+    @dir_size += File.size(path)
+    evict if @dir_size > @max_size
+  end
+
+  def evict
+    # other processes may have added or removed files, so start over from
+    # what's actually there
+    entries = dir_entries.map do |path|
+      begin
+        [path, File.mtime(path), File.size(path)]
+      rescue Errno::ENOENT
+        nil
+      end
+    end.compact
+
+    @dir_size = entries.map { |_, _, size| size }.reduce(0, :+)
+
+    # delete down to 90% of the limit, so we don't evict on every store
+    target_size = @max_size * 0.9
+    entries.sort_by { |_, mtime, _| mtime }.each do |path, _, size|
+      break if @dir_size <= target_size
+
+      begin
+        File.delete(path)
+      rescue Errno::ENOENT
+      end
+
+      @dir_size -= size
+    end
+  end
+end
@@ -22,6 +22,10 @@ class Box < Shape
     @ysize = ysize
     @zsize = zsize
   end
+
+  def analytic_bbox
+    [[0, 0, 0], [xsize, ysize, zsize]]
+  end
 end
 
 class Cube < Box
@@ -47,6 +51,11 @@ class Cone < Shape
   def top_radius
     top_dia / 2.0
   end
+
+  def analytic_bbox
+    r = [bottom_radius, top_radius].max
+    [[-r, -r, 0], [r, r, height]]
+  end
 end
 
 
@@ -60,6 +69,10 @@ class Cylinder < Shape
   def radius
     dia / 2.0
   end
+
+  def analytic_bbox
+    [[-radius, -radius, 0], [radius, radius, height]]
+  end
 end
 
 
@@ -73,15 +86,29 @@ class Sphere < Shape
   def radius
     dia / 2.0
   end
+
+  def analytic_bbox
+    [[-radius] * 3, [radius] * 3]
+  end
 end
 
 
+# takes [x, y, z] points and faces of point indices, either as Arrays or
+# packed like Polygon's points and paths. each face must be planar, and the
+# faces must enclose a volume: every edge has to be shared by exactly two
+# faces. coincident points are merged.
 class Polyhedron < Shape
   attr_accessor :points, :faces
 
   def initialize(points, faces)
-    @points = points
-    @faces = faces
+    @points = pack_points(points, 3)
+    @faces = pack_paths(faces)
+  end
+
+  def analytic_bbox
+    coords = @points.is_a?(String) ? @points.unpack('d*').each_slice(3).to_a
+                                   : @points
+    Shape.bbox_of_points(coords) unless coords.empty?
   end
 end
 
@@ -101,6 +128,16 @@ class Torus < Shape
   def outer_radius
     outer_dia / 2.0
   end
+
+  # inner_radius is the distance from the center to the middle of the tube,
+  # and outer_radius the tube's radius. partial tori start on the x axis and
+  # turn towards y.
+  def analytic_bbox
+    radii = [inner_radius - outer_radius, inner_radius + outer_radius]
+    lo, hi = Shape.bbox_of_points(
+      Shape.swept_extremes(radii.map { |r| [r, 0] }, angle))
+    [[lo[0], lo[1], -outer_radius], [hi[0], hi[1], outer_radius]]
+  end
 end
 
 
@@ -112,6 +149,24 @@ class LinearExtrusion < Shape
     @height = height
     @twist = twist
   end
+
+  # a twisted extrusion stays within the circle around the z axis through
+  # the profile's farthest corner
+  def analytic_bbox
+    bbox = Shape.analytic_bbox_of(profile)
+    return nil if bbox.nil?
+
+    lo, hi = bbox
+    zmin = lo[2] + [0, height].min
+    zmax = hi[2] + [0, height].max
+    if @twist == 0
+      return [[lo[0], lo[1], zmin], [hi[0], hi[1], zmax]]
+    end
+
+    r = [lo[0], hi[0]].product([lo[1], hi[1]])
+      .map { |x, y| Math.hypot(x, y) }.max
+    [[-r, -r, zmin], [r, r, zmax]]
+  end
 end
 
 
@@ -122,6 +177,17 @@ class Revolution < Shape
     @profile = profile
     @angle = angle
   end
+
+  # the profile is swept around the y axis, turning x towards z
+  def analytic_bbox
+    bbox = Shape.analytic_bbox_of(profile)
+    return nil if bbox.nil?
+
+    lo, hi = bbox
+    corners = [lo[0], hi[0]].product([lo[2], hi[2]])
+    xz_lo, xz_hi = Shape.bbox_of_points(Shape.swept_extremes(corners, angle))
+    [[xz_lo[0], lo[1], xz_lo[1]], [xz_hi[0], hi[1], xz_hi[1]]]
+  end
 end
 
 
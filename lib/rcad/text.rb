@@ -1,8 +1,9 @@
-require 'set'
 require 'rcad/_rcad'
 require 'rcad/base'
-require 'cairo'
 
+# when the extension is built with FreeType and fontconfig, it defines
+# Text#render, which reads glyph outlines directly. otherwise, text is laid
+# out here, through cairo.
 class Text < Shape
   attr_reader :text, :font_name, :font_size, :bold, :italic
 
@@ -14,10 +15,17 @@ class Text < Shape
     @italic = opts[:italic] || false;
   end
 
-  def render
-    path = make_path
-    wap = Text.path_to_wires_and_pts(path)
-    return RenderedShape._new_compound(Text.group_wires_into_faces(wap))
+  unless instance_methods(false).include?(:render)
+    def render
+      path = make_path
+      wap = Text.path_to_wires_and_pts(path)
+      return RenderedShape._new_compound(Text.group_wires_into_faces(wap))
+    end
+  end
+
+  # glyph outlines aren't known until the text is rendered
+  def analytic_bbox
+    nil
   end
 
   def slant
@@ -32,27 +40,29 @@ class Text < Shape
   private
 
   def make_path
-    # actually, we want an in-memory surface, but it seems ruby-cairo
-    # doesn't support that right now
-    tmp_filename = 'tmp.svg'
-
-    begin
-      Cairo::SVGSurface.new(tmp_filename, 1024, 1024) do |surf|
-        Cairo::Context.new(surf) do |ctx|
-          ctx.select_font_face(font_name, slant, weight)
-          ctx.set_font_size(font_size)
-
-          ctx.new_path()
-          ctx.text_path(text)
-          # invert y direction, to match coordinates used for 3D
-          ctx.scale(1, -1)
-
-          return ctx.copy_path()
-        end
-      end
-    ensure
-      File.delete(tmp_filename)
+    require 'cairo'
+
+    # only the path is used, so a tiny in-memory surface will do. hinting
+    # is turned off so that glyphs aren't snapped to its pixels.
+    surf = Cairo::ImageSurface.new(Cairo::FORMAT_A8, 1, 1)
+    Cairo::Context.new(surf) do |ctx|
+      options = Cairo::FontOptions.new
+      options.hint_style = Cairo::HINT_STYLE_NONE
+      options.hint_metrics = Cairo::HINT_METRICS_OFF
+      ctx.font_options = options
+
+      ctx.select_font_face(font_name, slant, weight)
+      ctx.set_font_size(font_size)
+
+      ctx.new_path()
+      ctx.text_path(text.to_s)
+      # invert y direction, to match coordinates used for 3D
+      ctx.scale(1, -1)
+
+      return ctx.copy_path()
     end
+  ensure
+    surf.finish if surf
   end
 
   def Text.path_to_wires_and_pts(path)
@@ -101,51 +111,30 @@ class Text < Shape
     wires_and_pts
   end
 
-  # wires must be non-intersecting (I expect cairo text paths to be fine)
+  # wires must be non-intersecting (I expect cairo text paths to be fine).
+  # wires nested an even number of levels deep are outer wires of faces,
+  # and the wires directly inside them are their holes.
   def Text.group_wires_into_faces(wires_and_pts)
-    # for each wire, set of wires it contains
-    graph_a_contains_bs = Hash[
-      wires_and_pts.map do |w,_|
-        f = RenderedShape._new_face([w])
-
-        contained = wires_and_pts
-          .select {|_,p| _is_pnt2D_in_face(p, f)}
-          .map {|w,p| w}
-
-        [w, Set.new(contained)]
-      end]
-
-    # build direct graph and set of root wires not contained in any other wre
-    graph_a_directly_contains_bs = {}
-    root_wires = Set.new(wires_and_pts.map {|w,_| w})
-
-    graph_a_contains_bs.each_pair do |a,bs|
-        direct_bs = bs.dup
-        bs.each {|b| direct_bs.subtract(graph_a_contains_bs[b])}
-        graph_a_directly_contains_bs[a] = direct_bs if !direct_bs.empty?
-
-        root_wires.subtract(direct_bs)
+    wires = wires_and_pts.map { |w,_| w }
+    parents = RenderedShape._nest_wires(wires, wires_and_pts.map { |_,p| p })
+
+    depths = parents.map do |parent|
+      depth = 0
+      while parent
+        depth += 1
+        parent = parents[parent]
       end
-
-    root_wires.map do |root|
-      RenderedShape._new_face(Text.oriented_wires(
-        root, graph_a_directly_contains_bs))
+      depth
     end
-  end
 
-  # gets all children of root, with wire orientation alternating between
-  # parents and childs
-  def Text.oriented_wires(root, graph, reverse=false)
-    ret = [reverse ? root._reversed  : root]
-
-    children = graph[root]
-    if children
-      children.each do |child_wire|
-        ret.concat(Text.oriented_wires(child_wire, graph, !reverse))
-      end
+    holes = Hash.new { |hash, parent| hash[parent] = [] }
+    parents.each_with_index do |parent, i|
+      holes[parent] << wires[i]._reversed if depths[i].odd?
     end
 
-    ret
+    wires.each_index.select { |i| depths[i].even? }.map do |i|
+      RenderedShape._new_face([wires[i]] + holes[i])
+    end
   end
 end
 